@@ -0,0 +1,113 @@
+#version 330 core
+
+// Checkerboard resolve: rt.frag traced only the pixels with (x + y) % 2 == parity this frame,
+// packed into a half width texture. The other half is reprojected from the previous resolved frame
+// and clamped to its traced neighbours, or interpolated from them when the history doesn't cover it.
+
+struct rt_scene {
+	vec4 quat_camera_rotation;
+	vec3 camera_pos;
+	vec3 bg_color;
+
+	int canvas_width;
+	int canvas_height;
+
+	int reflect_depth;
+};
+
+layout( std140 ) uniform scene_buf
+{
+    rt_scene scene;
+};
+
+layout (location = 0) out vec4 History; // color + primary hit distance, read back next frame
+layout (location = 1) out vec4 FragColor;
+
+uniform sampler2D trace_tex; // rgb + primary hit distance, 0 - ray missed everything
+uniform sampler2D history_tex;
+uniform int parity;
+uniform bool history_valid;
+// camera the previous frame was traced from
+uniform vec4 prev_camera_rotation;
+uniform vec3 prev_camera_pos;
+
+vec4 quat_conj(vec4 q)
+{
+  	return vec4(-q.x, -q.y, -q.z, q.w);
+}
+
+vec4 quat_inv(vec4 q)
+{
+  	return quat_conj(q) * (1 / dot(q, q));
+}
+
+vec4 quat_mult(vec4 q1, vec4 q2)
+{
+	vec4 qr;
+	qr.x = (q1.w * q2.x) + (q1.x * q2.w) + (q1.y * q2.z) - (q1.z * q2.y);
+	qr.y = (q1.w * q2.y) - (q1.x * q2.z) + (q1.y * q2.w) + (q1.z * q2.x);
+	qr.z = (q1.w * q2.z) + (q1.x * q2.y) - (q1.y * q2.x) + (q1.z * q2.w);
+	qr.w = (q1.w * q2.w) - (q1.x * q2.x) - (q1.y * q2.y) - (q1.z * q2.z);
+	return qr;
+}
+
+vec3 rotate(vec4 qr, vec3 v)
+{
+	vec4 qr_conj = quat_conj(qr);
+	vec4 q_pos = vec4(v.xyz, 0);
+	vec4 q_tmp = quat_mult(qr, q_pos);
+	return quat_mult(q_tmp, qr_conj).xyz;
+}
+
+vec4 traced(ivec2 pixel)
+{
+	return texelFetch(trace_tex, ivec2(pixel.x / 2, pixel.y), 0);
+}
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	if (((pixel.x + pixel.y) & 1) == parity)
+	{
+		vec4 value = traced(pixel);
+		History = value;
+		FragColor = vec4(value.rgb, 1);
+		return;
+	}
+
+	// direct neighbours were all traced this frame, at the borders the mirrored one is taken instead
+	ivec2 size = textureSize(history_tex, 0);
+	vec4 left = traced(ivec2(pixel.x > 0 ? pixel.x - 1 : pixel.x + 1, pixel.y));
+	vec4 right = traced(ivec2(pixel.x + 1 < size.x ? pixel.x + 1 : pixel.x - 1, pixel.y));
+	vec4 down = traced(ivec2(pixel.x, pixel.y > 0 ? pixel.y - 1 : pixel.y + 1));
+	vec4 up = traced(ivec2(pixel.x, pixel.y + 1 < size.y ? pixel.y + 1 : pixel.y - 1));
+
+	vec3 minColor = min(min(left.rgb, right.rgb), min(down.rgb, up.rgb));
+	vec3 maxColor = max(max(left.rgb, right.rgb), max(down.rgb, up.rgb));
+	vec4 result = vec4((left.rgb + right.rgb + down.rgb + up.rgb) * 0.25, 0);
+
+	// the closest neighbour keeps foreground edges in place, 0 - all of them see the sky
+	vec4 dists = vec4(left.a, right.a, down.a, up.a);
+	vec4 hits = mix(vec4(3.402823466e+38), dists, greaterThan(dists, vec4(0)));
+	float dist = min(min(hits.x, hits.y), min(hits.z, hits.w));
+	dist = dist < 3.402823466e+38 ? dist : 0;
+	result.a = dist;
+
+	if (history_valid)
+	{
+		// same ray as rt.frag getRayDir, the sky only depends on its direction
+		vec2 canvas = vec2(scene.canvas_width, scene.canvas_height);
+		vec3 rd = normalize(rotate(scene.quat_camera_rotation, vec3((vec2(pixel) + 0.5 - canvas / 2) / canvas.y, 1)));
+		vec3 target = dist > 0 ? scene.camera_pos + rd * dist - prev_camera_pos : rd;
+		vec3 prev = rotate(quat_inv(prev_camera_rotation), target);
+		if (prev.z > 0)
+		{
+			vec2 prevPixel = prev.xy / prev.z * canvas.y + canvas / 2;
+			if (all(greaterThanEqual(prevPixel, vec2(0))) && all(lessThan(prevPixel, vec2(size))))
+				result.rgb = clamp(texture(history_tex, prevPixel / vec2(size)).rgb, minColor, maxColor);
+		}
+	}
+
+	History = result;
+	FragColor = vec4(result.rgb, 1);
+}
@@ -11,6 +11,7 @@
 #define TYPE_TORUS 4
 #define TYPE_RING 5
 #define TYPE_POINT_LIGHT 6
+#define TYPE_INSTANCE 7
 
 #define SHADOW_ENABLED 1
 #define DBG 0
@@ -20,6 +21,25 @@
 #define DO_FRESNEL 1
 #define PLANE_ONESIDE 1
 #define REFLECT_REDUCE_ITERATION 1
+#define TORUS_ANALYTIC 1 // 0 - iterative Durand-Kerner solver, kept as the reference to validate against
+
+// What the scene contains, bits of rt_feature in scene.h. GLWrapper::init_shaders defines SCENE_FEATURES
+// for the scene it is given, code for object kinds, textures and material paths the scene doesn't use is left out
+#ifndef SCENE_FEATURES
+#define SCENE_FEATURES 0xfff
+#endif
+#define HAS_SPHERES ((SCENE_FEATURES & 0x001) != 0)
+#define HAS_PLANES ((SCENE_FEATURES & 0x002) != 0)
+#define HAS_SURFACES ((SCENE_FEATURES & 0x004) != 0)
+#define HAS_BOXES ((SCENE_FEATURES & 0x008) != 0)
+#define HAS_TORUSES ((SCENE_FEATURES & 0x010) != 0)
+#define HAS_RINGS ((SCENE_FEATURES & 0x020) != 0)
+#define HAS_INSTANCES ((SCENE_FEATURES & 0x040) != 0)
+#define HAS_POINT_LIGHTS ((SCENE_FEATURES & 0x080) != 0)
+#define HAS_DIRECT_LIGHTS ((SCENE_FEATURES & 0x100) != 0)
+#define HAS_TEXTURES ((SCENE_FEATURES & 0x200) != 0)
+#define HAS_REFLECTION ((SCENE_FEATURES & 0x400) != 0)
+#define HAS_REFRACTION ((SCENE_FEATURES & 0x800) != 0)
 
 struct rt_material {
 	vec3 color;
@@ -33,8 +53,9 @@ struct rt_material {
 	float ks;
 };
 
+// primitives refer to their material by index, it is fetched in get_hit_info only
 struct rt_sphere {
-	rt_material mat;
+	int material;
 	vec4 obj;
 	vec4 quat_rotation; // rotate normal
 	int textureNum;
@@ -42,22 +63,22 @@ struct rt_sphere {
 };
 
 struct rt_plane {
-	rt_material mat;
+	int material;
 	vec3 pos;
 	vec3 normal;
 };
 
 struct rt_box {
-	rt_material mat;
-	vec4 quat_rotation;
+	int material;
+	mat3 rotation;
 	vec3 pos;
 	vec3 form;
 	int textureNum;
 };
 
 struct rt_ring {
-	rt_material mat;
-	vec4 quat_rotation;
+	int material;
+	mat3 rotation;
 	vec3 pos;
 	int textureNum;
 	float r1; // square of min radius
@@ -65,8 +86,8 @@ struct rt_ring {
 };
 
 struct rt_surface {
-	rt_material mat;
-	vec4 quat_rotation;
+	int material;
+	mat3 rotation;
 	vec3 v_min;
 	vec3 v_max;
 	vec3 pos;
@@ -79,12 +100,28 @@ struct rt_surface {
 };
 
 struct rt_torus {
-	rt_material mat;
-	vec4 quat_rotation;
+	int material;
+	mat3 rotation;
 	vec3 pos;
 	vec2 form; // x - radius, y - ring thickness
 };
 
+// shape shared by instances, type is TYPE_SPHERE, TYPE_BOX or TYPE_TORUS
+struct rt_prototype {
+	vec4 form; // sphere: x - radius, box: xyz - half size, torus: x - radius, y - ring thickness
+	int type;
+	int textureNum;
+	float radius; // bounding sphere
+};
+
+struct rt_instance {
+	mat3 rotation;
+	vec3 pos;
+	float scale;
+	int prototype;
+	int material;
+};
+
 struct rt_light_direct {
 	vec3 direction;
 	vec3 color;
@@ -119,28 +156,96 @@ struct hit_record {
 	float alpha;
 };
 
-#define SPHERE_SIZE {SPHERE_SIZE}
-#define PLANE_SIZE {PLANE_SIZE}
-#define SURFACE_SIZE {SURFACE_SIZE}
-#define BOX_SIZE {BOX_SIZE}
-#define TORUS_SIZE {TORUS_SIZE}
-#define RING_SIZE {RING_SIZE}
-#define LIGHT_DIRECT_SIZE {LIGHT_DIRECT_SIZE}
-#define LIGHT_POINT_SIZE {LIGHT_POINT_SIZE}
 #define AMBIENT_COLOR {AMBIENT_COLOR}
 #define SHADOW_AMBIENT {SHADOW_AMBIENT}
 #define ITERATIONS {ITERATIONS}
 
+#ifdef VT_FEEDBACK
+// texture, level and tile the camera ray samples, x < 0 - none
+ivec4 vt_request = ivec4(-1);
+#endif
+
+#ifdef TILE_CLASSIFY
+out uint TileClass;
+vec4 FragColor; // written by the debug helpers only
+#else
 out vec4 FragColor;
+#endif
 
 uniform samplerCube skybox;
 
-uniform sampler2D texture_sphere_1;
-uniform sampler2D texture_sphere_2;
-uniform sampler2D texture_sphere_3;
-uniform sampler2D texture_sphere_4;
-uniform sampler2D texture_ring;
-uniform sampler2D texture_box;
+// textureNum n of any object is layer n - 1, 0 - no texture
+uniform sampler2DArray object_textures;
+
+// sphere textures streamed in tiles, see VirtualTextures; a textureNum listed here doesn't use its layer
+#define MAX_VIRTUAL_TEXTURES 4
+#define VT_TILE_SIZE 128
+#define VT_TILE_BORDER 4
+#define VT_SLOT_SIZE (VT_TILE_SIZE + 2 * VT_TILE_BORDER)
+#define VT_PAGE_NONE 0xffffffffu
+uniform int vt_count;
+// x - textureNum, y - first page table entry, zw - size of level 0 in texels
+uniform ivec4 vt_info[MAX_VIRTUAL_TEXTURES];
+uniform int vt_levels[MAX_VIRTUAL_TEXTURES];
+// shown until the tile file is built and its coarsest tile is resident
+uniform vec4 vt_placeholder[MAX_VIRTUAL_TEXTURES];
+// per tile of every level: slot x | slot y << 8 | level << 16 of the finest resident tile covering it
+uniform usamplerBuffer vt_pages;
+// resident tiles with their borders in VT_SLOT_SIZE slots
+uniform sampler2D vt_cache;
+// log2 of the feedback pass scale, its derivatives span that many more pixels
+uniform float vt_lod_bias;
+
+// subpixel offset of the camera ray in pixels, changes every frame while GLWrapper accumulates samples
+uniform vec2 jitter;
+// fraction of canvas_width/height the ray trace pass renders at, below 1 with dynamic resolution
+uniform vec2 render_scale;
+// -1 - off, otherwise only pixels with (x + y) % 2 == checkerboard are traced, packed into a half width target,
+// and the primary hit distance goes to alpha for checkerboard.frag
+uniform int checkerboard;
+// side of the tiles the pre-pass classified, 0 - no pre-pass
+uniform int tile_size;
+// per tile: TILE_MISS, 1 + ref of the only object primary rays can hit, or TILE_COMPLEX
+uniform usampler2D tile_classes;
+
+#define TILE_MISS 0u
+#define TILE_COMPLEX 0xffffffffu
+
+// primitive and light arrays, back to back as vec4 texels, see SceneManager::init_scene_data
+// *_offset - first texel of the array, *_count - number of elements
+uniform samplerBuffer scene_data;
+uniform int sphere_offset, sphere_count;
+uniform int plane_offset, plane_count;
+uniform int surface_offset, surface_count;
+uniform int box_offset, box_count;
+uniform int torus_offset, torus_count;
+uniform int ring_offset, ring_count;
+uniform int prototype_offset, prototype_count;
+uniform int material_offset, material_count;
+uniform int instance_offset, instance_count;
+uniform int light_point_offset, light_point_count;
+uniform int light_direct_offset, light_direct_count;
+
+// struct sizes in texels, must match the host side structs in scene.h
+#define MATERIAL_TEXELS 4
+#define SPHERE_TEXELS 3
+#define PLANE_TEXELS 2
+#define SURFACE_TEXELS 6
+#define BOX_TEXELS 3
+#define TORUS_TEXELS 3
+#define RING_TEXELS 3
+#define PROTOTYPE_TEXELS 2
+#define INSTANCE_TEXELS 3
+#define LIGHT_POINT_TEXELS 3
+#define LIGHT_DIRECT_TEXELS 2
+
+// bounding volume hierarchy, see Bvh.h for the layout
+uniform usamplerBuffer bvh_nodes; // 2 texels per node: (min, offset), (max, count)
+uniform usamplerBuffer bvh_prims; // primitive refs: type << 28 | index
+uniform int bvh_size; // node count, 0 - empty tree
+uniform int bvh_unbounded; // refs before the tree leaves, tested for every ray
+
+#define BVH_STACK_SIZE 32
 
 const float maxDist = 1000000.0;
 
@@ -157,77 +262,121 @@ layout( std140 ) uniform scene_buf
     rt_scene scene;
 };
 
-layout( std140 ) uniform spheres_buf
+// begin scene data section
+// unused fields are dropped by the compiler together with their fetches
+vec4 fetch(int texel)
 {
-	#if SPHERE_SIZE != 0
-    rt_sphere spheres[SPHERE_SIZE];
-	#else
-	rt_sphere spheres[1];
-	#endif
-};
+	return texelFetch(scene_data, texel);
+}
 
-layout( std140 ) uniform planes_buf
+int fetchInt(float value)
 {
-	#if PLANE_SIZE != 0
-    rt_plane planes[PLANE_SIZE];
-	#else
-	rt_plane planes[1];
-	#endif
-};
+	return floatBitsToInt(value);
+}
 
-layout( std140 ) uniform surfaces_buf
+rt_material getMaterial(int p)
 {
-	#if SURFACE_SIZE != 0
-    rt_surface surfaces[SURFACE_SIZE];
-	#else
-	rt_surface surfaces[1];
-	#endif
-};
+	vec4 t1 = fetch(p + 1);
+	vec4 t2 = fetch(p + 2);
+	return rt_material(fetch(p).xyz, t1.xyz, t1.w, t2.x, t2.y, fetchInt(t2.z), t2.w, fetch(p + 3).x);
+}
 
-layout( std140 ) uniform boxes_buf
+rt_material getMaterialById(int num)
 {
-	#if BOX_SIZE != 0
-    rt_box boxes[BOX_SIZE];
-	#else
-	rt_box boxes[1];
-	#endif
-};
+	return getMaterial(material_offset + num * MATERIAL_TEXELS);
+}
 
-layout( std140 ) uniform toruses_buf
+rt_sphere getSphere(int num)
 {
-	#if TORUS_SIZE != 0
-    rt_torus toruses[TORUS_SIZE];
-	#else
-	rt_torus toruses[1];
-	#endif
-};
+	int p = sphere_offset + num * SPHERE_TEXELS;
+	vec4 t2 = fetch(p + 2);
+	// bool is a single byte on the host side, the rest of the word is padding
+	return rt_sphere(fetchInt(t2.z), fetch(p), fetch(p + 1), fetchInt(t2.x), (fetchInt(t2.y) & 0xff) != 0);
+}
 
-layout( std140 ) uniform rings_buf
+rt_plane getPlane(int num)
 {
-	#if RING_SIZE != 0
-    rt_ring rings[RING_SIZE];
-	#else
-	rt_ring rings[1];
-	#endif
-};
+	int p = plane_offset + num * PLANE_TEXELS;
+	vec4 t0 = fetch(p);
+	return rt_plane(fetchInt(t0.w), t0.xyz, fetch(p + 1).xyz);
+}
 
-layout( std140 ) uniform lights_point_buf
+// world to object matrix of a unit quaternion, the same as rotate(q, v).
+// Built once per fetched object, m * v takes a vector into object space and v * m back
+mat3 rotationMatrix(vec4 q)
 {
-	#if LIGHT_POINT_SIZE != 0
-    rt_light_point lights_point[LIGHT_POINT_SIZE];
-	#else
-	rt_light_point lights_point[1];
-	#endif
-};
+	vec3 q2 = q.xyz * 2.0;
+	vec3 qq = q.xyz * q2;
+	float xy = q.x * q2.y, xz = q.x * q2.z, yz = q.y * q2.z;
+	vec3 w = q.w * q2;
+	return mat3(
+		1.0 - qq.y - qq.z, xy + w.z, xz - w.y,
+		xy - w.z, 1.0 - qq.x - qq.z, yz + w.x,
+		xz + w.y, yz - w.x, 1.0 - qq.x - qq.y);
+}
 
-layout( std140 ) uniform lights_direct_buf
+rt_surface getSurface(int num)
 {
-	#if LIGHT_DIRECT_SIZE != 0
-    rt_light_direct lights_direct[LIGHT_DIRECT_SIZE];
-	#else
-	rt_light_direct lights_direct[1];
-	#endif
-};
+	int p = surface_offset + num * SURFACE_TEXELS;
+	vec4 t1 = fetch(p + 1);
+	vec4 t3 = fetch(p + 3);
+	vec4 t4 = fetch(p + 4);
+	return rt_surface(fetchInt(t1.w), rotationMatrix(fetch(p)), t1.xyz, fetch(p + 2).xyz, t3.xyz, t3.w, t4.x, t4.y, t4.z, t4.w, fetch(p + 5).x);
+}
+
+rt_box getBox(int num)
+{
+	int p = box_offset + num * BOX_TEXELS;
+	vec4 t1 = fetch(p + 1);
+	vec4 t2 = fetch(p + 2);
+	return rt_box(fetchInt(t1.w), rotationMatrix(fetch(p)), t1.xyz, t2.xyz, fetchInt(t2.w));
+}
+
+rt_torus getTorus(int num)
+{
+	int p = torus_offset + num * TORUS_TEXELS;
+	vec4 t1 = fetch(p + 1);
+	return rt_torus(fetchInt(t1.w), rotationMatrix(fetch(p)), t1.xyz, fetch(p + 2).xy);
+}
+
+rt_ring getRing(int num)
+{
+	int p = ring_offset + num * RING_TEXELS;
+	vec4 t1 = fetch(p + 1);
+	vec4 t2 = fetch(p + 2);
+	return rt_ring(fetchInt(t2.z), rotationMatrix(fetch(p)), t1.xyz, fetchInt(t1.w), t2.x, t2.y);
+}
+
+rt_prototype getPrototype(int num)
+{
+	int p = prototype_offset + num * PROTOTYPE_TEXELS;
+	vec4 t1 = fetch(p + 1);
+	return rt_prototype(fetch(p), fetchInt(t1.x), fetchInt(t1.y), t1.z);
+}
+
+rt_instance getInstance(int num)
+{
+	int p = instance_offset + num * INSTANCE_TEXELS;
+	vec4 t1 = fetch(p + 1);
+	vec4 t2 = fetch(p + 2);
+	return rt_instance(rotationMatrix(fetch(p)), t1.xyz, t1.w, fetchInt(t2.x), fetchInt(t2.y));
+}
+
+rt_light_point getLightPoint(int num)
+{
+	int p = light_point_offset + num * LIGHT_POINT_TEXELS;
+	vec4 t1 = fetch(p + 1);
+	vec4 t2 = fetch(p + 2);
+	return rt_light_point(fetch(p), t1.xyz, t1.w, t2.x, t2.y);
+}
+
+rt_light_direct getLightDirect(int num)
+{
+	int p = light_direct_offset + num * LIGHT_DIRECT_TEXELS;
+	vec4 t1 = fetch(p + 1);
+	return rt_light_direct(fetch(p).xyz, t1.xyz, t1.w);
+}
+// end scene data section
 
 void _dbg()
 {
@@ -310,12 +459,64 @@ vec3 rotate(vec4 qr, vec3 v)
 	return quat_mult(q_tmp, qr_conj).xyz;
 }
 
-vec3 getRayDir()
+// canvas position of the fragment's camera ray, before jitter
+vec2 getPixel()
 {
-	vec3 result = vec3((gl_FragCoord.xy - vec2(scene.canvas_width, scene.canvas_height) / 2) / scene.canvas_height, 1);
+	vec2 pixel = gl_FragCoord.xy / render_scale;
+	if (checkerboard >= 0)
+		pixel.x = floor(gl_FragCoord.x) * 2 + float((int(gl_FragCoord.y) + checkerboard) & 1) + 0.5;
+	return pixel;
+}
+
+vec3 getRayDir(vec2 pixel)
+{
+	vec3 result = vec3((pixel - vec2(scene.canvas_width, scene.canvas_height) / 2) / scene.canvas_height, 1);
 	return normalize(rotate(scene.quat_camera_rotation, result));
 }
 
+ivec2 vtLevelSize(int vt, int level) {
+	return max(vt_info[vt].zw >> level, 1);
+}
+
+ivec2 vtPages(int vt, int level) {
+	return (vtLevelSize(vt, level) + VT_TILE_SIZE - 1) / VT_TILE_SIZE;
+}
+
+ivec2 vtPage(int vt, int level, vec2 uv) {
+	return clamp(ivec2(uv * vec2(vtLevelSize(vt, level))) / VT_TILE_SIZE, ivec2(0), vtPages(vt, level) - 1);
+}
+
+// bilinear sample of one level from the finest resident tile covering uv
+vec4 sampleVirtualLevel(int vt, int level, vec2 uv) {
+	int entry = vt_info[vt].y;
+	for (int l = 0; l < level; l++) {
+		ivec2 pages = vtPages(vt, l);
+		entry += pages.x * pages.y;
+	}
+	ivec2 page = vtPage(vt, level, uv);
+	uint tile = texelFetch(vt_pages, entry + page.y * vtPages(vt, level).x + page.x).r;
+	if (tile == VT_PAGE_NONE)
+		return vt_placeholder[vt];
+
+	int resident = int(tile >> 16);
+	vec2 texel = uv * vec2(vtLevelSize(vt, resident));
+	vec2 inTile = texel - vec2(page >> (resident - level)) * VT_TILE_SIZE;
+	vec2 slot = vec2(tile & 0xffu, (tile >> 8) & 0xffu);
+	return textureLod(vt_cache, (slot * VT_SLOT_SIZE + VT_TILE_BORDER + inTile) / vec2(textureSize(vt_cache, 0)), 0.);
+}
+
+vec4 sampleVirtualTexture(int vt, vec2 uv, float lod) {
+	lod = clamp(lod + vt_lod_bias, 0., float(vt_levels[vt] - 1));
+	int level = int(lod);
+	#ifdef VT_FEEDBACK
+	vt_request = ivec4(vt, level, vtPage(vt, level, uv));
+	#endif
+	vec4 color = sampleVirtualLevel(vt, level, uv);
+	if (level + 1 == vt_levels[vt])
+		return color;
+	return mix(color, sampleVirtualLevel(vt, level + 1, uv), fract(lod));
+}
+
 vec4 getSphereTexture(vec3 sphereNormal, vec4 quat, int texNum) {
 	if (quat != vec4(0,0,0,1)) {
 		sphereNormal = rotate(quat, sphereNormal);
@@ -326,17 +527,12 @@ vec4 getSphereTexture(vec3 sphereNormal, vec4 quat, int texNum) {
 	vec2 df = fwidth(uv);
 	if(df.x > 0.5) df.x = 0.;
 
-	vec4 color;
-	if (texNum == 1) {
-		color = textureLod(texture_sphere_1, uv, log2(max(df.x, df.y)*1024.));
-	}
-	if (texNum == 2) {
-		color = textureLod(texture_sphere_2, uv, log2(max(df.x, df.y)*1024.));
+	// two levels sharper than the footprint, like the array lookup below for its 4096 texels wide layers
+	for (int vt = 0; vt < vt_count; vt++) {
+		if (vt_info[vt].x == texNum)
+			return sampleVirtualTexture(vt, uv, log2(max(max(df.x, df.y) * float(vt_info[vt].z) / 4., 1e-8)));
 	}
-	if (texNum == 3) {
-		color = textureLod(texture_sphere_3, uv, log2(max(df.x, df.y)*1024.));
-	}
-	return color;
+	return textureLod(object_textures, vec3(uv, texNum - 1), log2(max(df.x, df.y)*1024.));
 }
 
 bool intersectSphere(vec3 ro, vec3 rd, vec4 object, bool hollow, float tmin, out float t)
@@ -370,9 +566,9 @@ bool intersectPlane(vec3 ro, vec3 rd, vec3 n, vec3 p, float tmin, out float t) {
 }
 
 bool intersectRing(vec3 ro, vec3 rd, int num, float tmin, out float t) {
-	rt_ring ring = rings[num];
-	rd = rotate(ring.quat_rotation, rd);
-	ro = rotate(ring.quat_rotation, ro - ring.pos);
+	rt_ring ring = getRing(num);
+	rd = ring.rotation * rd;
+	ro = ring.rotation * (ro - ring.pos);
 
 	t = -ro.z / rd.z;
 
@@ -389,24 +585,19 @@ bool intersectRing(vec3 ro, vec3 rd, int num, float tmin, out float t) {
 	return false;
 }
 vec3 getRingNormal(int num) {
-	rt_ring ring = rings[num];
-	return rotate(quat_inv(ring.quat_rotation), vec3(0, 0, -1));
+	rt_ring ring = getRing(num);
+	return vec3(0, 0, -1) * ring.rotation;
 }
 vec4 getRingTexture(int num, vec2 uv) {
-	return texture(texture_ring, uv);
+	return texture(object_textures, vec3(uv, num - 1));
 }
 
-bool intersectBox(vec3 ro, vec3 rd, int num, float tmin, out float t) 
+// ray in the box' own space, nor - normal of the hit side there. Shared by boxes and instances
+bool intersectBoxLocal(vec3 roo, vec3 rdd, vec3 form, float tmin, out float t, out vec3 nor)
 {
-	rt_box box = boxes[num];
-    // convert from ray to box space
-	vec3 rdd = rotate(box.quat_rotation, rd);
-	vec3 roo = rotate(box.quat_rotation, ro - box.pos);
-
-	// ray-box intersection in box space
     vec3 m = 1.0/rdd;
     vec3 n = m*roo;
-    vec3 k = abs(m)*box.form;
+    vec3 k = abs(m)*form;
 	
     vec3 t1 = -n - k;
     vec3 t2 = -n + k;
@@ -419,23 +610,99 @@ bool intersectBox(vec3 ro, vec3 rd, int num, float tmin, out float t)
 	if (tN >= tmin)
 		return false;
 
-	vec3 nor = -sign(rdd)*step(t1.yzx,t1.xyz)*step(t1.zxy,t1.xyz);
+	nor = -sign(rdd)*step(t1.yzx,t1.xyz)*step(t1.zxy,t1.xyz);
 	t = tN;
+	return true;
+}
+bool intersectBox(vec3 ro, vec3 rd, int num, float tmin, out float t) 
+{
+	rt_box box = getBox(num);
+	vec3 nor;
+	if (!intersectBoxLocal(box.rotation * (ro - box.pos), box.rotation * rd, box.form, tmin, t, nor))
+		return false;
 	// convert to ray space
-	opt_normal = rotate(quat_inv(box.quat_rotation), nor);
+	opt_normal = nor * box.rotation;
 	return true;
 }
+// point and normal in the box' own space
+vec4 getBoxTextureLocal(vec3 pt, vec3 normal, int texNum) {
+	float layer = float(texNum - 1);
+	return abs(normal.x)*texture(object_textures, vec3(0.5*pt.zy-vec2(0.5), layer)) + 
+			abs(normal.y)*texture(object_textures, vec3(0.5*pt.zx-vec2(0.5), layer)) + 
+			abs(normal.z)*texture(object_textures, vec3(0.5*pt.xy-vec2(0.5), layer));
+}
 vec4 getBoxTexture(vec3 pt, vec3 normal, int num) {
-	rt_box box = boxes[num];
-	vec3 pos = rotate(box.quat_rotation, box.pos);
-	pt = rotate(box.quat_rotation, pt);
-	normal = rotate(box.quat_rotation, normal);
-	return abs(normal.x)*texture(texture_box, 0.5*(pt.zy - pos.zy)-vec2(0.5)) + 
-			abs(normal.y)*texture(texture_box, 0.5*(pt.zx - pos.zx)-vec2(0.5)) + 
-			abs(normal.z)*texture(texture_box, 0.5*(pt.xy - pos.xy)-vec2(0.5));
+	rt_box box = getBox(num);
+	return getBoxTextureLocal(box.rotation * (pt - box.pos), box.rotation * normal, box.textureNum);
 }
 
 // begin torus section
+#if TORUS_ANALYTIC
+// smallest positive root of the torus quartic, FLT_MAX if none. rd must be normalized.
+// Closed form (Ferrari): the quartic is split into two quadratics through the largest root of its resolvent cubic,
+// then each root gets Newton steps on the original polynomial to win back the digits float loses on the way
+float solveTorus(vec3 ro, vec3 rd, vec2 torus)
+{
+	float R2 = torus.x*torus.x;
+	float n = dot(ro, rd);
+	float k = (dot(ro, ro) - torus.y*torus.y - R2) / 2.0;
+
+	// t^4 + 4*k3*t^3 + 4*k2*t^2 + 8*k1*t + 4*k0, depressed by t = y - k3 to y^4 + p*y^2 + q*y + r
+	float k3 = n;
+	float k2 = n*n + R2*rd.z*rd.z + k;
+	float k1 = k*n + R2*ro.z*rd.z;
+	float k0 = k*k + R2*ro.z*ro.z - R2*torus.y*torus.y;
+	float p = 4.0*k2 - 6.0*k3*k3;
+	float q = 8.0*(k3*(k3*k3 - k2) + k1);
+	float r = k3*k3*(4.0*k2 - 3.0*k3*k3) - 8.0*k3*k1 + 4.0*k0;
+
+	// resolvent m^3 + p*m^2 + (p^2/4 - r)*m - q^2/8, depressed by m = x - p/3 to x^3 + P*x + Q
+	float P = -p*p/12.0 - r;
+	float Q = -p*p*p/108.0 + p*r/3.0 - q*q/8.0;
+	float D = Q*Q/4.0 + P*P*P/27.0;
+	float x;
+	if (D < 0.0) {
+		x = 2.0*sqrt(-P/3.0)*cos(acos(clamp(1.5*Q/P*sqrt(-3.0/P), -1.0, 1.0))/3.0);
+	} else {
+		float sd = sqrt(D);
+		float u = -Q/2.0 + sd;
+		float v = -Q/2.0 - sd;
+		x = sign(u)*pow(abs(u), 1.0/3.0) + sign(v)*pow(abs(v), 1.0/3.0);
+	}
+	float m = x - p/3.0;
+
+	vec4 ys = vec4(FLT_MAX);
+	if (m <= 1e-6) {
+		// q == 0, biquadratic
+		float d = p*p - 4.0*r;
+		if (d < 0.0) return FLT_MAX;
+		vec2 y2 = (vec2(-p) + vec2(-1.0, 1.0)*sqrt(d)) / 2.0;
+		if (y2.x >= 0.0) ys.xy = vec2(-1.0, 1.0)*sqrt(y2.x);
+		if (y2.y >= 0.0) ys.zw = vec2(-1.0, 1.0)*sqrt(y2.y);
+	} else {
+		// (y^2 + p/2 + m)^2 = (s*y - q/(2*s))^2
+		float s = sqrt(2.0*m);
+		float d = s*s - 4.0*(p/2.0 + m + q/(2.0*s));
+		if (d >= 0.0) ys.xy = (vec2(s) + vec2(-1.0, 1.0)*sqrt(d)) / 2.0;
+		d = s*s - 4.0*(p/2.0 + m - q/(2.0*s));
+		if (d >= 0.0) ys.zw = (vec2(-s) + vec2(-1.0, 1.0)*sqrt(d)) / 2.0;
+	}
+
+	float result = FLT_MAX;
+	for (int i = 0; i < 4; i++) {
+		if (ys[i] == FLT_MAX) continue;
+		float t = ys[i] - k3;
+		for (int j = 0; j < 2; j++) {
+			float a = t*t + 2.0*n*t + 2.0*k;
+			float b = ro.z + t*rd.z;
+			float df = 4.0*a*(t + n) + 8.0*R2*b*rd.z;
+			if (df != 0.0) t -= (a*a + 4.0*R2*(b*b - torus.y*torus.y)) / df;
+		}
+		if (t > 0.0) result = min(result, t);
+	}
+	return result;
+}
+#else
 vec2 cmul(vec2 c1, vec2 c2){
 	return vec2(c1.x*c2.x-c1.y*c2.y,c1.x*c2.y+c1.y*c2.x);
 }
@@ -459,20 +726,42 @@ float DKstep(inout vec2 c0, vec2 c1, vec2 c2, vec2 c3, in vec3 ro, in vec3 rd, i
 	c0-=fc;
 	return max(abs(fc.x),abs(fc.y));
 }
-bool intersectTorus( in vec3 ro, in vec3 rd, int num, float tmin, out float t ){
+#endif
+
+// ray in the torus' own space, shared by toruses and instances
+bool intersectTorusLocal(vec3 ro, vec3 rd, vec2 form, float tmin, out float t)
+{
+	t = FLT_MAX;
+
+	// bounding sphere rejection, most rays never get to the quartic
+	float a = dot(rd, rd);
+	float b = dot(ro, rd);
+	float radius = form.x + form.y;
+	float h = b*b - a*(dot(ro, ro) - radius*radius);
+	if (h < 0) return false;
+	h = sqrt(h);
+	float tnear = (-b - h) / a;
+	if (-b + h < 0 || tnear > tmin) return false;
+
+#if TORUS_ANALYTIC
+	// solve from the sphere entry point, a close origin keeps the float coefficients well-conditioned
+	tnear = max(tnear, 0);
+	float len = sqrt(a);
+	t = solveTorus(ro + rd * tnear, rd / len, form);
+	if (t == FLT_MAX) return false;
+	t = tnear + t / len;
+	return t < tmin;
+#else
 	float eps = 0.001;
-	rt_torus torus = toruses[num];
-	ro = rotate(torus.quat_rotation, ro - torus.pos);
-	rd = rotate(torus.quat_rotation, rd);
 	vec2 c0=vec2(1.,0.);
 	vec2 c1=vec2(0.4,0.9);
 	vec2 c2=cmul(c1,vec2(0.4,0.9));
 	vec2 c3=cmul(c2,vec2(0.4,0.9));
 	for(int i=0; i<60; i++){
-		float e = DKstep(c0, c1, c2, c3, ro, rd, torus.form);
-		e = max(e,DKstep(c1, c2, c3, c0, ro, rd, torus.form));
-		e = max(e,DKstep(c2, c3, c0, c1, ro, rd, torus.form));
-		e = max(e,DKstep(c3, c0, c1, c2, ro, rd, torus.form));
+		float e = DKstep(c0, c1, c2, c3, ro, rd, form);
+		e = max(e,DKstep(c1, c2, c3, c0, ro, rd, form));
+		e = max(e,DKstep(c2, c3, c0, c1, ro, rd, form));
+		e = max(e,DKstep(c3, c0, c1, c2, ro, rd, form));
 		if(e<eps) break;
 	}
 	vec4 rs= vec4(c0.x, c1.x, c2.x, c3.x);
@@ -484,15 +773,22 @@ bool intersectTorus( in vec3 ro, in vec3 rd, int num, float tmin, out float t ){
 	if(ri.w>eps || rs.w<0.) rs.w=10000.;
 	t = min(min(rs.x,rs.y),min(rs.z,rs.w));
 	return t > 0 && t < 100 && t < tmin;
+#endif
+}
+bool intersectTorus( in vec3 ro, in vec3 rd, int num, float tmin, out float t ){
+	rt_torus torus = getTorus(num);
+	return intersectTorusLocal(torus.rotation * (ro - torus.pos), torus.rotation * rd, torus.form, tmin, t);
+}
+vec3 getTorusNormalLocal(vec3 pos, vec2 form)
+{
+	return pos*(dot(pos,pos)- form.y*form.y - form.x*form.x*vec3(1.0,1.0,-1.0));
 }
 vec3 getTorusNormal(vec3 ro, vec3 rd, float t, int num)
 {
-	rt_torus torus = toruses[num];
-	ro = rotate(torus.quat_rotation, ro - torus.pos);
-	rd = rotate(torus.quat_rotation, rd);
-	vec3 pos = ro + rd * t;
-	vec3 normal = pos*(dot(pos,pos)- torus.form.y*torus.form.y - torus.form.x*torus.form.x*vec3(1.0,1.0,-1.0));
-	return normalize(rotate(quat_inv(torus.quat_rotation), normal));
+	rt_torus torus = getTorus(num);
+	ro = torus.rotation * (ro - torus.pos);
+	rd = torus.rotation * rd;
+	return normalize(getTorusNormalLocal(ro + rd * t, torus.form) * torus.rotation);
 }
 // end torus section
 
@@ -514,9 +810,20 @@ bool intersectSurface(vec3 ro, vec3 rd, int num, float tmin, out float t)
 {
 	vec3 orig_ro = ro;
 	vec3 orig_rd = rd;
-	rt_surface surface = surfaces[num];
-	ro = rotate(surface.quat_rotation, ro - surface.pos);
-	rd = rotate(surface.quat_rotation, rd);
+	rt_surface surface = getSurface(num);
+
+	// slab test against the clip box, SceneManager fits it to the quadric so rays passing by stop here
+	vec3 slab0 = (surface.v_min - ro) / rd;
+	vec3 slab1 = (surface.v_max - ro) / rd;
+	vec3 tsmall = min(slab0, slab1);
+	vec3 tbig = max(slab0, slab1);
+	float tnear = max(max(tsmall.x, tsmall.y), tsmall.z);
+	float tfar = min(min(tbig.x, tbig.y), tbig.z);
+	if (tnear > tfar || tfar < 0 || tnear > tmin)
+		return false;
+
+	ro = surface.rotation * (ro - surface.pos);
+	rd = surface.rotation * rd;
 
 	float a = surface.a;
 	float b = surface.b;
@@ -571,87 +878,301 @@ bool intersectSurface(vec3 ro, vec3 rd, int num, float tmin, out float t)
 	return t < tmin;
 }
 vec3 getSurfaceNormal(vec3 ro, vec3 rd, float t, int num) {
-	rt_surface surface = surfaces[num];
+	rt_surface surface = getSurface(num);
 	ro = ro - surface.pos;
-	ro = rotate(surface.quat_rotation, ro);
-	rd = rotate(surface.quat_rotation, rd);
+	ro = surface.rotation * ro;
+	rd = surface.rotation * rd;
 
 	vec3 tm = rd * t + ro;
 
 	vec3 normal = vec3(2 * surface.a * tm.x, 2 * surface.b * tm.y + surface.e, 2 * surface.c * tm.z + surface.d);
-	normal = rotate(quat_inv(surface.quat_rotation), normal);
+	normal = normal * surface.rotation;
 	return normalize(normal);
 }
 // end surface section
 
-float calcInter(vec3 ro, vec3 rd, out int num, out int type)
+// begin instance section
+// The ray goes into the prototype's space, where distances are world ones divided by the scale.
+// The bounding sphere rejects most rays before the shape test
+bool intersectInstance(vec3 ro, vec3 rd, int num, float tmin, out float t)
 {
-	float tmin = maxDist;
-	float t;
-	for (int i = 0; i < PLANE_SIZE; i++) {
-		if (intersectPlane(ro, rd, planes[i].normal, planes[i].pos, tmin, t)) {
-			num = i; tmin = t; type = TYPE_PLANE;
-		}
+	rt_instance instance = getInstance(num);
+	rt_prototype prototype = getPrototype(instance.prototype);
+	ro = instance.rotation * (ro - instance.pos) / instance.scale;
+	rd = instance.rotation * rd;
+	tmin /= instance.scale;
+	t = FLT_MAX;
+
+	float b = dot(ro, rd);
+	float h = b*b - dot(ro, ro) + prototype.radius*prototype.radius;
+	if (h < 0 || -b + sqrt(h) < 0 || -b - sqrt(h) > tmin)
+		return false;
+
+	bool hit = false;
+	if (prototype.type == TYPE_SPHERE) {
+		hit = intersectSphere(ro, rd, vec4(0, 0, 0, prototype.form.x), false, tmin, t);
+	} else if (prototype.type == TYPE_BOX) {
+		vec3 nor;
+		hit = intersectBoxLocal(ro, rd, prototype.form.xyz, tmin, t, nor);
+		if (hit)
+			opt_normal = nor * instance.rotation;
+	} else if (prototype.type == TYPE_TORUS) {
+		hit = intersectTorusLocal(ro, rd, prototype.form.xy, tmin, t);
 	}
-	for (int i = 0; i < SPHERE_SIZE; i++) {
-		if (intersectSphere(ro, rd, spheres[i].obj, spheres[i].hollow, tmin, t)) {
-			num = i; tmin = t; type = TYPE_SPHERE;
-		}
+	if (hit)
+		t *= instance.scale;
+	return hit;
+}
+// point and normal of an instance hit in its prototype's space, box normals come from the intersection
+void getInstanceHitLocal(rt_instance instance, rt_prototype prototype, vec3 pt, out vec3 local, out vec3 normal)
+{
+	local = instance.rotation * (pt - instance.pos) / instance.scale;
+	if (prototype.type == TYPE_SPHERE)
+		normal = local;
+	else if (prototype.type == TYPE_TORUS)
+		normal = getTorusNormalLocal(local, prototype.form.xy);
+	else
+		normal = instance.rotation * opt_normal;
+	normal = normalize(normal);
+}
+// end instance section
+
+// begin bvh section
+int refType(uint ref) 
+{
+	return int(ref >> 28u);
+}
+
+int refIndex(uint ref) 
+{
+	return int(ref & 0x0fffffffu);
+}
+
+bool intersectPrim(vec3 ro, vec3 rd, uint ref, bool hollow, float tmin, out float t)
+{
+	int type = refType(ref);
+	int num = refIndex(ref);
+	#if HAS_SPHERES
+	if (type == TYPE_SPHERE) {
+		rt_sphere sphere = getSphere(num);
+		return intersectSphere(ro, rd, sphere.obj, hollow && sphere.hollow, tmin, t);
 	}
-	for (int i = 0; i < SURFACE_SIZE; i++) {
-		if (intersectSurface(ro, rd, i, tmin, t)) {
-			num = i; tmin = t; type = TYPE_SURFACE;
+	#endif
+	#if HAS_SURFACES
+	if (type == TYPE_SURFACE) 
+		return intersectSurface(ro, rd, num, tmin, t);
+	#endif
+	#if HAS_BOXES
+	if (type == TYPE_BOX) 
+		return intersectBox(ro, rd, num, tmin, t);
+	#endif
+	#if HAS_TORUSES
+	if (type == TYPE_TORUS) 
+		return intersectTorus(ro, rd, num, tmin, t);
+	#endif
+	#if HAS_RINGS
+	if (type == TYPE_RING) 
+		return intersectRing(ro, rd, num, tmin, t);
+	#endif
+	#if HAS_INSTANCES
+	if (type == TYPE_INSTANCE) 
+		return intersectInstance(ro, rd, num, tmin, t);
+	#endif
+	return false;
+}
+
+bool intersectNode(vec3 ro, vec3 inv_rd, int node, float tmin, out float tnear)
+{
+	vec3 bmin = uintBitsToFloat(texelFetch(bvh_nodes, node * 2).xyz);
+	vec3 bmax = uintBitsToFloat(texelFetch(bvh_nodes, node * 2 + 1).xyz);
+	vec3 t0 = (bmin - ro) * inv_rd;
+	vec3 t1 = (bmax - ro) * inv_rd;
+	vec3 tsmall = min(t0, t1);
+	vec3 tbig = max(t0, t1);
+	tnear = max(max(tsmall.x, tsmall.y), tsmall.z);
+	float tfar = min(min(tbig.x, tbig.y), tbig.z);
+	return tnear <= tfar && tfar > 0 && tnear < tmin;
+}
+
+// nearest hit over the unbounded refs and the tree
+void bvhClosestHit(vec3 ro, vec3 rd, inout float tmin, inout int num, inout int type)
+{
+	float t;
+	for (int i = 0; i < bvh_unbounded; i++) {
+		uint ref = texelFetch(bvh_prims, i).r;
+		if (intersectPrim(ro, rd, ref, true, tmin, t)) {
+			num = refIndex(ref); tmin = t; type = refType(ref);
 		}
 	}
-	for (int i = 0; i < BOX_SIZE; i++) {
-		if (intersectBox(ro, rd, i, tmin, t)) {
-			num = i; tmin = t; type = TYPE_BOX;
+
+	vec3 inv_rd = 1.0 / rd;
+	float tleft, tright;
+	if (bvh_size == 0 || !intersectNode(ro, inv_rd, 0, tmin, tleft))
+		return;
+
+	int stack[BVH_STACK_SIZE];
+	float stack_t[BVH_STACK_SIZE];
+	int sp = 0;
+	int node = 0;
+	while (true) {
+		int offset = int(texelFetch(bvh_nodes, node * 2).w);
+		int count = int(texelFetch(bvh_nodes, node * 2 + 1).w);
+		if (count > 0) {
+			for (int i = offset; i < offset + count; i++) {
+				uint ref = texelFetch(bvh_prims, i).r;
+				if (intersectPrim(ro, rd, ref, true, tmin, t)) {
+					num = refIndex(ref); tmin = t; type = refType(ref);
+				}
+			}
+		} else {
+			// visit the nearer child first, the other one goes to the stack
+			bool hitLeft = intersectNode(ro, inv_rd, node + 1, tmin, tleft);
+			bool hitRight = intersectNode(ro, inv_rd, offset, tmin, tright);
+			if (hitLeft && hitRight) {
+				bool leftFirst = tleft <= tright;
+				if (sp < BVH_STACK_SIZE) {
+					stack[sp] = leftFirst ? offset : node + 1; 
+					stack_t[sp] = leftFirst ? tright : tleft; 
+					sp++;
+				}
+				node = leftFirst ? node + 1 : offset;
+				continue;
+			}
+			if (hitLeft) { node = node + 1; continue; }
+			if (hitRight) { node = offset; continue; }
 		}
+
+		// pop nodes that may still contain a closer hit
+		while (sp > 0 && stack_t[sp - 1] >= tmin) sp--;
+		if (sp == 0) break;
+		node = stack[--sp];
 	}
-	for (int i = 0; i < TORUS_SIZE; i++) {
-		if (intersectTorus(ro, rd, i, tmin, t)) {
-			num = i; tmin = t; type = TYPE_TORUS;
+}
+
+// sum of occluder opacities between ro and ro + rd * dist, same rules as inShadow.
+// Any hit will do: it returns at the first opaque occluder or once textured rings add up to opaque
+float bvhShadow(vec3 ro, vec3 rd, float dist)
+{
+	float t;
+	float shadow = 0;
+	for (int i = 0; i < bvh_unbounded; i++) {
+		if (intersectPrim(ro, rd, texelFetch(bvh_prims, i).r, false, dist, t)) 
+			return 1.0;
+	}
+
+	vec3 inv_rd = 1.0 / rd;
+	float tnear;
+	if (bvh_size == 0 || !intersectNode(ro, inv_rd, 0, dist, tnear))
+		return shadow;
+
+	int stack[BVH_STACK_SIZE];
+	int sp = 0;
+	int node = 0;
+	while (true) {
+		int offset = int(texelFetch(bvh_nodes, node * 2).w);
+		int count = int(texelFetch(bvh_nodes, node * 2 + 1).w);
+		if (count > 0) {
+			for (int i = offset; i < offset + count; i++) {
+				uint ref = texelFetch(bvh_prims, i).r;
+				if (intersectPrim(ro, rd, ref, false, dist, t)) {
+					#if HAS_RINGS && HAS_TEXTURES
+					int textureNum = refType(ref) == TYPE_RING ? getRing(refIndex(ref)).textureNum : 0;
+					if (textureNum == 0)
+						return 1.0;
+					shadow += getRingTexture(textureNum, opt_uv).a;
+					if (shadow >= 1)
+						return 1.0;
+					#else
+					return 1.0;
+					#endif
+				}
+			}
+		} else {
+			bool hitLeft = intersectNode(ro, inv_rd, node + 1, dist, tnear);
+			bool hitRight = intersectNode(ro, inv_rd, offset, dist, tnear);
+			if (hitLeft && hitRight && sp < BVH_STACK_SIZE) 
+				stack[sp++] = offset;
+			if (hitLeft) { node = node + 1; continue; }
+			if (hitRight) { node = offset; continue; }
 		}
+
+		if (sp == 0) break;
+		node = stack[--sp];
 	}
-	for (int i = 0; i < RING_SIZE; i++) {
-		if (intersectRing(ro, rd, i, tmin, t)) {
-			num = i; tmin = t; type = TYPE_RING;
+	return shadow;
+}
+// end bvh section
+
+float calcInter(vec3 ro, vec3 rd, out int num, out int type)
+{
+	float tmin = maxDist;
+	float t;
+	#if HAS_PLANES
+	for (int i = 0; i < plane_count; i++) {
+		rt_plane plane = getPlane(i);
+		if (intersectPlane(ro, rd, plane.normal, plane.pos, tmin, t)) {
+			num = i; tmin = t; type = TYPE_PLANE;
 		}
 	}
-	for (int i = 0; i < LIGHT_POINT_SIZE; i++) {
-		if (intersectSphere(ro, rd, lights_point[i].pos, false, tmin, t)) {
+	#endif
+	bvhClosestHit(ro, rd, tmin, num, type);
+	#if HAS_POINT_LIGHTS
+	for (int i = 0; i < light_point_count; i++) {
+		if (intersectSphere(ro, rd, getLightPoint(i).pos, false, tmin, t)) {
 			num = i; tmin = t; type = TYPE_POINT_LIGHT;
 		}
 	}
+	#endif
 	
  	return tmin;
 }
 
+// calcInter for a camera ray, tiles the pre-pass found simple skip the object loops
+float calcPrimaryInter(vec3 ro, vec3 rd, vec2 pixel, out int num, out int type)
+{
+	if (tile_size == 0)
+		return calcInter(ro, rd, num, type);
+	uint tile = texelFetch(tile_classes, ivec2(pixel) / tile_size, 0).r;
+	if (tile == TILE_COMPLEX)
+		return calcInter(ro, rd, num, type);
+
+	float tmin = maxDist;
+	if (tile == TILE_MISS)
+		return tmin;
+
+	float t;
+	uint ref = tile - 1u;
+	int refNum = refIndex(ref);
+	int refT = refType(ref);
+	if (refT == TYPE_PLANE) {
+		#if HAS_PLANES
+		rt_plane plane = getPlane(refNum);
+		if (intersectPlane(ro, rd, plane.normal, plane.pos, tmin, t)) {
+			num = refNum; tmin = t; type = TYPE_PLANE;
+		}
+		#endif
+	} else if (refT == TYPE_POINT_LIGHT) {
+		#if HAS_POINT_LIGHTS
+		if (intersectSphere(ro, rd, getLightPoint(refNum).pos, false, tmin, t)) {
+			num = refNum; tmin = t; type = TYPE_POINT_LIGHT;
+		}
+		#endif
+	} else if (intersectPrim(ro, rd, ref, true, tmin, t)) {
+		num = refNum; tmin = t; type = refT;
+	}
+	return tmin;
+}
+
 float inShadow(vec3 ro, vec3 rd, float dist)
 {
 	float t;
-	float shadow = 0;
+	float shadow = bvhShadow(ro, rd, dist);
 	
-	for (int i = 0; i < SPHERE_SIZE; i++)
-		if(intersectSphere(ro, rd, spheres[i].obj, false, dist, t)) {shadow = 1;}
-	for (int i = 0; i < SURFACE_SIZE; i++)
-		if(intersectSurface(ro, rd, i, dist, t)) {shadow = 1;}
-	for (int i = 0; i < BOX_SIZE; i++)
-		if(intersectBox(ro, rd, i, dist, t)) {shadow = 1;}
-	for (int i = 0; i < TORUS_SIZE; i++)
-		if(intersectTorus(ro, rd, i, dist, t)) {shadow = 1;}
-	for (int i = 0; i < RING_SIZE; i++)
-		if(intersectRing(ro, rd, i, dist, t)) {
-			rt_ring ring = rings[i];
-			if (ring.textureNum > 0) {
-				shadow += getRingTexture(ring.textureNum, opt_uv).a;
-			} else {
-				shadow = 1;
-			}
-		}
-	#if PLANE_ONESIDE == 0
-	for (int i = 0; i < PLANE_SIZE; i++)
-		if(intersectPlane(ro, rd, planes[i].normal, planes[i].pos, dist, t)) {shadow = 1;}
+	#if PLANE_ONESIDE == 0 && HAS_PLANES
+	for (int i = 0; i < plane_count && shadow < 1; i++) {
+		rt_plane plane = getPlane(i);
+		if(intersectPlane(ro, rd, plane.normal, plane.pos, dist, t)) {shadow = 1;}
+	}
 	#endif
 
 	return min(shadow, 1);
@@ -687,8 +1208,9 @@ vec3 calcShade(vec3 pt, vec3 rd, rt_material material, vec3 normal, bool doShado
 
 	vec3 pixelColor = AMBIENT_COLOR * material.color;
 
-	for (int i = 0; i < LIGHT_POINT_SIZE; i++) {
-		rt_light_point light = lights_point[i];
+	#if HAS_POINT_LIGHTS
+	for (int i = 0; i < light_point_count; i++) {
+		rt_light_point light = getLightPoint(i);
 		light_color = light.color;
 		light_dir = light.pos.xyz - pt;
 		dist = length(light_dir);
@@ -696,14 +1218,18 @@ vec3 calcShade(vec3 pt, vec3 rd, rt_material material, vec3 normal, bool doShado
 
 		calcShade2(light_dir, light_color, light.intensity, pt, rd, material, normal, doShadow, dist, distDiv, diffuse, specular);
 	}
-	for (int i = 0; i < LIGHT_DIRECT_SIZE; i++) {
-		light_color = lights_direct[i].color;
-		light_dir = - lights_direct[i].direction;
+	#endif
+	#if HAS_DIRECT_LIGHTS
+	for (int i = 0; i < light_direct_count; i++) {
+		rt_light_direct light = getLightDirect(i);
+		light_color = light.color;
+		light_dir = - light.direction;
 		dist = maxDist;
 		distDiv = 1;
 
-		calcShade2(light_dir, light_color, lights_direct[i].intensity, pt, rd, material, normal, doShadow, dist, distDiv, diffuse, specular);
+		calcShade2(light_dir, light_color, light.intensity, pt, rd, material, normal, doShadow, dist, distDiv, diffuse, specular);
 	}
+	#endif
 	pixelColor += diffuse * material.kd + specular * material.ks;
 	return pixelColor;
 }
@@ -743,40 +1269,79 @@ float FresnelReflectAmount(float n1, float n2, vec3 normal, vec3 incident, float
 
 hit_record get_hit_info(vec3 ro, vec3 rd, vec3 pt, float t, int num, int type) {
 	hit_record hr;
+	#if HAS_SPHERES
 	if (type == TYPE_SPHERE) {
-		rt_sphere sphere = spheres[num];
-		hr = hit_record(sphere.mat, normalize(pt - sphere.obj.xyz), 0, 1);
+		rt_sphere sphere = getSphere(num);
+		hr = hit_record(getMaterialById(sphere.material), normalize(pt - sphere.obj.xyz), 0, 1);
+		#if HAS_TEXTURES
 		if (sphere.textureNum != 0) {
 			vec4 texColor = getSphereTexture(hr.normal, sphere.quat_rotation, sphere.textureNum);
 			hr.mat.color = texColor.rgb;
 			hr.alpha = texColor.a;
 		}
+		#endif
 	}
+	#endif
+	#if HAS_PLANES
 	if (type == TYPE_PLANE) {
-		hr = hit_record(planes[num].mat, normalize(planes[num].normal), 0, 1);
+		rt_plane plane = getPlane(num);
+		hr = hit_record(getMaterialById(plane.material), normalize(plane.normal), 0, 1);
 	}
+	#endif
+	#if HAS_SURFACES
 	if (type == TYPE_SURFACE) {
-		hr = hit_record(surfaces[num].mat, getSurfaceNormal(ro, rd, t, num), 0, 1);
+		hr = hit_record(getMaterialById(getSurface(num).material), getSurfaceNormal(ro, rd, t, num), 0, 1);
 	}
+	#endif
+	#if HAS_BOXES
 	if (type == TYPE_BOX) {
-		rt_box box = boxes[num];
-		hr = hit_record(box.mat, opt_normal, 0, 1);
+		rt_box box = getBox(num);
+		hr = hit_record(getMaterialById(box.material), opt_normal, 0, 1);
+		#if HAS_TEXTURES
 		if (box.textureNum != 0) {
 			hr.mat.color = getBoxTexture(pt, opt_normal, num).rgb;
 		}
+		#endif
 	}
+	#endif
+	#if HAS_TORUSES
 	if (type == TYPE_TORUS) {
-		hr = hit_record(toruses[num].mat, getTorusNormal(ro, rd, t, num), 0, 1);
+		hr = hit_record(getMaterialById(getTorus(num).material), getTorusNormal(ro, rd, t, num), 0, 1);
 	}
+	#endif
+	#if HAS_RINGS
 	if (type == TYPE_RING) {
-		rt_ring ring = rings[num];
-		hr = hit_record(ring.mat, getRingNormal(num), 0, 1);
+		rt_ring ring = getRing(num);
+		hr = hit_record(getMaterialById(ring.material), getRingNormal(num), 0, 1);
+		#if HAS_TEXTURES
 		if (ring.textureNum != 0) {
 			vec4 texColor = getRingTexture(ring.textureNum, opt_uv);
 			hr.mat.color = texColor.rgb;
 			hr.alpha = texColor.a;
 		}
+		#endif
 	}
+	#endif
+	#if HAS_INSTANCES
+	if (type == TYPE_INSTANCE) {
+		rt_instance instance = getInstance(num);
+		rt_prototype prototype = getPrototype(instance.prototype);
+		vec3 local, normal;
+		getInstanceHitLocal(instance, prototype, pt, local, normal);
+		hr = hit_record(getMaterialById(instance.material), normal * instance.rotation, 0, 1);
+		#if HAS_TEXTURES
+		if (prototype.textureNum != 0) {
+			if (prototype.type == TYPE_BOX) {
+				hr.mat.color = getBoxTextureLocal(local, normal, prototype.textureNum).rgb;
+			} else if (prototype.type == TYPE_SPHERE) {
+				vec4 texColor = getSphereTexture(normal, vec4(0, 0, 0, 1), prototype.textureNum);
+				hr.mat.color = texColor.rgb;
+				hr.alpha = texColor.a;
+			}
+		}
+		#endif
+	}
+	#endif
 	float distance = length(pt - ro);
 	hr.bias_mult = (9e-3 * distance + 35) / 35e3;
 
@@ -790,7 +1355,7 @@ vec3 getReflectedColor(vec3 ro, vec3 rd)
 	vec3 pt;
 	int num, type;
 	float t = calcInter(ro, rd, num, type);
-	if (type == TYPE_POINT_LIGHT) return lights_point[num].color;
+	if (type == TYPE_POINT_LIGHT) return getLightPoint(num).color;
 	hit_record hr;
 	if(t < maxDist) {
 		pt = ro + rd * t;
@@ -801,6 +1366,209 @@ vec3 getReflectedColor(vec3 ro, vec3 rd)
 	return color;
 }
 
+#ifdef TILE_CLASSIFY
+// Tile pre-pass: one fragment per tile_size x tile_size pixels collects the objects a cone around all camera rays
+// of the tile may touch. Tests are conservative, a tile can be complex needlessly but never misses an object.
+
+struct ray_cone {
+	vec3 apex;
+	vec3 axis;
+	float cos_angle;
+	float sin_angle;
+};
+
+bool coneHitsSphere(ray_cone cone, vec3 center, float radius)
+{
+	vec3 v = center - cone.apex;
+	float dist2 = dot(v, v);
+	if (dist2 <= radius * radius)
+		return true;
+	// the sphere covers the directions within asin(radius / dist) of v
+	float dist = sqrt(dist2);
+	float sin_sphere = radius / dist;
+	float cos_sphere = sqrt(1 - sin_sphere * sin_sphere);
+	return dot(v, cone.axis) / dist >= cone.cos_angle * cos_sphere - cone.sin_angle * sin_sphere;
+}
+
+// a box point inside the cone is at most its distance * sin_angle away from the axis,
+// so the axis ray has to pass through the box grown by that much
+bool coneHitsBox(ray_cone cone, vec3 bmin, vec3 bmax)
+{
+	float far = length(max(abs(bmin - cone.apex), abs(bmax - cone.apex)));
+	vec3 grow = vec3(far * cone.sin_angle);
+	vec3 inv_rd = 1.0 / cone.axis;
+	vec3 t0 = (bmin - grow - cone.apex) * inv_rd;
+	vec3 t1 = (bmax + grow - cone.apex) * inv_rd;
+	vec3 tsmall = min(t0, t1);
+	vec3 tbig = max(t0, t1);
+	return max(max(tsmall.x, tsmall.y), tsmall.z) <= min(min(tbig.x, tbig.y), tbig.z) && min(min(tbig.x, tbig.y), tbig.z) >= 0;
+}
+
+bool coneHitsNode(ray_cone cone, int node)
+{
+	vec3 bmin = uintBitsToFloat(texelFetch(bvh_nodes, node * 2).xyz);
+	vec3 bmax = uintBitsToFloat(texelFetch(bvh_nodes, node * 2 + 1).xyz);
+	return coneHitsBox(cone, bmin, bmax);
+}
+
+// sphere around a bvh primitive, false for surfaces, see surfaceBoxHit
+bool primBounds(uint ref, out vec4 bounds)
+{
+	int num = refIndex(ref);
+	int type = refType(ref);
+	#if HAS_SPHERES
+	if (type == TYPE_SPHERE) {
+		bounds = getSphere(num).obj;
+		return true;
+	}
+	#endif
+	#if HAS_BOXES
+	if (type == TYPE_BOX) {
+		rt_box box = getBox(num);
+		bounds = vec4(box.pos, length(box.form));
+		return true;
+	}
+	#endif
+	#if HAS_TORUSES
+	if (type == TYPE_TORUS) {
+		rt_torus torus = getTorus(num);
+		bounds = vec4(torus.pos, torus.form.x + torus.form.y);
+		return true;
+	}
+	#endif
+	#if HAS_RINGS
+	if (type == TYPE_RING) {
+		rt_ring ring = getRing(num);
+		bounds = vec4(ring.pos, sqrt(ring.r2));
+		return true;
+	}
+	#endif
+	#if HAS_INSTANCES
+	if (type == TYPE_INSTANCE) {
+		rt_instance instance = getInstance(num);
+		bounds = vec4(instance.pos, getPrototype(instance.prototype).radius * instance.scale);
+		return true;
+	}
+	#endif
+	return false;
+}
+
+// surfaces are tested against their clip box when SceneManager managed to close it
+bool surfaceBoxHit(ray_cone cone, int num)
+{
+	rt_surface surface = getSurface(num);
+	if (any(greaterThanEqual(abs(surface.v_min), vec3(FLT_MAX))) || any(greaterThanEqual(abs(surface.v_max), vec3(FLT_MAX))))
+		return true;
+	return coneHitsBox(cone, surface.v_min, surface.v_max);
+}
+
+uint makeRef(int type, int num)
+{
+	return uint(type) << 28u | uint(num);
+}
+
+uint classifyTile(ray_cone cone)
+{
+	int count = 0;
+	uint ref = 0u;
+	#if HAS_PLANES
+	for (int i = 0; i < plane_count; i++) {
+		rt_plane plane = getPlane(i);
+		#ifdef PLANE_ONESIDE
+		// only hit from the front, by rays going against the normal
+		vec3 n = normalize(plane.normal);
+		if (dot(cone.apex - plane.pos, n) <= 0 || dot(cone.axis, -n) <= -cone.sin_angle)
+			continue;
+		#endif
+		if (++count > 1) return TILE_COMPLEX;
+		ref = makeRef(TYPE_PLANE, i);
+	}
+	#endif
+	#if HAS_POINT_LIGHTS
+	for (int i = 0; i < light_point_count; i++) {
+		vec4 light = getLightPoint(i).pos;
+		if (coneHitsSphere(cone, light.xyz, light.w)) {
+			if (++count > 1) return TILE_COMPLEX;
+			ref = makeRef(TYPE_POINT_LIGHT, i);
+		}
+	}
+	#endif
+	for (int i = 0; i < bvh_unbounded; i++) {
+		if (++count > 1) return TILE_COMPLEX;
+		ref = texelFetch(bvh_prims, i).r;
+	}
+
+	if (bvh_size == 0 || !coneHitsNode(cone, 0))
+		return count == 0 ? TILE_MISS : ref + 1u;
+
+	int stack[BVH_STACK_SIZE];
+	int sp = 0;
+	int node = 0;
+	while (true) {
+		int offset = int(texelFetch(bvh_nodes, node * 2).w);
+		int nodeCount = int(texelFetch(bvh_nodes, node * 2 + 1).w);
+		if (nodeCount > 0) {
+			for (int i = offset; i < offset + nodeCount; i++) {
+				uint prim = texelFetch(bvh_prims, i).r;
+				vec4 bounds;
+				#if HAS_SURFACES
+				if (primBounds(prim, bounds) ? !coneHitsSphere(cone, bounds.xyz, bounds.w) : !surfaceBoxHit(cone, refIndex(prim)))
+				#else
+				if (primBounds(prim, bounds) && !coneHitsSphere(cone, bounds.xyz, bounds.w))
+				#endif
+					continue;
+				if (++count > 1) return TILE_COMPLEX;
+				ref = prim;
+			}
+		} else {
+			bool hitLeft = coneHitsNode(cone, node + 1);
+			bool hitRight = coneHitsNode(cone, offset);
+			if (hitLeft && hitRight && sp < BVH_STACK_SIZE) 
+				stack[sp++] = offset;
+			if (hitLeft) { node = node + 1; continue; }
+			if (hitRight) { node = offset; continue; }
+		}
+
+		if (sp == 0) break;
+		node = stack[--sp];
+	}
+	return count == 0 ? TILE_MISS : ref + 1u;
+}
+
+void main()
+{
+	// corners of the tile with 2 pixels of margin for the accumulation jitter and rounding
+	vec2 lo = floor(gl_FragCoord.xy) * tile_size - 2;
+	vec2 hi = lo + tile_size + 4;
+	vec3 d0 = getRayDir(lo);
+	vec3 d1 = getRayDir(vec2(hi.x, lo.y));
+	vec3 d2 = getRayDir(vec2(lo.x, hi.y));
+	vec3 d3 = getRayDir(hi);
+
+	ray_cone cone;
+	cone.apex = scene.camera_pos;
+	cone.axis = normalize(d0 + d1 + d2 + d3);
+	cone.cos_angle = min(min(dot(cone.axis, d0), dot(cone.axis, d1)), min(dot(cone.axis, d2), dot(cone.axis, d3)));
+	cone.sin_angle = sqrt(max(1 - cone.cos_angle * cone.cos_angle, 0));
+	TileClass = classifyTile(cone);
+}
+#elif defined(VT_FEEDBACK)
+// Virtual texture feedback: one camera ray per block of canvas pixels, the tile its primary hit samples goes to
+// the target as (texture + 1, level, tile x, tile y) / 255 for VirtualTextures::update(), zero for no tile
+uniform float vt_feedback_scale;
+uniform vec2 vt_feedback_offset; // canvas pixel within the block, changes every frame
+
+void main()
+{
+	vec3 ro = vec3(scene.camera_pos);
+	vec3 rd = getRayDir(floor(gl_FragCoord.xy) * vt_feedback_scale + vt_feedback_offset);
+	int num, type;
+	float t = calcInter(ro, rd, num, type);
+	if (t < maxDist)
+		get_hit_info(ro, rd, ro + rd * t, t, num, type);
+	FragColor = vt_request.x < 0 ? vec4(0) : vec4(vt_request.x + 1, vt_request.yzw) / 255.;
+}
+#else
 void main()
 {
 	float reflectMultiplier,refractMultiplier,tm;
@@ -812,24 +1580,32 @@ void main()
 	vec3 mask = vec3(1.0);
 	vec3 color = vec3(0.0);
 	vec3 ro = vec3(scene.camera_pos);
-	vec3 rd = getRayDir();
+	vec2 pixel = getPixel();
+	vec3 rd = getRayDir(pixel + jitter);
 	float absorbDistance = 0.0;
 	int type = 0;
 	int num;
 	hit_record hr;
+	float primaryDist = 0.0; // 0 - the camera ray missed
+	bool primary = true;
 	
 	for(int i = 0; i < ITERATIONS; i++)
 	{
-		tm = calcInter(ro, rd, num, type);
+		tm = primary ? calcPrimaryInter(ro, rd, pixel, num, type) : calcInter(ro, rd, num, type);
+		primary = false;
 		if(tm < maxDist)
 		{
+			if (primaryDist == 0.0)
+				primaryDist = tm;
 			pt = ro + rd*tm;
 			hr = get_hit_info(ro, rd, pt, tm, num, type);
 
+			#if HAS_POINT_LIGHTS
 			if (type == TYPE_POINT_LIGHT) {
-				color += lights_point[num].color * mask;
+				color += getLightPoint(num).color * mask;
 				break;
 			}
+			#endif
 
 			mat = hr.mat;
 			n = hr.normal;
@@ -837,7 +1613,7 @@ void main()
 			bool outside = dot(rd, n) < 0;
 			n = outside ? n : -n;
 
-			#if TOTAL_INTERNAL_REFLECTION
+			#if TOTAL_INTERNAL_REFLECTION && HAS_REFRACTION
 			if (mat.refraction > 0) 
 				reflectMultiplier = FresnelReflectAmount( outside ? 1 : mat.refraction,
 													  	  outside ? mat.refraction : 1,
@@ -848,6 +1624,7 @@ void main()
 			#endif
 			refractMultiplier = 1 - reflectMultiplier;
 
+			#if HAS_REFRACTION
 			if(mat.refraction > 0.0) // Refractive
 			{
 				if (outside && mat.reflection > 0)
@@ -871,14 +1648,19 @@ void main()
 				i--;
 				#endif
 			}
-			else if(mat.reflection > 0.0) // Reflective
+			else
+			#endif
+			#if HAS_REFLECTION
+			if(mat.reflection > 0.0) // Reflective
 			{
 				ro = pt + n * hr.bias_mult;
 				color += calcShade(ro, rd, mat, n, true) * refractMultiplier * mask;
 				rd = reflect(rd, n);
 				mask *= reflectMultiplier;
 			}
-			else // Diffuse
+			else
+			#endif
+			// Diffuse
 			{
 				color += calcShade(pt + n * hr.bias_mult, rd, mat, n, true) * mask * hr.alpha;
 				if (hr.alpha < 1) {
@@ -894,9 +1676,11 @@ void main()
 			break;
 		}
 	}
+	float alpha = checkerboard >= 0 ? primaryDist : 1;
 	#if DBG == 0
-	FragColor = vec4(color,1);
+	FragColor = vec4(color,alpha);
 	#else
-	if (!dbgEd) FragColor = vec4(color,1);
+	if (!dbgEd) FragColor = vec4(color,alpha);
 	#endif
-}
\ No newline at end of file
+}
+#endif
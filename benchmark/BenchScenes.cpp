@@ -0,0 +1,248 @@
+#include "BenchScenes.h"
+#include <cmath>
+#include <cstdint>
+#include "SceneManager.h"
+#include "Surface.h"
+
+namespace
+{
+	const float PI_F = 3.14159265358979f;
+
+	// integer hash mapped to [0, 1), same sequence on every platform unlike <random> distributions
+	float hash(uint32_t i, uint32_t salt)
+	{
+		uint32_t x = i * 0x9e3779b9u + salt * 0x85ebca6bu;
+		x ^= x >> 16;
+		x *= 0x7feb352du;
+		x ^= x >> 15;
+		x *= 0x846ca68bu;
+		x ^= x >> 16;
+		return (x >> 8) / 16777216.0f;
+	}
+
+	glm::vec3 hash_color(uint32_t i)
+	{
+		return glm::vec3(0.2f + 0.8f * hash(i, 1), 0.2f + 0.8f * hash(i, 2), 0.2f + 0.8f * hash(i, 3));
+	}
+
+	bench_camera look_at(glm::vec3 position, glm::vec3 target)
+	{
+		const glm::vec3 dir = glm::normalize(target - position);
+		return { position, glm::degrees(std::atan2(dir.x, dir.z)), glm::degrees(std::asin(dir.y)) };
+	}
+
+	// circle around target, starts behind it on -z like the default camera
+	bench_camera orbit(glm::vec3 target, float radius, float height, float speed, float time)
+	{
+		const float a = time * speed;
+		return look_at(target + glm::vec3(std::sin(a) * radius, height, -std::cos(a) * radius), target);
+	}
+
+	void add_lights(scene_container& scene)
+	{
+		scene.lights_point.push_back(SceneManager::create_light_point({ 0, 20, 0, 0.5 }, { 1, 1, 1 }, 2, 0.02f, 0.002f));
+		scene.lights_direct.push_back(SceneManager::create_light_direct({ 3, -2, 1 }, { 1, 1, 1 }, 0.8f));
+	}
+
+	void init_common(scene_container& scene, int width, int height)
+	{
+		scene.scene = SceneManager::create_scene(width, height);
+		scene.ambient_color = glm::vec3{ 0.025, 0.025, 0.025 };
+		scene.shadow_ambient = glm::vec3{ 0.1, 0.1, 0.1 };
+		add_lights(scene);
+		scene.planes.push_back(SceneManager::create_plane({ 0, 1, 0 }, { 0, -2, 0 },
+			scene.add_material(SceneManager::create_material({ 0.5, 0.5, 0.5 }, 50, 0.1f))));
+	}
+
+	// 16x16 grid of reflective spheres bobbing up and down
+	void build_spheres(scene_container& scene, int width, int height)
+	{
+		init_common(scene, width, height);
+		for (int i = 0; i < 256; i++)
+		{
+			const glm::vec3 pos((i % 16 - 7.5f) * 2.5f, 0, (i / 16 - 7.5f) * 2.5f);
+			const float radius = 0.6f + 0.4f * hash(i, 4);
+			scene.spheres.push_back(SceneManager::create_sphere(pos, radius,
+				scene.add_material(SceneManager::create_material(hash_color(i), 50 + i % 4 * 50, i % 3 == 0 ? 0.4f : 0.05f))));
+		}
+	}
+
+	void animate_spheres(scene_container& scene, float time)
+	{
+		for (size_t i = 0; i < scene.spheres.size(); i++)
+			scene.spheres[i].obj.y = std::sin(time * 2 + i * 0.37f) * 0.5f;
+	}
+
+	bench_camera camera_spheres(float time)
+	{
+		return orbit(glm::vec3(0), 28, 10, 0.25f, time);
+	}
+
+	// 6x6 grid of spinning toruses, the quartic solver dominates
+	void build_toruses(scene_container& scene, int width, int height)
+	{
+		init_common(scene, width, height);
+		for (int i = 0; i < 36; i++)
+		{
+			const glm::vec3 pos((i % 6 - 2.5f) * 4, 0.5f, (i / 6 - 2.5f) * 4);
+			rt_torus torus = SceneManager::create_torus(pos, { 1.2f, 0.4f },
+				scene.add_material(SceneManager::create_material(hash_color(i), 200, i % 2 ? 0.3f : 0.1f)));
+			torus.quat_rotation = glm::quat(glm::vec3(hash(i, 5) * PI_F, hash(i, 6) * PI_F, 0));
+			scene.toruses.push_back(torus);
+		}
+	}
+
+	void animate_toruses(scene_container& scene, float time)
+	{
+		for (size_t i = 0; i < scene.toruses.size(); i++)
+			scene.toruses[i].quat_rotation = glm::quat(glm::vec3(hash(i, 5) * PI_F + time, hash(i, 6) * PI_F + time * 0.5f, 0));
+	}
+
+	bench_camera camera_toruses(float time)
+	{
+		return orbit(glm::vec3(0), 20, 8, 0.3f, time);
+	}
+
+	// 5x5 grid of clipped quadrics of every kind SurfaceFactory makes
+	void build_quadrics(scene_container& scene, int width, int height)
+	{
+		init_common(scene, width, height);
+		for (int i = 0; i < 25; i++)
+		{
+			const int material = scene.add_material(SceneManager::create_material(hash_color(i), 200, 0.2f));
+			rt_surface s;
+			switch (i % 6)
+			{
+				case 0: s = SurfaceFactory::GetEllipsoid(1.2f, 0.8f, 1.0f, material); break;
+				case 1: s = SurfaceFactory::GetEllipticCone(0.5f, 0.5f, 1, material); break;
+				case 2: s = SurfaceFactory::GetEllipticCylinder(0.6f, 0.6f, material); break;
+				case 3: s = SurfaceFactory::GetEllipticParaboloid(0.5f, 0.5f, material); break;
+				case 4: s = SurfaceFactory::GetEllipticHyperboloidOneSheet(0.5f, 0.5f, 0.7f, material); break;
+				default: s = SurfaceFactory::GetHyperbolicParaboloid(0.7f, 0.7f, material); break;
+			}
+			s.pos = glm::vec3((i % 5 - 2) * 4.5f, 0.5f, (i / 5 - 2) * 4.5f);
+			s.quat_rotation = glm::quat(glm::vec3(glm::radians(90.f), hash(i, 7) * PI_F, 0));
+			// clip box is in world space
+			s.xMin = s.pos.x - 1.5f; s.xMax = s.pos.x + 1.5f;
+			s.yMin = s.pos.y - 1.5f; s.yMax = s.pos.y + 1.5f;
+			s.zMin = s.pos.z - 1.5f; s.zMax = s.pos.z + 1.5f;
+			scene.surfaces.push_back(s);
+		}
+	}
+
+	bench_camera camera_quadrics(float time)
+	{
+		return orbit(glm::vec3(0), 18, 7, 0.3f, time);
+	}
+
+	// glass spheres and boxes, every hit spawns reflected and refracted rays up to reflect_depth
+	void build_refractive(scene_container& scene, int width, int height)
+	{
+		init_common(scene, width, height);
+		for (int i = 0; i < 36; i++)
+		{
+			const glm::vec3 pos((i % 6 - 2.5f) * 3, 0.2f, (i / 6 - 2.5f) * 3);
+			const int glass = scene.add_material(SceneManager::create_material(glm::vec3(1), 200, 0.1f, 1.1f + 0.4f * hash(i, 8),
+				hash_color(i) * 0.5f, 1));
+			if (i % 4 == 3)
+				scene.boxes.push_back(SceneManager::create_box(pos, glm::vec3(0.9f), glass));
+			else
+				scene.spheres.push_back(SceneManager::create_sphere(pos, 1.1f, glass, true));
+		}
+	}
+
+	bench_camera camera_refractive(float time)
+	{
+		return orbit(glm::vec3(0), 16, 5, 0.3f, time);
+	}
+
+	// thousands of objects scattered over a wide field, mostly a BVH traversal test
+	void build_procedural(scene_container& scene, int width, int height)
+	{
+		init_common(scene, width, height);
+		const float field = 200;
+		for (int i = 0; i < 4096; i++)
+		{
+			const glm::vec3 pos((hash(i, 9) - 0.5f) * field, hash(i, 10) * 4, (hash(i, 11) - 0.5f) * field);
+			const float size = 0.3f + 1.2f * hash(i, 12);
+			const int material = scene.add_material(SceneManager::create_material(hash_color(i), 100, i % 5 == 0 ? 0.3f : 0.0f));
+			switch (i % 8)
+			{
+				case 0:
+				case 1:
+				{
+					rt_box box = SceneManager::create_box(pos, glm::vec3(size, size * 0.7f, size), material);
+					box.quat_rotation = glm::quat(glm::vec3(0, hash(i, 13) * PI_F, 0));
+					scene.boxes.push_back(box);
+					break;
+				}
+				case 2:
+				{
+					rt_ring ring = SceneManager::create_ring(pos, size * 0.5f, size, material);
+					ring.quat_rotation = glm::quat(glm::vec3(hash(i, 14) * PI_F, 0, 0));
+					scene.rings.push_back(ring);
+					break;
+				}
+				default:
+					scene.spheres.push_back(SceneManager::create_sphere(pos, size, material));
+					break;
+			}
+		}
+	}
+
+	// flies over the field along z above the tallest objects, swaying from side to side
+	bench_camera camera_procedural(float time)
+	{
+		const glm::vec3 position(std::sin(time * 0.5f) * 20, 9, -90 + time * 15);
+		return look_at(position, position + glm::vec3(std::sin(time * 0.3f) * 10, -6, 30));
+	}
+
+	// the procedural field again, but every object is an instance of one of three prototypes
+	// sharing eight materials, so the scene data is a fraction of the size
+	void build_instances(scene_container& scene, int width, int height)
+	{
+		init_common(scene, width, height);
+		scene.prototypes.push_back(SceneManager::create_prototype(PROTOTYPE_SPHERE, glm::vec4(1, 0, 0, 0)));
+		scene.prototypes.push_back(SceneManager::create_prototype(PROTOTYPE_BOX, glm::vec4(1, 0.7f, 1, 0)));
+		scene.prototypes.push_back(SceneManager::create_prototype(PROTOTYPE_TORUS, glm::vec4(0.8f, 0.3f, 0, 0)));
+		const int firstMaterial = static_cast<int>(scene.materials.size());
+		for (int i = 0; i < 8; i++)
+			scene.add_material(SceneManager::create_material(hash_color(i), 100, i % 4 == 0 ? 0.3f : 0.0f));
+
+		const float field = 200;
+		for (int i = 0; i < 4096; i++)
+		{
+			const glm::vec3 pos((hash(i, 9) - 0.5f) * field, hash(i, 10) * 4, (hash(i, 11) - 0.5f) * field);
+			const float size = 0.3f + 1.2f * hash(i, 12);
+			const glm::quat rotation(glm::vec3(hash(i, 14) * PI_F, hash(i, 13) * PI_F, 0));
+			scene.instances.push_back(SceneManager::create_instance(i % 8 < 2 ? 1 : i % 8 == 2 ? 2 : 0, firstMaterial + i % 8,
+				pos, rotation, size));
+		}
+	}
+
+	void animate_instances(scene_container& scene, float time)
+	{
+		for (size_t i = 0; i < scene.instances.size(); i++)
+			scene.instances[i].quat_rotation = glm::quat(glm::vec3(hash(i, 14) * PI_F + time, hash(i, 13) * PI_F + time * 0.5f, 0));
+	}
+}
+
+const std::vector<bench_scene>& bench_scenes()
+{
+	static const std::vector<bench_scene> scenes =
+	{
+		{ "spheres", "256 animated spheres", build_spheres, camera_spheres, animate_spheres },
+		{ "toruses", "36 spinning toruses", build_toruses, camera_toruses, animate_toruses },
+		{ "quadrics", "25 clipped quadric surfaces", build_quadrics, camera_quadrics, nullptr },
+		{ "refractive", "36 glass spheres and boxes", build_refractive, camera_refractive, nullptr },
+		{ "procedural", "4096 spheres, boxes and rings", build_procedural, camera_procedural, nullptr },
+		{ "instances", "4096 spinning instances of 3 prototypes", build_instances, camera_procedural, animate_instances },
+	};
+	return scenes;
+}
+
+size_t bench_object_count(const scene_container& scene)
+{
+	return scene.spheres.size() + scene.planes.size() + scene.surfaces.size() + scene.boxes.size() +
+		scene.toruses.size() + scene.rings.size() + scene.instances.size();
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "scene.h"
+
+// camera placement for one frame, angles in degrees as SceneManager::set_camera takes them
+struct bench_camera
+{
+	glm::vec3 position;
+	float yaw;
+	float pitch;
+};
+
+// Reference scene for rt-bench. Everything is generated from fixed formulas, runs on any machine
+// see the same objects and camera path frame by frame.
+struct bench_scene
+{
+	const char* name;
+	const char* description;
+	void (*build)(scene_container& scene, int width, int height);
+	// time - seconds from the start of playback
+	bench_camera (*camera)(float time);
+	// moves objects every frame, nullptr - static scene
+	void (*animate)(scene_container& scene, float time);
+};
+
+const std::vector<bench_scene>& bench_scenes();
+size_t bench_object_count(const scene_container& scene);
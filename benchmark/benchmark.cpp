@@ -0,0 +1,277 @@
+#include <glad/glad.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "BenchScenes.h"
+#include "GLWrapper.h"
+#include "Profiler.h"
+#include "SceneAssets.h"
+#include "SceneManager.h"
+
+// Deterministic GPU benchmark: every reference scene is played back offscreen along its camera path
+// with a fixed 1/60 s step, results go to a JSON file to compare builds.
+//
+// rt-bench [--scene name] [--width N] [--height N] [--frames N] [--warmup N] [--no-smaa] [--checkerboard] [--no-tiles] [--out file.json] [--list]
+
+namespace
+{
+	const float TIME_STEP = 1.0f / 60;
+
+	struct bench_options
+	{
+		int width = 1280;
+		int height = 720;
+		int frames = 120;
+		int warmup = 10;
+		bool smaa = true;
+		bool checkerboard = false;
+		bool tiles = true;
+		std::string scene;
+		std::string out = "benchmark.json";
+	};
+
+	struct bench_result
+	{
+		std::string name;
+		size_t objects;
+		double seconds;
+		double fps;
+		double primary_rays_per_sec;
+		Profiler::stats frame;
+		std::vector<std::pair<std::string, Profiler::stats>> cpu;
+		std::vector<std::pair<std::string, Profiler::stats>> gpu;
+	};
+
+	std::string renderer;
+	std::string version;
+
+	bool parse_options(int argc, char* argv[], bench_options& options)
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			const std::string arg = argv[i];
+			const bool hasValue = i + 1 < argc;
+			if (arg == "--no-smaa")
+				options.smaa = false;
+			else if (arg == "--checkerboard")
+				options.checkerboard = true;
+			else if (arg == "--no-tiles")
+				options.tiles = false;
+			else if (arg == "--list")
+			{
+				for (const bench_scene& s : bench_scenes())
+					printf("%-12s %s\n", s.name, s.description);
+				exit(0);
+			}
+			else if (arg == "--scene" && hasValue)
+				options.scene = argv[++i];
+			else if (arg == "--width" && hasValue)
+				options.width = atoi(argv[++i]);
+			else if (arg == "--height" && hasValue)
+				options.height = atoi(argv[++i]);
+			else if (arg == "--frames" && hasValue)
+				options.frames = atoi(argv[++i]);
+			else if (arg == "--warmup" && hasValue)
+				options.warmup = atoi(argv[++i]);
+			else if (arg == "--out" && hasValue)
+				options.out = argv[++i];
+			else
+			{
+				fprintf(stderr, "Unknown argument %s\n", arg.c_str());
+				return false;
+			}
+		}
+
+		// fix ray direction issues
+		if (options.width % 2 == 1) options.width++;
+		if (options.height % 2 == 1) options.height++;
+		return options.width > 0 && options.height > 0 && options.frames > 0 && options.frames <= Profiler::HISTORY;
+	}
+
+	std::vector<std::pair<std::string, Profiler::stats>> collect_stats(const Profiler& profiler, bool gpu)
+	{
+		std::vector<std::pair<std::string, Profiler::stats>> result;
+		for (const std::string& name : profiler.get_names(gpu))
+		{
+			Profiler::stats s;
+			if (profiler.get_stats(name, gpu, s))
+				result.push_back(std::make_pair(name, s));
+		}
+		return result;
+	}
+
+	// each scene gets its own context, shaders are compiled for its defines like in the interactive mode
+	bool run_scene(const bench_scene& benchScene, const bench_options& options, bench_result& result)
+	{
+		GLWrapper glWrapper(options.width, options.height, false);
+		if (options.smaa)
+			glWrapper.enable_SMAA(ULTRA);
+		glWrapper.enable_offscreen();
+		if (options.checkerboard)
+			glWrapper.enable_checkerboard();
+		if (options.tiles)
+			glWrapper.enable_tile_classification();
+		if (!glWrapper.init_window())
+		{
+			fprintf(stderr, "Failed to create an offscreen OpenGL context\n");
+			return false;
+		}
+		renderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+		version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+
+		scene_container scene = {};
+		benchScene.build(scene, options.width, options.height);
+		rt_defines defines = scene.get_defines();
+		glWrapper.init_shaders(defines);
+		glWrapper.set_skybox(glWrapper.load_cubemap(skybox_faces(), false));
+		glWrapper.finish_textures();
+
+		SceneManager sceneManager(options.width, options.height, &scene, &glWrapper);
+		sceneManager.init();
+
+		{
+			Profiler profiler;
+			auto render = [&](int frame)
+			{
+				const float time = frame * TIME_STEP;
+				{
+					cpu_scope scope(glWrapper.getProfiler(), "animate");
+					if (benchScene.animate)
+						benchScene.animate(scene, time);
+				}
+				const bench_camera camera = benchScene.camera(time);
+				sceneManager.set_camera(camera.position, camera.yaw, camera.pitch);
+				{
+					cpu_scope scope(glWrapper.getProfiler(), "SceneManager::update");
+					sceneManager.update(TIME_STEP);
+				}
+				cpu_scope scope(glWrapper.getProfiler(), "draw");
+				glWrapper.draw();
+			};
+
+			// first frames pay for shader warmup and buffer allocation
+			for (int frame = 0; frame < options.warmup; frame++)
+				render(frame);
+			glFinish();
+
+			glWrapper.set_profiler(&profiler);
+			const auto start = std::chrono::steady_clock::now();
+			for (int frame = 0; frame < options.frames; frame++)
+			{
+				profiler.begin_frame();
+				render(options.warmup + frame);
+			}
+			glFinish();
+			profiler.begin_frame(); // closes the last frame
+			const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			profiler.flush();
+			glWrapper.set_profiler(nullptr);
+
+			result.name = benchScene.name;
+			result.objects = bench_object_count(scene);
+			result.seconds = elapsed.count();
+			result.fps = options.frames / result.seconds;
+			// checkerboard traces every other pixel
+			result.primary_rays_per_sec = result.fps * options.width * options.height / (options.checkerboard ? 2 : 1);
+			profiler.get_stats("frame", false, result.frame);
+			result.cpu = collect_stats(profiler, false);
+			result.gpu = collect_stats(profiler, true);
+		}
+
+		glWrapper.stop();
+		return true;
+	}
+
+	void write_stats(FILE* f, const Profiler::stats& s)
+	{
+		fprintf(f, "{ \"min_ms\": %.4f, \"avg_ms\": %.4f, \"p99_ms\": %.4f }", s.min, s.avg, s.p99);
+	}
+
+	void write_passes(FILE* f, const char* name, const std::vector<std::pair<std::string, Profiler::stats>>& passes)
+	{
+		fprintf(f, "      \"%s\": {", name);
+		for (size_t i = 0; i < passes.size(); i++)
+		{
+			fprintf(f, "%s\n        \"%s\": ", i ? "," : "", passes[i].first.c_str());
+			write_stats(f, passes[i].second);
+		}
+		fprintf(f, "\n      }");
+	}
+
+	bool write_results(const std::string& path, const bench_options& options, const std::vector<bench_result>& results)
+	{
+		FILE* f = fopen(path.c_str(), "w");
+		if (!f)
+			return false;
+
+		fprintf(f, "{\n");
+		fprintf(f, "  \"renderer\": \"%s\",\n", renderer.c_str());
+		fprintf(f, "  \"gl_version\": \"%s\",\n", version.c_str());
+		fprintf(f, "  \"width\": %d,\n  \"height\": %d,\n", options.width, options.height);
+		fprintf(f, "  \"frames\": %d,\n  \"warmup\": %d,\n", options.frames, options.warmup);
+		fprintf(f, "  \"smaa\": %s,\n", options.smaa ? "true" : "false");
+		fprintf(f, "  \"checkerboard\": %s,\n", options.checkerboard ? "true" : "false");
+		fprintf(f, "  \"tiles\": %s,\n", options.tiles ? "true" : "false");
+		fprintf(f, "  \"scenes\": [");
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const bench_result& r = results[i];
+			fprintf(f, "%s\n    {\n", i ? "," : "");
+			fprintf(f, "      \"name\": \"%s\",\n", r.name.c_str());
+			fprintf(f, "      \"objects\": %zu,\n", r.objects);
+			fprintf(f, "      \"seconds\": %.4f,\n", r.seconds);
+			fprintf(f, "      \"fps\": %.3f,\n", r.fps);
+			fprintf(f, "      \"primary_rays_per_sec\": %.0f,\n", r.primary_rays_per_sec);
+			fprintf(f, "      \"frame\": ");
+			write_stats(f, r.frame);
+			fprintf(f, ",\n");
+			write_passes(f, "gpu", r.gpu);
+			fprintf(f, ",\n");
+			write_passes(f, "cpu", r.cpu);
+			fprintf(f, "\n    }");
+		}
+		fprintf(f, "\n  ]\n}\n");
+		return fclose(f) == 0;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bench_options options;
+	if (!parse_options(argc, argv, options))
+	{
+		fprintf(stderr, "usage: rt-bench [--scene name] [--width N] [--height N] [--frames N (<= %d)] [--warmup N] [--no-smaa] [--checkerboard] [--no-tiles] [--out file.json] [--list]\n",
+			Profiler::HISTORY);
+		return 1;
+	}
+
+	std::vector<bench_result> results;
+	for (const bench_scene& s : bench_scenes())
+	{
+		if (!options.scene.empty() && options.scene != s.name)
+			continue;
+
+		bench_result result;
+		if (!run_scene(s, options, result))
+			return 1;
+		printf("%-12s %8.2f fps %10.2f Mrays/s  frame avg %.2f p99 %.2f ms\n", result.name.c_str(), result.fps,
+			result.primary_rays_per_sec / 1e6, result.frame.avg, result.frame.p99);
+		results.push_back(result);
+	}
+
+	if (results.empty())
+	{
+		fprintf(stderr, "Unknown scene %s, see --list\n", options.scene.c_str());
+		return 1;
+	}
+	if (!write_results(options.out, options, results))
+	{
+		fprintf(stderr, "Failed to write %s\n", options.out.c_str());
+		return 1;
+	}
+	std::cout << "Results written to " << options.out << std::endl;
+	return 0;
+}
@@ -0,0 +1,471 @@
+#include "Bvh.h"
+#include <algorithm>
+#include <cmath>
+#include "rt_math.h"
+
+namespace
+{
+	const int SAH_BINS = 16;
+	const float TRAVERSAL_COST = 0.5f; // relative to one primitive test
+	const float REBUILD_FACTOR = 2.0f; // rebuild when refitted tree cost grows that much
+
+	bool is_finite(const glm::vec3& v)
+	{
+		return std::abs(v.x) < FLT_MAX && std::abs(v.y) < FLT_MAX && std::abs(v.z) < FLT_MAX;
+	}
+
+	// bounds of a local space box [-extent, extent] placed with rt.frag's rotate(quat, world - pos) convention
+	aabb oriented_bounds(const glm::quat& q, const glm::vec3& pos, const glm::vec3& extent)
+	{
+		const glm::vec4 inv = rtmath::quat_inv(rtmath::to_vec4(q));
+		const glm::vec3 world_extent =
+			glm::abs(rtmath::rotate(inv, glm::vec3(1, 0, 0))) * extent.x +
+			glm::abs(rtmath::rotate(inv, glm::vec3(0, 1, 0))) * extent.y +
+			glm::abs(rtmath::rotate(inv, glm::vec3(0, 0, 1))) * extent.z;
+
+		aabb b;
+		b.min = pos - world_extent;
+		b.max = pos + world_extent;
+		return b;
+	}
+
+	// min of q * u^2 + l * u over [lo, hi], -FLT_MAX if it is unbounded below
+	float quadratic_min(float q, float l, float lo, float hi)
+	{
+		auto value = [&](float u) { return std::abs(u) < FLT_MAX ? q * u * u + l * u : -FLT_MAX; };
+		if (q > 0)
+			return value(glm::clamp(-l / (2 * q), lo, hi));
+		if (q == 0 && l == 0)
+			return 0;
+		if (q == 0)
+			return l > 0 ? value(lo) : value(hi);
+		return std::min(value(lo), value(hi));
+	}
+
+	// bounds of a quadric whose world clip box is open on some axes, like a cylinder clipped only along its axis.
+	// Needs the local axes to be aligned with the world ones, so the clip box is a box in local space too.
+	// Every squared term with a positive coefficient is limited by the minimum of the other terms
+	bool quadric_bounds(const rt_surface& s, aabb& b)
+	{
+		const glm::vec4 q = rtmath::to_vec4(s.quat_rotation);
+		const glm::vec3 clipMin(s.xMin, s.yMin, s.zMin);
+		const glm::vec3 clipMax(s.xMax, s.yMax, s.zMax);
+
+		// local = rotate(q, world - pos)
+		glm::vec3 lo(-FLT_MAX), hi(FLT_MAX);
+		for (int j = 0; j < 3; j++)
+		{
+			glm::vec3 axis(0);
+			axis[j] = 1;
+			const glm::vec3 local = rtmath::rotate(q, axis);
+			int i = 0;
+			for (int k = 1; k < 3; k++)
+				if (std::abs(local[k]) > std::abs(local[i]))
+					i = k;
+			if (std::abs(local[i]) < 1 - 1e-5f)
+				return false;
+
+			const float from = clipMin[j] > -FLT_MAX ? clipMin[j] - s.pos[j] : -FLT_MAX;
+			const float to = clipMax[j] < FLT_MAX ? clipMax[j] - s.pos[j] : FLT_MAX;
+			lo[i] = local[i] > 0 ? from : -to;
+			hi[i] = local[i] > 0 ? to : -from;
+		}
+
+		const glm::vec3 square(s.a, s.b, s.c);
+		const glm::vec3 linear(0, s.e, s.d);
+		for (int pass = 0; pass < 3; pass++)
+		{
+			for (int i = 0; i < 3; i++)
+			{
+				if (!(square[i] > 0))
+					continue;
+				// square[i] * u^2 + linear[i] * u <= rest
+				float rest = -s.f;
+				for (int k = 0; k < 3; k++)
+				{
+					const float m = k == i ? 0 : quadratic_min(square[k], linear[k], lo[k], hi[k]);
+					if (m == -FLT_MAX)
+						rest = FLT_MAX;
+					else if (rest < FLT_MAX)
+						rest -= m;
+				}
+				if (rest == FLT_MAX)
+					continue;
+
+				const float disc = linear[i] * linear[i] + 4 * square[i] * rest;
+				if (disc < 0)
+					return false;
+				const float root = std::sqrt(disc);
+				lo[i] = std::max(lo[i], (-linear[i] - root) / (2 * square[i]));
+				hi[i] = std::min(hi[i], (-linear[i] + root) / (2 * square[i]));
+			}
+		}
+		if (!is_finite(lo) || !is_finite(hi))
+			return false;
+
+		const glm::vec3 center = (lo + hi) * 0.5f;
+		const glm::vec3 world = s.pos + rtmath::rotate(rtmath::quat_inv(q), center);
+		b = oriented_bounds(s.quat_rotation, world, (hi - lo) * 0.5f);
+		b.min = glm::max(b.min, clipMin);
+		b.max = glm::min(b.max, clipMax);
+		return true;
+	}
+
+	// clip box, or the quadric inside it when that is smaller or the box is open
+	bool surface_bounds(const rt_surface& s, aabb& b)
+	{
+		if (quadric_bounds(s, b))
+			return true;
+		b.min = glm::vec3(s.xMin, s.yMin, s.zMin);
+		b.max = glm::vec3(s.xMax, s.yMax, s.zMax);
+		return is_finite(b.min) && is_finite(b.max);
+	}
+
+	// keep flat and tangent objects inside their boxes despite rounding
+	void pad_bounds(aabb& b)
+	{
+		const glm::vec3 pad = (glm::abs(b.min) + glm::abs(b.max)) * 1e-6f + 1e-4f;
+		b.min -= pad;
+		b.max += pad;
+	}
+}
+
+bool Bvh::get_bounds(const scene_container& scene, uint32_t ref, aabb& b)
+{
+	const int index = bvh_ref_index(ref);
+	switch (bvh_ref_type(ref))
+	{
+		case BVH_SPHERE:
+		{
+			const glm::vec4& obj = scene.spheres[index].obj;
+			b.min = glm::vec3(obj) - obj.w;
+			b.max = glm::vec3(obj) + obj.w;
+			break;
+		}
+		case BVH_SURFACE:
+		{
+			// clip box is in world space, quadrics without it are infinite unless their shape closes the open sides
+			if (!surface_bounds(scene.surfaces[index], b))
+				return false;
+			break;
+		}
+		case BVH_BOX:
+		{
+			const rt_box& box = scene.boxes[index];
+			b = oriented_bounds(box.quat_rotation, box.pos, box.form);
+			break;
+		}
+		case BVH_TORUS:
+		{
+			// torus lies in the local xy plane, x - radius, y - ring thickness
+			const rt_torus& torus = scene.toruses[index];
+			const float r = torus.form.x + torus.form.y;
+			b = oriented_bounds(torus.quat_rotation, torus.pos, glm::vec3(r, r, torus.form.y));
+			break;
+		}
+		case BVH_RING:
+		{
+			// flat disk in the local xy plane, r2 is the squared outer radius
+			const rt_ring& ring = scene.rings[index];
+			const float r = std::sqrt(ring.r2);
+			b = oriented_bounds(ring.quat_rotation, ring.pos, glm::vec3(r, r, 0));
+			break;
+		}
+		case BVH_INSTANCE:
+		{
+			// prototype box in its own space, scaled and placed
+			const rt_instance& instance = scene.instances[index];
+			const rt_prototype& prototype = scene.prototypes[instance.prototype];
+			glm::vec3 extent(prototype.radius);
+			if (prototype.type == PROTOTYPE_BOX)
+				extent = glm::vec3(prototype.form);
+			else if (prototype.type == PROTOTYPE_TORUS)
+				extent = glm::vec3(prototype.radius, prototype.radius, prototype.form.y);
+			b = oriented_bounds(instance.quat_rotation, instance.pos, extent * instance.scale);
+			break;
+		}
+		default:
+			return false;
+	}
+
+	pad_bounds(b);
+	return true;
+}
+
+void Bvh::fit_clip_box(rt_surface& s)
+{
+	aabb b;
+	if (!quadric_bounds(s, b))
+		return;
+	pad_bounds(b);
+	s.xMin = std::max(s.xMin, b.min.x);
+	s.yMin = std::max(s.yMin, b.min.y);
+	s.zMin = std::max(s.zMin, b.min.z);
+	s.xMax = std::min(s.xMax, b.max.x);
+	s.yMax = std::min(s.yMax, b.max.y);
+	s.zMax = std::min(s.zMax, b.max.z);
+}
+
+void Bvh::update_surface_bounds(const scene_container& scene)
+{
+	const size_t stride = sizeof(rt_surface);
+	surface_boxes.resize(scene.surfaces.size());
+	surface_bounded.resize(scene.surfaces.size());
+	for (const byte_range& r : surface_tracker.update(scene.surfaces.data(), scene.surfaces.size(), stride))
+	{
+		for (size_t i = r.begin / stride; i < r.end / stride; i++)
+			surface_bounded[i] = get_bounds(scene, bvh_make_ref(BVH_SURFACE, static_cast<int>(i)), surface_boxes[i]);
+	}
+}
+
+bool Bvh::prim_bounds(const scene_container& scene, uint32_t ref, aabb& b) const
+{
+	if (bvh_ref_type(ref) != BVH_SURFACE)
+		return get_bounds(scene, ref, b);
+	const int index = bvh_ref_index(ref);
+	b = surface_boxes[index];
+	return surface_bounded[index] != 0;
+}
+
+bool Bvh::update(const scene_container& scene)
+{
+	if (!counts_match(scene))
+	{
+		build(scene);
+		return true;
+	}
+
+	if (refit(scene) && (nodes.empty() || inner_area() <= built_cost * REBUILD_FACTOR))
+		return false;
+
+	build(scene);
+	return true;
+}
+
+void Bvh::build(const scene_container& scene)
+{
+	nodes.clear();
+	prims.clear();
+	unbounded_count = 0;
+	save_counts(scene);
+	update_surface_bounds(scene);
+
+	std::vector<build_ref> refs;
+	auto add = [&](int type, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			build_ref r;
+			r.ref = bvh_make_ref(type, static_cast<int>(i));
+			if (prim_bounds(scene, r.ref, r.bounds))
+			{
+				r.center = r.bounds.center();
+				refs.push_back(r);
+			}
+			else
+			{
+				prims.push_back(r.ref);
+				unbounded_count++;
+			}
+		}
+	};
+	add(BVH_SPHERE, scene.spheres.size());
+	add(BVH_SURFACE, scene.surfaces.size());
+	add(BVH_BOX, scene.boxes.size());
+	add(BVH_TORUS, scene.toruses.size());
+	add(BVH_RING, scene.rings.size());
+	add(BVH_INSTANCE, scene.instances.size());
+	std::stable_sort(prims.begin(), prims.end(), [](uint32_t a, uint32_t b) { return bvh_prim_cost(a) < bvh_prim_cost(b); });
+
+	if (!refs.empty())
+	{
+		nodes.reserve(refs.size() * 2);
+		build_node(refs, 0, static_cast<int>(refs.size()), 0);
+	}
+	built_cost = inner_area();
+}
+
+int Bvh::build_node(std::vector<build_ref>& refs, int begin, int end, int depth)
+{
+	const int index = static_cast<int>(nodes.size());
+	nodes.push_back(rt_bvh_node());
+
+	aabb bounds, centroids;
+	for (int i = begin; i < end; i++)
+	{
+		bounds.grow(refs[i].bounds);
+		centroids.grow(refs[i].center);
+	}
+	nodes[index].min = bounds.min;
+	nodes[index].max = bounds.max;
+
+	const int count = end - begin;
+	auto make_leaf = [&]
+	{
+		nodes[index].offset = static_cast<uint32_t>(prims.size());
+		nodes[index].count = static_cast<uint32_t>(count);
+		for (int i = begin; i < end; i++)
+			prims.push_back(refs[i].ref);
+		std::stable_sort(prims.end() - count, prims.end(), [](uint32_t a, uint32_t b) { return bvh_prim_cost(a) < bvh_prim_cost(b); });
+		return index;
+	};
+
+	if (count == 1 || depth >= MAX_DEPTH - 1)
+		return make_leaf();
+
+	// binned SAH over centroid bounds
+	const glm::vec3 extent = centroids.max - centroids.min;
+	int best_axis = -1, best_split = 0;
+	float best_cost = FLT_MAX;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (!(extent[axis] > 0))
+			continue;
+
+		aabb bin_bounds[SAH_BINS];
+		int bin_count[SAH_BINS] = {};
+		const float scale = SAH_BINS / extent[axis];
+		for (int i = begin; i < end; i++)
+		{
+			const int b = std::min(static_cast<int>((refs[i].center[axis] - centroids.min[axis]) * scale), SAH_BINS - 1);
+			bin_bounds[b].grow(refs[i].bounds);
+			bin_count[b]++;
+		}
+
+		float left_area[SAH_BINS - 1];
+		int left_count[SAH_BINS - 1];
+		aabb acc;
+		int n = 0;
+		for (int b = 0; b < SAH_BINS - 1; b++)
+		{
+			acc.grow(bin_bounds[b]);
+			n += bin_count[b];
+			left_area[b] = n ? acc.area() : 0;
+			left_count[b] = n;
+		}
+
+		acc = aabb();
+		n = 0;
+		for (int b = SAH_BINS - 1; b > 0; b--)
+		{
+			acc.grow(bin_bounds[b]);
+			n += bin_count[b];
+			if (n == 0 || left_count[b - 1] == 0)
+				continue;
+			const float cost = left_area[b - 1] * left_count[b - 1] + acc.area() * n;
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = b;
+			}
+		}
+	}
+
+	const float area = bounds.area();
+	const float split_cost = area > 0 ? TRAVERSAL_COST + best_cost / area : FLT_MAX;
+	if (count <= MAX_LEAF_SIZE && split_cost >= count)
+		return make_leaf();
+
+	int mid;
+	if (best_axis >= 0)
+	{
+		const float scale = SAH_BINS / extent[best_axis];
+		const float cmin = centroids.min[best_axis];
+		mid = static_cast<int>(std::partition(refs.begin() + begin, refs.begin() + end, [&](const build_ref& r)
+		{
+			return std::min(static_cast<int>((r.center[best_axis] - cmin) * scale), SAH_BINS - 1) < best_split;
+		}) - refs.begin());
+	}
+	else
+	{
+		// all centroids coincide, any split is as good as another
+		mid = begin + count / 2;
+	}
+
+	build_node(refs, begin, mid, depth + 1); // first child is always index + 1
+	const int right = build_node(refs, mid, end, depth + 1);
+	nodes[index].offset = static_cast<uint32_t>(right);
+	nodes[index].count = 0;
+	return index;
+}
+
+bool Bvh::refit(const scene_container& scene)
+{
+	update_surface_bounds(scene);
+	aabb pb;
+	for (int i = 0; i < unbounded_count; i++)
+		if (prim_bounds(scene, prims[i], pb))
+			return false;
+
+	// children are stored after their parent, so a reverse pass visits them first
+	for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; i--)
+	{
+		rt_bvh_node& node = nodes[i];
+		aabb b;
+		if (node.count > 0)
+		{
+			for (uint32_t p = node.offset; p < node.offset + node.count; p++)
+			{
+				if (!prim_bounds(scene, prims[p], pb))
+					return false;
+				b.grow(pb);
+			}
+		}
+		else
+		{
+			const rt_bvh_node& left = nodes[i + 1];
+			const rt_bvh_node& right = nodes[node.offset];
+			b.grow(left.min);
+			b.grow(left.max);
+			b.grow(right.min);
+			b.grow(right.max);
+		}
+		node.min = b.min;
+		node.max = b.max;
+	}
+	return true;
+}
+
+float Bvh::inner_area() const
+{
+	if (nodes.empty())
+		return 0;
+
+	aabb root;
+	root.min = nodes[0].min;
+	root.max = nodes[0].max;
+	const float root_area = root.area();
+	if (!(root_area > 0))
+		return 0;
+
+	float sum = 0;
+	for (const rt_bvh_node& node : nodes)
+	{
+		aabb b;
+		b.min = node.min;
+		b.max = node.max;
+		sum += b.area();
+	}
+	return sum / root_area;
+}
+
+bool Bvh::counts_match(const scene_container& scene) const
+{
+	return counts[0] == scene.spheres.size() &&
+		counts[1] == scene.surfaces.size() &&
+		counts[2] == scene.boxes.size() &&
+		counts[3] == scene.toruses.size() &&
+		counts[4] == scene.rings.size() &&
+		counts[5] == scene.instances.size();
+}
+
+void Bvh::save_counts(const scene_container& scene)
+{
+	counts[0] = scene.spheres.size();
+	counts[1] = scene.surfaces.size();
+	counts[2] = scene.boxes.size();
+	counts[3] = scene.toruses.size();
+	counts[4] = scene.rings.size();
+	counts[5] = scene.instances.size();
+}
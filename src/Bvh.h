@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "scene.h"
+#include "DirtyTracker.h"
+
+struct aabb
+{
+	glm::vec3 min = glm::vec3(FLT_MAX);
+	glm::vec3 max = glm::vec3(-FLT_MAX);
+
+	void grow(const glm::vec3& p)
+	{
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+
+	void grow(const aabb& b)
+	{
+		min = glm::min(min, b.min);
+		max = glm::max(max, b.max);
+	}
+
+	glm::vec3 center() const
+	{
+		return (min + max) * 0.5f;
+	}
+
+	float area() const
+	{
+		const glm::vec3 e = glm::max(max - min, glm::vec3(0));
+		return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+};
+
+// Primitive reference: type in the upper 4 bits, index in its scene_container vector in the rest.
+// Type values are the TYPE_* constants of rt.frag.
+enum bvh_prim_type
+{
+	BVH_SPHERE = 0,
+	BVH_SURFACE = 2,
+	BVH_BOX = 3,
+	BVH_TORUS = 4,
+	BVH_RING = 5,
+	BVH_INSTANCE = 7
+};
+
+inline uint32_t bvh_make_ref(int type, int index)
+{
+	return static_cast<uint32_t>(type) << 28 | static_cast<uint32_t>(index);
+}
+
+inline int bvh_ref_type(uint32_t ref)
+{
+	return static_cast<int>(ref >> 28);
+}
+
+inline int bvh_ref_index(uint32_t ref)
+{
+	return static_cast<int>(ref & 0x0fffffff);
+}
+
+// Rank of a primitive's intersection cost, leaves and the unbounded list are sorted by it
+// so shadow rays, which stop at the first opaque hit, try the cheap tests first.
+inline int bvh_prim_cost(uint32_t ref)
+{
+	switch (bvh_ref_type(ref))
+	{
+		case BVH_SPHERE: return 0;
+		case BVH_RING: return 1;
+		case BVH_BOX: return 2;
+		case BVH_INSTANCE: return 2; // a bounding sphere test, then its prototype
+		case BVH_SURFACE: return 3;
+		default: return 4; // torus, an iterative quartic solver
+	}
+}
+
+// Flattened node, two uvec4 texels in the bvh_nodes buffer.
+// Nodes are stored depth first, the first child of an inner node follows it directly.
+typedef struct {
+	glm::vec3 min;
+	uint32_t offset; // leaf: first ref in the prims list, inner: index of the second child
+	glm::vec3 max;
+	uint32_t count; // leaf: number of refs, inner: 0
+} rt_bvh_node;
+
+// Bounding volume hierarchy over spheres, surfaces, boxes, toruses, rings and instances.
+// Planes, point lights and surfaces without finite bounds are not in the tree,
+// unbounded surfaces are listed at the start of the prims list and tested for every ray.
+class Bvh
+{
+public:
+	static const int MAX_DEPTH = 32; // traversal stack size in rt.frag
+	static const int MAX_LEAF_SIZE = 4;
+
+	// builds the tree when primitive counts changed or refitted bounds degraded too much, refits otherwise
+	// returns true if the tree was rebuilt (prims list changed)
+	bool update(const scene_container& scene);
+	void build(const scene_container& scene);
+	// recomputes bounds for moved objects, topology stays the same
+	// returns false if an object became bounded or unbounded and the tree has to be rebuilt
+	bool refit(const scene_container& scene);
+
+	const std::vector<rt_bvh_node>& get_nodes() const { return nodes; }
+	const std::vector<uint32_t>& get_prims() const { return prims; }
+	int get_unbounded_count() const { return unbounded_count; }
+
+	static bool get_bounds(const scene_container& scene, uint32_t ref, aabb& bounds);
+	// shrinks the world clip box of a surface to the quadric inside it, the visible surface stays the same.
+	// intersectSurface slab tests the clip box before solving the quadric, a tight box rejects more rays
+	static void fit_clip_box(rt_surface& s);
+
+private:
+	struct build_ref
+	{
+		uint32_t ref;
+		aabb bounds;
+		glm::vec3 center;
+	};
+
+	std::vector<rt_bvh_node> nodes;
+	std::vector<uint32_t> prims;
+	int unbounded_count = 0;
+	// quadric bounds are expensive, they are kept per surface and recomputed only for changed ones
+	DirtyTracker surface_tracker;
+	std::vector<aabb> surface_boxes;
+	std::vector<unsigned char> surface_bounded;
+	float built_cost = 0;
+	size_t counts[6] = {};
+
+	void update_surface_bounds(const scene_container& scene);
+	// get_bounds with the cached surface bounds
+	bool prim_bounds(const scene_container& scene, uint32_t ref, aabb& bounds) const;
+	bool counts_match(const scene_container& scene) const;
+	void save_counts(const scene_container& scene);
+	int build_node(std::vector<build_ref>& refs, int begin, int end, int depth);
+	float inner_area() const;
+};
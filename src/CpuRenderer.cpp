@@ -0,0 +1,1154 @@
+#include "CpuRenderer.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <initializer_list>
+#include "Bvh.h"
+#include "ImageWriter.h"
+#include "rt_math.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_CPU_SSE 1
+#include <emmintrin.h>
+#else
+#define RT_CPU_SSE 0
+#endif
+
+// same switches as rt.frag
+#define SHADOW_ENABLED 1
+#define TOTAL_INTERNAL_REFLECTION 1
+#define DO_FRESNEL 1
+#define PLANE_ONESIDE 1
+#define REFLECT_REDUCE_ITERATION 1
+#define TORUS_ANALYTIC 1
+
+using namespace rtmath;
+
+namespace
+{
+	const float PI_F = 3.14159265358979f;
+	const float maxDist = 1000000.0f;
+
+	// rt.frag never gives back refraction iterations, cap them so a ray trapped inside a refractive object ends
+	const int MAX_REFRACT_STEPS = 64;
+
+	enum { TYPE_SPHERE, TYPE_PLANE, TYPE_SURFACE, TYPE_BOX, TYPE_TORUS, TYPE_RING, TYPE_POINT_LIGHT, TYPE_INSTANCE };
+
+	struct hit_record
+	{
+		rt_material mat;
+		glm::vec3 normal;
+		float bias_mult;
+		float alpha;
+	};
+
+	// ray origin and inverse direction for slab tests, lanes x, y, z and a padding lane
+	struct ray_simd
+	{
+#if RT_CPU_SSE
+		__m128 ro;
+		__m128 inv_rd;
+#else
+		glm::vec3 ro;
+		glm::vec3 inv_rd;
+#endif
+
+		ray_simd(glm::vec3 o, glm::vec3 rd)
+		{
+			const glm::vec3 inv = 1.0f / rd;
+#if RT_CPU_SSE
+			ro = _mm_set_ps(0, o.z, o.y, o.x);
+			inv_rd = _mm_set_ps(0, inv.z, inv.y, inv.x);
+#else
+			ro = o;
+			inv_rd = inv;
+#endif
+		}
+	};
+
+	glm::vec3 step(glm::vec3 edge, glm::vec3 x)
+	{
+		return glm::vec3(x.x < edge.x ? 0 : 1, x.y < edge.y ? 0 : 1, x.z < edge.z ? 0 : 1);
+	}
+
+	bool isBetween(glm::vec3 value, glm::vec3 min, glm::vec3 max)
+	{
+		return value.x > min.x && value.y > min.y && value.z > min.z &&
+			value.x < max.x && value.y < max.y && value.z < max.z;
+	}
+
+#if !TORUS_ANALYTIC
+	glm::vec2 cmul(glm::vec2 c1, glm::vec2 c2)
+	{
+		return glm::vec2(c1.x * c2.x - c1.y * c2.y, c1.x * c2.y + c1.y * c2.x);
+	}
+
+	glm::vec2 cinv(glm::vec2 c)
+	{
+		return glm::vec2(c.x, -c.y) / glm::dot(c, c);
+	}
+#endif
+
+	// Per frame state, methods follow rt.frag function by function
+	class Tracer
+	{
+	public:
+		Tracer(const scene_container& scene, const std::vector<rt_surface>& surfaces, const Bvh& bvh, const std::vector<CpuTexture>& textures, const CpuCubemap& skybox)
+			: scene(scene), surfaces(surfaces), bvh(bvh), textures(textures), skybox(skybox)
+		{
+			pixel_size = 1.0f / scene.scene.canvas_height;
+		}
+
+		glm::vec3 trace(float fragX, float fragY);
+
+	private:
+		const scene_container& scene;
+		const std::vector<rt_surface>& surfaces; // clip boxes fitted like SceneManager uploads them
+		const Bvh& bvh;
+		const std::vector<CpuTexture>& textures;
+		const CpuCubemap& skybox;
+		float pixel_size;
+
+		// rt.frag globals, set by box and ring intersections
+		glm::vec3 opt_normal;
+		glm::vec2 opt_uv;
+
+		const CpuTexture* texture(int texNum) const
+		{
+			return texNum > 0 && texNum < static_cast<int>(textures.size()) ? &textures[texNum] : nullptr;
+		}
+
+		glm::vec4 sample(int texNum, glm::vec2 uv) const
+		{
+			const CpuTexture* tex = texture(texNum);
+			return tex ? tex->sample(uv) : glm::vec4(0, 0, 0, 1);
+		}
+
+		glm::vec3 getRayDir(float fragX, float fragY) const;
+		glm::vec4 getSphereTexture(glm::vec3 sphereNormal, glm::vec4 quat, int texNum, float t, float radius) const;
+		static bool intersectSphere(glm::vec3 ro, glm::vec3 rd, glm::vec4 object, bool hollow, float tmin, float& t);
+		static bool intersectPlane(glm::vec3 ro, glm::vec3 rd, glm::vec3 n, glm::vec3 p, float tmin, float& t);
+		bool intersectRing(glm::vec3 ro, glm::vec3 rd, int num, float tmin, float& t);
+		glm::vec3 getRingNormal(int num) const;
+		static bool intersectBoxLocal(glm::vec3 roo, glm::vec3 rdd, glm::vec3 form, float tmin, float& t, glm::vec3& nor);
+		bool intersectBox(glm::vec3 ro, glm::vec3 rd, int num, float tmin, float& t);
+		glm::vec4 getBoxTextureLocal(glm::vec3 pt, glm::vec3 normal, int texNum) const;
+		glm::vec4 getBoxTexture(glm::vec3 pt, glm::vec3 normal, int num) const;
+		static bool intersectTorusLocal(glm::vec3 ro, glm::vec3 rd, glm::vec2 form, float tmin, float& t);
+		bool intersectTorus(glm::vec3 ro, glm::vec3 rd, int num, float tmin, float& t) const;
+		static glm::vec3 getTorusNormalLocal(glm::vec3 pos, glm::vec2 form);
+		glm::vec3 getTorusNormal(glm::vec3 ro, glm::vec3 rd, float t, int num) const;
+		bool intersectSurface(glm::vec3 ro, glm::vec3 rd, int num, float tmin, float& t) const;
+		glm::vec3 getSurfaceNormal(glm::vec3 ro, glm::vec3 rd, float t, int num) const;
+		bool intersectInstance(glm::vec3 ro, glm::vec3 rd, int num, float tmin, float& t);
+		void getInstanceHitLocal(const rt_instance& instance, const rt_prototype& prototype, glm::mat3 rotation, glm::vec3 pt, glm::vec3& local, glm::vec3& normal) const;
+		bool intersectPrim(glm::vec3 ro, glm::vec3 rd, uint32_t ref, bool hollow, float tmin, float& t);
+		static bool intersectNode(const ray_simd& ray, const rt_bvh_node& node, float tmin, float& tnear);
+		void bvhClosestHit(glm::vec3 ro, glm::vec3 rd, float& tmin, int& num, int& type);
+		float bvhShadow(glm::vec3 ro, glm::vec3 rd, float dist);
+		float calcInter(glm::vec3 ro, glm::vec3 rd, int& num, int& type);
+		float inShadow(glm::vec3 ro, glm::vec3 rd, float dist);
+		void calcShade2(glm::vec3 light_dir, glm::vec3 light_color, float intensity, glm::vec3 pt, glm::vec3 rd, const rt_material& material, glm::vec3 normal, bool doShadow, float dist, float distDiv, glm::vec3& diffuse, glm::vec3& specular);
+		glm::vec3 calcShade(glm::vec3 pt, glm::vec3 rd, const rt_material& material, glm::vec3 normal, bool doShadow);
+		static float getFresnel(glm::vec3 normal, glm::vec3 rd, float reflection);
+		static float FresnelReflectAmount(float n1, float n2, glm::vec3 normal, glm::vec3 incident, float refl);
+		hit_record get_hit_info(glm::vec3 ro, glm::vec3 rd, glm::vec3 pt, float t, int num, int type);
+		glm::vec3 getReflectedColor(glm::vec3 ro, glm::vec3 rd);
+	};
+
+	glm::vec3 Tracer::getRayDir(float fragX, float fragY) const
+	{
+		const glm::vec3 result = glm::vec3((glm::vec2(fragX, fragY) - glm::vec2(scene.scene.canvas_width, scene.scene.canvas_height) / 2.0f) / static_cast<float>(scene.scene.canvas_height), 1);
+		return glm::normalize(rotate(scene.scene.quat_camera_rotation, result));
+	}
+
+	glm::vec4 Tracer::getSphereTexture(glm::vec3 sphereNormal, glm::vec4 quat, int texNum, float t, float radius) const
+	{
+		if (quat != glm::vec4(0, 0, 0, 1)) {
+			sphereNormal = rotate(quat, sphereNormal);
+		}
+		const float u = 0.5f + atan2(sphereNormal.z, sphereNormal.x) / (2 * PI_F);
+		const float v = 0.5f - asin(glm::clamp(sphereNormal.y, -1.0f, 1.0f)) / PI_F;
+		const glm::vec2 uv(u, v);
+
+		// no screen space derivatives here, fwidth(uv) is estimated from the pixel footprint at the hit distance
+		const float footprint = t * pixel_size;
+		const float latitude_scale = std::max(std::sqrt(std::max(0.0f, 1 - sphereNormal.y * sphereNormal.y)), 1e-3f);
+		glm::vec2 df(footprint / (2 * PI_F * radius * latitude_scale), footprint / (PI_F * radius));
+		if (df.x > 0.5f) df.x = 0;
+
+		const CpuTexture* tex = texture(texNum);
+		return tex ? tex->sample_lod(uv, std::log2(std::max(df.x, df.y) * 1024)) : glm::vec4(0, 0, 0, 1);
+	}
+
+	bool Tracer::intersectSphere(glm::vec3 ro, glm::vec3 rd, glm::vec4 object, bool hollow, float tmin, float& t)
+	{
+		const glm::vec3 oc = ro - glm::vec3(object);
+		const float b = glm::dot(oc, rd);
+		const float c = glm::dot(oc, oc) - object.w * object.w;
+		const float h = b * b - c;
+		if (h < 0) return false;
+		const float h_sqrt = std::sqrt(h);
+		t = -b - h_sqrt;
+		if (hollow && t < 0)
+			t = -b + h_sqrt;
+		return t > 0 && t < tmin;
+	}
+
+	bool Tracer::intersectPlane(glm::vec3 ro, glm::vec3 rd, glm::vec3 n, glm::vec3 p, float tmin, float& t)
+	{
+		const float denom = glm::clamp(glm::dot(n, rd), -1.0f, 1.0f);
+#if PLANE_ONESIDE
+		if (denom < -1e-6f)
+#else
+		if (std::abs(denom) > 1e-6f)
+#endif
+		{
+			const glm::vec3 p_ro = p - ro;
+			t = glm::dot(p_ro, n) / denom;
+			return (t > 0) && (t < tmin);
+		}
+
+		return false;
+	}
+
+	bool Tracer::intersectRing(glm::vec3 ro, glm::vec3 rd, int num, float tmin, float& t)
+	{
+		const rt_ring& ring = scene.rings[num];
+		const glm::mat3 rotation = rotation_matrix(ring.quat_rotation);
+		rd = rotation * rd;
+		ro = rotation * (ro - ring.pos);
+
+		t = -ro.z / rd.z;
+
+		const float x = ro.x + rd.x * t;
+		const float y = ro.y + rd.y * t;
+
+		const float p = x * x + y * y;
+
+		if (t > 0 && t < tmin && p < ring.r2 && p > ring.r1) {
+			const float cosv = glm::dot(glm::normalize(glm::vec2(x, y)), glm::vec2(1, 0));
+			opt_uv = glm::vec2((p - ring.r1) / (ring.r2 - ring.r1), cosv);
+			return true;
+		}
+		return false;
+	}
+
+	glm::vec3 Tracer::getRingNormal(int num) const
+	{
+		const rt_ring& ring = scene.rings[num];
+		return glm::vec3(0, 0, -1) * rotation_matrix(ring.quat_rotation);
+	}
+
+	// ray in the box' own space, nor - normal of the hit face there
+	bool Tracer::intersectBoxLocal(glm::vec3 roo, glm::vec3 rdd, glm::vec3 form, float tmin, float& t, glm::vec3& nor)
+	{
+		const glm::vec3 m = 1.0f / rdd;
+		const glm::vec3 n = m * roo;
+		const glm::vec3 k = glm::abs(m) * form;
+
+		const glm::vec3 t1 = -n - k;
+		const glm::vec3 t2 = -n + k;
+
+		const float tN = std::max(std::max(t1.x, t1.y), t1.z);
+		const float tF = std::min(std::min(t2.x, t2.y), t2.z);
+
+		if (tN > tF || tF < 0) return false;
+
+		if (tN >= tmin)
+			return false;
+
+		const glm::vec3 t1_yzx(t1.y, t1.z, t1.x);
+		const glm::vec3 t1_zxy(t1.z, t1.x, t1.y);
+		nor = -glm::sign(rdd) * step(t1_yzx, t1) * step(t1_zxy, t1);
+		t = tN;
+		return true;
+	}
+
+	bool Tracer::intersectBox(glm::vec3 ro, glm::vec3 rd, int num, float tmin, float& t)
+	{
+		const rt_box& box = scene.boxes[num];
+		const glm::mat3 rotation = rotation_matrix(box.quat_rotation);
+		// convert from ray to box space
+		glm::vec3 nor;
+		if (!intersectBoxLocal(rotation * (ro - box.pos), rotation * rd, box.form, tmin, t, nor))
+			return false;
+		// convert to ray space
+		opt_normal = nor * rotation;
+		return true;
+	}
+
+	// point and normal in the box' own space
+	glm::vec4 Tracer::getBoxTextureLocal(glm::vec3 pt, glm::vec3 normal, int texNum) const
+	{
+		return std::abs(normal.x) * sample(texNum, 0.5f * glm::vec2(pt.z, pt.y) - glm::vec2(0.5f)) +
+			std::abs(normal.y) * sample(texNum, 0.5f * glm::vec2(pt.z, pt.x) - glm::vec2(0.5f)) +
+			std::abs(normal.z) * sample(texNum, 0.5f * glm::vec2(pt.x, pt.y) - glm::vec2(0.5f));
+	}
+
+	glm::vec4 Tracer::getBoxTexture(glm::vec3 pt, glm::vec3 normal, int num) const
+	{
+		const rt_box& box = scene.boxes[num];
+		const glm::mat3 rotation = rotation_matrix(box.quat_rotation);
+		return getBoxTextureLocal(rotation * (pt - box.pos), rotation * normal, box.textureNum);
+	}
+
+	// begin torus section
+#if TORUS_ANALYTIC
+	// smallest positive root of the torus quartic, FLT_MAX if none. rd must be normalized.
+	// Closed form (Ferrari): the quartic is split into two quadratics through the largest root of its resolvent cubic,
+	// then each root gets Newton steps on the original polynomial to win back the digits float loses on the way
+	float solveTorus(glm::vec3 ro, glm::vec3 rd, glm::vec2 torus)
+	{
+		const float R2 = torus.x * torus.x;
+		const float n = glm::dot(ro, rd);
+		const float k = (glm::dot(ro, ro) - torus.y * torus.y - R2) / 2;
+
+		// t^4 + 4*k3*t^3 + 4*k2*t^2 + 8*k1*t + 4*k0, depressed by t = y - k3 to y^4 + p*y^2 + q*y + r
+		const float k3 = n;
+		const float k2 = n * n + R2 * rd.z * rd.z + k;
+		const float k1 = k * n + R2 * ro.z * rd.z;
+		const float k0 = k * k + R2 * ro.z * ro.z - R2 * torus.y * torus.y;
+		const float p = 4 * k2 - 6 * k3 * k3;
+		const float q = 8 * (k3 * (k3 * k3 - k2) + k1);
+		const float r = k3 * k3 * (4 * k2 - 3 * k3 * k3) - 8 * k3 * k1 + 4 * k0;
+
+		// resolvent m^3 + p*m^2 + (p^2/4 - r)*m - q^2/8, depressed by m = x - p/3 to x^3 + P*x + Q
+		const float P = -p * p / 12 - r;
+		const float Q = -p * p * p / 108 + p * r / 3 - q * q / 8;
+		const float D = Q * Q / 4 + P * P * P / 27;
+		float x;
+		if (D < 0) {
+			x = 2 * std::sqrt(-P / 3) * std::cos(std::acos(glm::clamp(1.5f * Q / P * std::sqrt(-3 / P), -1.0f, 1.0f)) / 3);
+		}
+		else {
+			const float sd = std::sqrt(D);
+			x = std::cbrt(-Q / 2 + sd) + std::cbrt(-Q / 2 - sd);
+		}
+		const float m = x - p / 3;
+
+		float ys[4];
+		int count = 0;
+		if (m <= 1e-6f) {
+			// q == 0, biquadratic
+			const float d = p * p - 4 * r;
+			if (d < 0) return FLT_MAX;
+			for (float y2 : { (-p - std::sqrt(d)) / 2, (-p + std::sqrt(d)) / 2 }) {
+				if (y2 < 0) continue;
+				ys[count++] = -std::sqrt(y2);
+				ys[count++] = std::sqrt(y2);
+			}
+		}
+		else {
+			// (y^2 + p/2 + m)^2 = (s*y - q/(2*s))^2
+			const float s = std::sqrt(2 * m);
+			for (float sg : { 1.0f, -1.0f }) {
+				const float d = s * s - 4 * (p / 2 + m + sg * q / (2 * s));
+				if (d < 0) continue;
+				ys[count++] = (sg * s - std::sqrt(d)) / 2;
+				ys[count++] = (sg * s + std::sqrt(d)) / 2;
+			}
+		}
+
+		float result = FLT_MAX;
+		for (int i = 0; i < count; i++) {
+			float t = ys[i] - k3;
+			for (int j = 0; j < 2; j++) {
+				const float a = t * t + 2 * n * t + 2 * k;
+				const float b = ro.z + t * rd.z;
+				const float df = 4 * a * (t + n) + 8 * R2 * b * rd.z;
+				if (df != 0) t -= (a * a + 4 * R2 * (b * b - torus.y * torus.y)) / df;
+			}
+			if (t > 0) result = std::min(result, t);
+		}
+		return result;
+	}
+#else
+	glm::vec2 cTorus(glm::vec2 t, glm::vec3 ro, glm::vec3 rd, glm::vec2 torus)
+	{
+		const float R2 = torus.x * torus.x;
+		const float r2 = torus.y * torus.y;
+		const glm::vec2 t2 = glm::vec2(t.x * t.x - t.y * t.y, 2 * t.x * t.y);
+		glm::vec2 res = t2 * glm::dot(rd, rd) + 2.0f * t * glm::dot(ro, rd) + glm::vec2(glm::dot(ro, ro) + R2 - r2, 0);
+		res = cmul(res, res);
+		const glm::vec2 rd_xy(rd), ro_xy(ro);
+		const glm::vec2 res2 = 4 * R2 * (t2 * glm::dot(rd_xy, rd_xy) + 2.0f * t * glm::dot(ro_xy, rd_xy) + glm::vec2(glm::dot(ro_xy, ro_xy), 0));
+
+		return res - res2;
+	}
+
+	float DKstep(glm::vec2& c0, glm::vec2 c1, glm::vec2 c2, glm::vec2 c3, glm::vec3 ro, glm::vec3 rd, glm::vec2 torus)
+	{
+		glm::vec2 fc = cTorus(c0, ro, rd, torus);
+		fc = cmul(fc, cinv(cmul(c0 - c1, cmul(c0 - c2, c0 - c3))));
+		c0 -= fc;
+		return std::max(std::abs(fc.x), std::abs(fc.y));
+	}
+#endif
+
+	// ray in the torus' own space
+	bool Tracer::intersectTorusLocal(glm::vec3 ro, glm::vec3 rd, glm::vec2 form, float tmin, float& t)
+	{
+		t = FLT_MAX;
+
+		// bounding sphere rejection, most rays never get to the quartic
+		const float a = glm::dot(rd, rd);
+		const float b = glm::dot(ro, rd);
+		const float radius = form.x + form.y;
+		float h = b * b - a * (glm::dot(ro, ro) - radius * radius);
+		if (h < 0) return false;
+		h = std::sqrt(h);
+		float tnear = (-b - h) / a;
+		if (-b + h < 0 || tnear > tmin) return false;
+
+#if TORUS_ANALYTIC
+		// solve from the sphere entry point, a close origin keeps the float coefficients well-conditioned
+		tnear = std::max(tnear, 0.0f);
+		const float len = std::sqrt(a);
+		t = solveTorus(ro + rd * tnear, rd / len, form);
+		if (t == FLT_MAX) return false;
+		t = tnear + t / len;
+		return t < tmin;
+#else
+		const float eps = 0.001f;
+		glm::vec2 c0 = glm::vec2(1, 0);
+		glm::vec2 c1 = glm::vec2(0.4f, 0.9f);
+		glm::vec2 c2 = cmul(c1, glm::vec2(0.4f, 0.9f));
+		glm::vec2 c3 = cmul(c2, glm::vec2(0.4f, 0.9f));
+		for (int i = 0; i < 60; i++) {
+			float e = DKstep(c0, c1, c2, c3, ro, rd, form);
+			e = std::max(e, DKstep(c1, c2, c3, c0, ro, rd, form));
+			e = std::max(e, DKstep(c2, c3, c0, c1, ro, rd, form));
+			e = std::max(e, DKstep(c3, c0, c1, c2, ro, rd, form));
+			if (e < eps) break;
+		}
+		glm::vec4 rs = glm::vec4(c0.x, c1.x, c2.x, c3.x);
+		const glm::vec4 ri = glm::abs(glm::vec4(c0.y, c1.y, c2.y, c3.y));
+
+		for (int i = 0; i < 4; i++)
+			if (ri[i] > eps || rs[i] < 0) rs[i] = 10000;
+		t = std::min(std::min(rs.x, rs.y), std::min(rs.z, rs.w));
+		return t > 0 && t < 100 && t < tmin;
+#endif
+	}
+
+	bool Tracer::intersectTorus(glm::vec3 ro, glm::vec3 rd, int num, float tmin, float& t) const
+	{
+		const rt_torus& torus = scene.toruses[num];
+		const glm::mat3 rotation = rotation_matrix(torus.quat_rotation);
+		return intersectTorusLocal(rotation * (ro - torus.pos), rotation * rd, torus.form, tmin, t);
+	}
+
+	glm::vec3 Tracer::getTorusNormalLocal(glm::vec3 pos, glm::vec2 form)
+	{
+		return pos * (glm::dot(pos, pos) - form.y * form.y - form.x * form.x * glm::vec3(1, 1, -1));
+	}
+
+	glm::vec3 Tracer::getTorusNormal(glm::vec3 ro, glm::vec3 rd, float t, int num) const
+	{
+		const rt_torus& torus = scene.toruses[num];
+		const glm::mat3 rotation = rotation_matrix(torus.quat_rotation);
+		ro = rotation * (ro - torus.pos);
+		rd = rotation * rd;
+		return glm::normalize(getTorusNormalLocal(ro + rd * t, torus.form) * rotation);
+	}
+	// end torus section
+
+	// begin surface section
+	bool checkSurfaceEdges(glm::vec3 o, glm::vec3 d, float& tMin, float& tMax, glm::vec3 v_min, glm::vec3 v_max, float epsilon)
+	{
+		glm::vec3 pt = d * tMin + o;
+		if (!isBetween(pt, v_min, v_max))
+		{
+			if (tMax < epsilon) return false;
+			pt = d * tMax + o;
+			if (!isBetween(pt, v_min, v_max))
+				return false;
+			std::swap(tMin, tMax);
+		}
+		return true;
+	}
+
+	bool Tracer::intersectSurface(glm::vec3 ro, glm::vec3 rd, int num, float tmin, float& t) const
+	{
+		const glm::vec3 orig_ro = ro;
+		const glm::vec3 orig_rd = rd;
+		const rt_surface& surface = surfaces[num];
+
+		// slab test against the clip box, fitted to the quadric so rays passing by stop here
+		const glm::vec3 slab0 = (glm::vec3(surface.xMin, surface.yMin, surface.zMin) - ro) / rd;
+		const glm::vec3 slab1 = (glm::vec3(surface.xMax, surface.yMax, surface.zMax) - ro) / rd;
+		const glm::vec3 tsmall = glm::min(slab0, slab1);
+		const glm::vec3 tbig = glm::max(slab0, slab1);
+		const float tnear = std::max(std::max(tsmall.x, tsmall.y), tsmall.z);
+		const float tfar = std::min(std::min(tbig.x, tbig.y), tbig.z);
+		if (tnear > tfar || tfar < 0 || tnear > tmin)
+			return false;
+
+		const glm::mat3 rotation = rotation_matrix(surface.quat_rotation);
+		ro = rotation * (ro - surface.pos);
+		rd = rotation * rd;
+
+		const float a = surface.a;
+		const float b = surface.b;
+		const float c = surface.c;
+		const float d = surface.d;
+		const float e = surface.e;
+		const float f = surface.f;
+
+		const float d1 = rd.x;
+		const float d2 = rd.y;
+		const float d3 = rd.z;
+		const float o1 = ro.x;
+		const float o2 = ro.y;
+		const float o3 = ro.z;
+
+		const float p1 = 2 * a * d1 * o1 + 2 * b * d2 * o2 + 2 * c * d3 * o3 + d * d3 + d2 * e;
+		const float p2 = a * d1 * d1 + b * d2 * d2 + c * d3 * d3;
+		const float p3 = a * o1 * o1 + b * o2 * o2 + c * o3 * o3 + d * o3 + e * o2 + f;
+		const float p4 = std::sqrt(p1 * p1 - 4 * p2 * p3);
+
+		//division by zero
+		if (std::abs(p2) < 1e-6f)
+		{
+			t = -p3 / p1;
+			return t > tmin; // kept as in rt.frag
+		}
+
+		float min = FLT_MAX;
+		float max = FLT_MAX;
+
+		const float t1 = (-p1 - p4) / (2 * p2);
+		const float t2 = (-p1 + p4) / (2 * p2);
+
+		const float epsilon = 1e-4f;
+
+		if (t1 > epsilon && t1 < min)
+		{
+			min = t1;
+			max = t2;
+		}
+
+		if (t2 > epsilon && t2 < min)
+		{
+			min = t2;
+			max = t1;
+		}
+
+		if (!checkSurfaceEdges(orig_ro, orig_rd, min, max,
+			glm::vec3(surface.xMin, surface.yMin, surface.zMin), glm::vec3(surface.xMax, surface.yMax, surface.zMax), epsilon))
+			return false;
+
+		t = min;
+		return t < tmin;
+	}
+
+	glm::vec3 Tracer::getSurfaceNormal(glm::vec3 ro, glm::vec3 rd, float t, int num) const
+	{
+		const rt_surface& surface = surfaces[num];
+		const glm::mat3 rotation = rotation_matrix(surface.quat_rotation);
+		ro = ro - surface.pos;
+		ro = rotation * ro;
+		rd = rotation * rd;
+
+		const glm::vec3 tm = rd * t + ro;
+
+		glm::vec3 normal = glm::vec3(2 * surface.a * tm.x, 2 * surface.b * tm.y + surface.e, 2 * surface.c * tm.z + surface.d);
+		normal = normal * rotation;
+		return glm::normalize(normal);
+	}
+	// end surface section
+
+	// begin instance section
+	// The ray goes into the prototype's space, where distances are world ones divided by the scale.
+	// The bounding sphere rejects most rays before the shape test
+	bool Tracer::intersectInstance(glm::vec3 ro, glm::vec3 rd, int num, float tmin, float& t)
+	{
+		const rt_instance& instance = scene.instances[num];
+		const rt_prototype& prototype = scene.prototypes[instance.prototype];
+		const glm::mat3 rotation = rotation_matrix(instance.quat_rotation);
+		ro = rotation * (ro - instance.pos) / instance.scale;
+		rd = rotation * rd;
+		tmin /= instance.scale;
+		t = FLT_MAX;
+
+		const float b = glm::dot(ro, rd);
+		const float h = b * b - glm::dot(ro, ro) + prototype.radius * prototype.radius;
+		if (h < 0 || -b + std::sqrt(h) < 0 || -b - std::sqrt(h) > tmin)
+			return false;
+
+		bool hit = false;
+		if (prototype.type == PROTOTYPE_SPHERE) {
+			hit = intersectSphere(ro, rd, glm::vec4(0, 0, 0, prototype.form.x), false, tmin, t);
+		} else if (prototype.type == PROTOTYPE_BOX) {
+			glm::vec3 nor;
+			hit = intersectBoxLocal(ro, rd, glm::vec3(prototype.form), tmin, t, nor);
+			if (hit)
+				opt_normal = nor * rotation;
+		} else if (prototype.type == PROTOTYPE_TORUS) {
+			hit = intersectTorusLocal(ro, rd, glm::vec2(prototype.form), tmin, t);
+		}
+		if (hit)
+			t *= instance.scale;
+		return hit;
+	}
+
+	// point and normal of an instance hit in its prototype's space, box normals come from the intersection
+	void Tracer::getInstanceHitLocal(const rt_instance& instance, const rt_prototype& prototype, glm::mat3 rotation, glm::vec3 pt, glm::vec3& local, glm::vec3& normal) const
+	{
+		local = rotation * (pt - instance.pos) / instance.scale;
+		if (prototype.type == PROTOTYPE_SPHERE)
+			normal = local;
+		else if (prototype.type == PROTOTYPE_TORUS)
+			normal = getTorusNormalLocal(local, glm::vec2(prototype.form));
+		else
+			normal = rotation * opt_normal;
+		normal = glm::normalize(normal);
+	}
+	// end instance section
+
+	// begin bvh section
+	bool Tracer::intersectPrim(glm::vec3 ro, glm::vec3 rd, uint32_t ref, bool hollow, float tmin, float& t)
+	{
+		const int num = bvh_ref_index(ref);
+		switch (bvh_ref_type(ref))
+		{
+			case BVH_SPHERE: return intersectSphere(ro, rd, scene.spheres[num].obj, hollow && scene.spheres[num].hollow, tmin, t);
+			case BVH_SURFACE: return intersectSurface(ro, rd, num, tmin, t);
+			case BVH_BOX: return intersectBox(ro, rd, num, tmin, t);
+			case BVH_TORUS: return intersectTorus(ro, rd, num, tmin, t);
+			case BVH_RING: return intersectRing(ro, rd, num, tmin, t);
+			case BVH_INSTANCE: return intersectInstance(ro, rd, num, tmin, t);
+			default: return false;
+		}
+	}
+
+	bool Tracer::intersectNode(const ray_simd& ray, const rt_bvh_node& node, float tmin, float& tnear)
+	{
+#if RT_CPU_SSE
+		// min and max load with the offset / count word in the fourth lane, which is masked out
+		const __m128 pad = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+		const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.min.x), ray.ro), ray.inv_rd);
+		const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.max.x), ray.ro), ray.inv_rd);
+		__m128 tsmall = _mm_or_ps(_mm_andnot_ps(pad, _mm_min_ps(t0, t1)), _mm_and_ps(pad, _mm_set1_ps(-FLT_MAX)));
+		__m128 tbig = _mm_or_ps(_mm_andnot_ps(pad, _mm_max_ps(t0, t1)), _mm_and_ps(pad, _mm_set1_ps(FLT_MAX)));
+		// horizontal max / min
+		tsmall = _mm_max_ps(tsmall, _mm_shuffle_ps(tsmall, tsmall, _MM_SHUFFLE(2, 3, 0, 1)));
+		tsmall = _mm_max_ps(tsmall, _mm_shuffle_ps(tsmall, tsmall, _MM_SHUFFLE(1, 0, 3, 2)));
+		tbig = _mm_min_ps(tbig, _mm_shuffle_ps(tbig, tbig, _MM_SHUFFLE(2, 3, 0, 1)));
+		tbig = _mm_min_ps(tbig, _mm_shuffle_ps(tbig, tbig, _MM_SHUFFLE(1, 0, 3, 2)));
+		tnear = _mm_cvtss_f32(tsmall);
+		const float tfar = _mm_cvtss_f32(tbig);
+#else
+		const glm::vec3 t0 = (node.min - ray.ro) * ray.inv_rd;
+		const glm::vec3 t1 = (node.max - ray.ro) * ray.inv_rd;
+		const glm::vec3 tsmall = glm::min(t0, t1);
+		const glm::vec3 tbig = glm::max(t0, t1);
+		tnear = std::max(std::max(tsmall.x, tsmall.y), tsmall.z);
+		const float tfar = std::min(std::min(tbig.x, tbig.y), tbig.z);
+#endif
+		return tnear <= tfar && tfar > 0 && tnear < tmin;
+	}
+
+	// nearest hit over the unbounded refs and the tree
+	void Tracer::bvhClosestHit(glm::vec3 ro, glm::vec3 rd, float& tmin, int& num, int& type)
+	{
+		const std::vector<rt_bvh_node>& nodes = bvh.get_nodes();
+		const std::vector<uint32_t>& prims = bvh.get_prims();
+		float t;
+		for (int i = 0; i < bvh.get_unbounded_count(); i++) {
+			if (intersectPrim(ro, rd, prims[i], true, tmin, t)) {
+				num = bvh_ref_index(prims[i]); tmin = t; type = bvh_ref_type(prims[i]);
+			}
+		}
+
+		const ray_simd ray(ro, rd);
+		float tleft, tright;
+		if (nodes.empty() || !intersectNode(ray, nodes[0], tmin, tleft))
+			return;
+
+		int stack[Bvh::MAX_DEPTH];
+		float stack_t[Bvh::MAX_DEPTH];
+		int sp = 0;
+		int node = 0;
+		while (true) {
+			const rt_bvh_node& n = nodes[node];
+			if (n.count > 0) {
+				for (uint32_t i = n.offset; i < n.offset + n.count; i++) {
+					if (intersectPrim(ro, rd, prims[i], true, tmin, t)) {
+						num = bvh_ref_index(prims[i]); tmin = t; type = bvh_ref_type(prims[i]);
+					}
+				}
+			}
+			else {
+				// visit the nearer child first, the other one goes to the stack
+				const int left = node + 1;
+				const int right = static_cast<int>(n.offset);
+				const bool hitLeft = intersectNode(ray, nodes[left], tmin, tleft);
+				const bool hitRight = intersectNode(ray, nodes[right], tmin, tright);
+				if (hitLeft && hitRight) {
+					const bool leftFirst = tleft <= tright;
+					if (sp < Bvh::MAX_DEPTH) {
+						stack[sp] = leftFirst ? right : left;
+						stack_t[sp] = leftFirst ? tright : tleft;
+						sp++;
+					}
+					node = leftFirst ? left : right;
+					continue;
+				}
+				if (hitLeft) { node = left; continue; }
+				if (hitRight) { node = right; continue; }
+			}
+
+			// pop nodes that may still contain a closer hit
+			while (sp > 0 && stack_t[sp - 1] >= tmin) sp--;
+			if (sp == 0) break;
+			node = stack[--sp];
+		}
+	}
+
+	// sum of occluder opacities between ro and ro + rd * dist, same rules as inShadow.
+	// Any hit will do: it returns at the first opaque occluder or once textured rings add up to opaque
+	float Tracer::bvhShadow(glm::vec3 ro, glm::vec3 rd, float dist)
+	{
+		const std::vector<rt_bvh_node>& nodes = bvh.get_nodes();
+		const std::vector<uint32_t>& prims = bvh.get_prims();
+		float t;
+		float shadow = 0;
+		for (int i = 0; i < bvh.get_unbounded_count(); i++) {
+			if (intersectPrim(ro, rd, prims[i], false, dist, t))
+				return 1;
+		}
+
+		const ray_simd ray(ro, rd);
+		float tnear;
+		if (nodes.empty() || !intersectNode(ray, nodes[0], dist, tnear))
+			return shadow;
+
+		int stack[Bvh::MAX_DEPTH];
+		int sp = 0;
+		int node = 0;
+		while (true) {
+			const rt_bvh_node& n = nodes[node];
+			if (n.count > 0) {
+				for (uint32_t i = n.offset; i < n.offset + n.count; i++) {
+					if (intersectPrim(ro, rd, prims[i], false, dist, t)) {
+						if (bvh_ref_type(prims[i]) != BVH_RING || scene.rings[bvh_ref_index(prims[i])].textureNum == 0)
+							return 1;
+						shadow += sample(scene.rings[bvh_ref_index(prims[i])].textureNum, opt_uv).a;
+						if (shadow >= 1)
+							return 1;
+					}
+				}
+			}
+			else {
+				const int left = node + 1;
+				const int right = static_cast<int>(n.offset);
+				const bool hitLeft = intersectNode(ray, nodes[left], dist, tnear);
+				const bool hitRight = intersectNode(ray, nodes[right], dist, tnear);
+				if (hitLeft && hitRight && sp < Bvh::MAX_DEPTH)
+					stack[sp++] = right;
+				if (hitLeft) { node = left; continue; }
+				if (hitRight) { node = right; continue; }
+			}
+
+			if (sp == 0) break;
+			node = stack[--sp];
+		}
+		return shadow;
+	}
+	// end bvh section
+
+	float Tracer::calcInter(glm::vec3 ro, glm::vec3 rd, int& num, int& type)
+	{
+		float tmin = maxDist;
+		float t;
+		for (int i = 0; i < static_cast<int>(scene.planes.size()); i++) {
+			if (intersectPlane(ro, rd, scene.planes[i].normal, scene.planes[i].pos, tmin, t)) {
+				num = i; tmin = t; type = TYPE_PLANE;
+			}
+		}
+		bvhClosestHit(ro, rd, tmin, num, type);
+		for (int i = 0; i < static_cast<int>(scene.lights_point.size()); i++) {
+			if (intersectSphere(ro, rd, scene.lights_point[i].pos, false, tmin, t)) {
+				num = i; tmin = t; type = TYPE_POINT_LIGHT;
+			}
+		}
+
+		return tmin;
+	}
+
+	float Tracer::inShadow(glm::vec3 ro, glm::vec3 rd, float dist)
+	{
+		float shadow = bvhShadow(ro, rd, dist);
+
+#if PLANE_ONESIDE == 0
+		float t;
+		for (int i = 0; i < static_cast<int>(scene.planes.size()) && shadow < 1; i++)
+			if (intersectPlane(ro, rd, scene.planes[i].normal, scene.planes[i].pos, dist, t)) { shadow = 1; }
+#endif
+
+		return std::min(shadow, 1.0f);
+	}
+
+	void Tracer::calcShade2(glm::vec3 light_dir, glm::vec3 light_color, float intensity, glm::vec3 pt, glm::vec3 rd, const rt_material& material, glm::vec3 normal, bool doShadow, float dist, float distDiv, glm::vec3& diffuse, glm::vec3& specular)
+	{
+		light_dir = glm::normalize(light_dir);
+		// diffuse
+		const float dp = glm::clamp(glm::dot(normal, light_dir), 0.0f, 1.0f);
+		light_color *= dp;
+#if SHADOW_ENABLED
+		if (doShadow) {
+			const glm::vec3 shadow = glm::vec3(1 - inShadow(pt, light_dir, dist));
+			light_color *= glm::max(shadow, scene.shadow_ambient);
+		}
+#endif
+		diffuse += light_color * material.color * material.diffuse * intensity / distDiv;
+
+		//specular
+		if (material.specular > 0) {
+			const glm::vec3 reflection = glm::reflect(light_dir, normal);
+			const float specDp = glm::clamp(glm::dot(rd, reflection), 0.0f, 1.0f);
+			specular += light_color * std::pow(specDp, static_cast<float>(material.specular)) * intensity / distDiv;
+		}
+	}
+
+	glm::vec3 Tracer::calcShade(glm::vec3 pt, glm::vec3 rd, const rt_material& material, glm::vec3 normal, bool doShadow)
+	{
+		float dist, distDiv;
+		glm::vec3 light_color, light_dir;
+		glm::vec3 diffuse = glm::vec3(0);
+		glm::vec3 specular = glm::vec3(0);
+
+		glm::vec3 pixelColor = scene.ambient_color * material.color;
+
+		for (const rt_light_point& light : scene.lights_point) {
+			light_color = light.color;
+			light_dir = glm::vec3(light.pos) - pt;
+			dist = glm::length(light_dir);
+			distDiv = 1 + light.linear_k * dist + light.quadratic_k * dist * dist;
+
+			calcShade2(light_dir, light_color, light.intensity, pt, rd, material, normal, doShadow, dist, distDiv, diffuse, specular);
+		}
+		for (const rt_light_direct& light : scene.lights_direct) {
+			light_color = light.color;
+			light_dir = -light.direction;
+			dist = maxDist;
+			distDiv = 1;
+
+			calcShade2(light_dir, light_color, light.intensity, pt, rd, material, normal, doShadow, dist, distDiv, diffuse, specular);
+		}
+		pixelColor += diffuse * material.kd + specular * material.ks;
+		return pixelColor;
+	}
+
+	float Tracer::getFresnel(glm::vec3 normal, glm::vec3 rd, float reflection)
+	{
+		const float ndotv = glm::clamp(glm::dot(normal, -rd), 0.0f, 1.0f);
+		return reflection + (1 - reflection) * std::pow(1 - ndotv, 5.0f);
+	}
+
+	float Tracer::FresnelReflectAmount(float n1, float n2, glm::vec3 normal, glm::vec3 incident, float refl)
+	{
+#if DO_FRESNEL
+		// Schlick aproximation
+		float r0 = (n1 - n2) / (n1 + n2);
+		r0 *= r0;
+		float cosX = -glm::dot(normal, incident);
+		if (n1 > n2)
+		{
+			const float n = n1 / n2;
+			const float sinT2 = n * n * (1 - cosX * cosX);
+			// Total internal reflection
+			if (sinT2 > 1)
+				return 1;
+			cosX = std::sqrt(1 - sinT2);
+		}
+		const float x = 1 - cosX;
+		float ret = r0 + (1 - r0) * x * x * x * x * x;
+
+		// adjust reflect multiplier for object reflectivity
+		ret = (refl + (1 - refl) * ret);
+		return ret;
+#else
+		return refl;
+#endif
+	}
+
+	hit_record Tracer::get_hit_info(glm::vec3 ro, glm::vec3 rd, glm::vec3 pt, float t, int num, int type)
+	{
+		hit_record hr = {};
+		if (type == TYPE_SPHERE) {
+			const rt_sphere& sphere = scene.spheres[num];
+			hr = { scene.materials[sphere.material], glm::normalize(pt - glm::vec3(sphere.obj)), 0, 1 };
+			if (sphere.textureNum != 0) {
+				const glm::vec4 texColor = getSphereTexture(hr.normal, to_vec4(sphere.quat_rotation), sphere.textureNum, t, sphere.obj.w);
+				hr.mat.color = glm::vec3(texColor);
+				hr.alpha = texColor.a;
+			}
+		}
+		if (type == TYPE_PLANE) {
+			hr = { scene.materials[scene.planes[num].material], glm::normalize(scene.planes[num].normal), 0, 1 };
+		}
+		if (type == TYPE_SURFACE) {
+			hr = { scene.materials[surfaces[num].material], getSurfaceNormal(ro, rd, t, num), 0, 1 };
+		}
+		if (type == TYPE_BOX) {
+			const rt_box& box = scene.boxes[num];
+			hr = { scene.materials[box.material], opt_normal, 0, 1 };
+			if (box.textureNum != 0) {
+				hr.mat.color = glm::vec3(getBoxTexture(pt, opt_normal, num));
+			}
+		}
+		if (type == TYPE_TORUS) {
+			hr = { scene.materials[scene.toruses[num].material], getTorusNormal(ro, rd, t, num), 0, 1 };
+		}
+		if (type == TYPE_RING) {
+			const rt_ring& ring = scene.rings[num];
+			hr = { scene.materials[ring.material], getRingNormal(num), 0, 1 };
+			if (ring.textureNum != 0) {
+				const glm::vec4 texColor = sample(ring.textureNum, opt_uv);
+				hr.mat.color = glm::vec3(texColor);
+				hr.alpha = texColor.a;
+			}
+		}
+		if (type == TYPE_INSTANCE) {
+			const rt_instance& instance = scene.instances[num];
+			const rt_prototype& prototype = scene.prototypes[instance.prototype];
+			const glm::mat3 rotation = rotation_matrix(instance.quat_rotation);
+			glm::vec3 local, normal;
+			getInstanceHitLocal(instance, prototype, rotation, pt, local, normal);
+			hr = { scene.materials[instance.material], normal * rotation, 0, 1 };
+			if (prototype.textureNum != 0) {
+				if (prototype.type == PROTOTYPE_BOX) {
+					hr.mat.color = glm::vec3(getBoxTextureLocal(local, normal, prototype.textureNum));
+				} else if (prototype.type == PROTOTYPE_SPHERE) {
+					const glm::vec4 texColor = getSphereTexture(normal, glm::vec4(0, 0, 0, 1), prototype.textureNum, t, prototype.form.x * instance.scale);
+					hr.mat.color = glm::vec3(texColor);
+					hr.alpha = texColor.a;
+				}
+			}
+		}
+		const float distance = glm::length(pt - ro);
+		hr.bias_mult = (9e-3f * distance + 35) / 35e3f;
+
+		return hr;
+	}
+
+	// get one-step reflection color for refractive objects
+	glm::vec3 Tracer::getReflectedColor(glm::vec3 ro, glm::vec3 rd)
+	{
+		glm::vec3 color = glm::vec3(0);
+		int num = 0, type = -1;
+		const float t = calcInter(ro, rd, num, type);
+		if (type == TYPE_POINT_LIGHT) return scene.lights_point[num].color;
+		if (t < maxDist) {
+			const glm::vec3 pt = ro + rd * t;
+			const hit_record hr = get_hit_info(ro, rd, pt, t, num, type);
+			ro = glm::dot(rd, hr.normal) < 0 ? pt + hr.normal * hr.bias_mult : pt - hr.normal * hr.bias_mult;
+			color = calcShade(ro, rd, hr.mat, hr.normal, true);
+		}
+		return color;
+	}
+
+	glm::vec3 Tracer::trace(float fragX, float fragY)
+	{
+		float reflectMultiplier, refractMultiplier, tm;
+		rt_material mat;
+		glm::vec3 pt, n;
+
+		glm::vec3 mask = glm::vec3(1);
+		glm::vec3 color = glm::vec3(0);
+		glm::vec3 ro = scene.scene.camera_pos;
+		glm::vec3 rd = getRayDir(fragX, fragY);
+		float absorbDistance = 0;
+		int type = 0;
+		int num = 0;
+		int refractSteps = 0;
+		hit_record hr;
+
+		for (int i = 0; i < scene.scene.reflect_depth; i++)
+		{
+			tm = calcInter(ro, rd, num, type);
+			if (tm < maxDist)
+			{
+				pt = ro + rd * tm;
+				hr = get_hit_info(ro, rd, pt, tm, num, type);
+
+				if (type == TYPE_POINT_LIGHT) {
+					color += scene.lights_point[num].color * mask;
+					break;
+				}
+
+				mat = hr.mat;
+				n = hr.normal;
+
+				const bool outside = glm::dot(rd, n) < 0;
+				n = outside ? n : -n;
+
+#if TOTAL_INTERNAL_REFLECTION
+				if (mat.refract > 0)
+					reflectMultiplier = FresnelReflectAmount(outside ? 1 : mat.refract,
+						outside ? mat.refract : 1,
+						rd, n, mat.reflect);
+				else reflectMultiplier = getFresnel(n, rd, mat.reflect);
+#else
+				reflectMultiplier = getFresnel(n, rd, mat.reflect);
+#endif
+				refractMultiplier = 1 - reflectMultiplier;
+
+				if (mat.refract > 0) // Refractive
+				{
+					if (outside && mat.reflect > 0)
+					{
+						color += getReflectedColor(pt + n * hr.bias_mult, glm::reflect(rd, n)) * reflectMultiplier * mask;
+						mask *= refractMultiplier;
+					}
+					else if (!outside) {
+						absorbDistance += tm;
+						const glm::vec3 absorb = glm::exp(-mat.absorb * absorbDistance);
+						mask *= absorb;
+					}
+#if TOTAL_INTERNAL_REFLECTION
+					if (reflectMultiplier >= 1)
+						break;
+#endif
+					ro = pt - n * hr.bias_mult;
+					rd = glm::refract(rd, n, outside ? 1 / mat.refract : mat.refract);
+#if REFLECT_REDUCE_ITERATION
+					if (++refractSteps < MAX_REFRACT_STEPS)
+						i--;
+#endif
+				}
+				else if (mat.reflect > 0) // Reflective
+				{
+					ro = pt + n * hr.bias_mult;
+					color += calcShade(ro, rd, mat, n, true) * refractMultiplier * mask;
+					rd = glm::reflect(rd, n);
+					mask *= reflectMultiplier;
+				}
+				else // Diffuse
+				{
+					color += calcShade(pt + n * hr.bias_mult, rd, mat, n, true) * mask * hr.alpha;
+					if (hr.alpha < 1) {
+						ro = pt - n * hr.bias_mult;
+						mask *= 1 - hr.alpha;
+					}
+					else {
+						break;
+					}
+				}
+			}
+			else {
+				color += glm::vec3(skybox.sample(rd)) * mask;
+				break;
+			}
+		}
+		return color;
+	}
+}
+
+CpuRenderer::CpuRenderer(int width, int height, unsigned threads) : pool(threads)
+{
+	this->width = width;
+	this->height = height;
+	pixels.resize(static_cast<size_t>(width) * height);
+}
+
+int CpuRenderer::getWidth() const
+{
+	return width;
+}
+
+int CpuRenderer::getHeight() const
+{
+	return height;
+}
+
+void CpuRenderer::set_skybox(const std::vector<std::string>& faces)
+{
+	skybox.load(faces);
+}
+
+bool CpuRenderer::load_texture(int texNum, const char* name)
+{
+	if (texNum >= static_cast<int>(textures.size()))
+		textures.resize(texNum + 1);
+	const std::string path = ASSETS_DIR "/textures/" + std::string(name);
+	return textures[texNum].load(path.c_str());
+}
+
+void CpuRenderer::draw(const scene_container& scene)
+{
+	const int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	const int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+	bvh.update(scene);
+	// only changed surfaces are refitted, ranges cover whole elements
+	const size_t stride = sizeof(rt_surface);
+	surfaces.resize(scene.surfaces.size());
+	for (const byte_range& r : surfacesTracker.update(scene.surfaces.data(), scene.surfaces.size(), stride))
+	{
+		for (size_t i = r.begin / stride; i < r.end / stride; i++)
+		{
+			surfaces[i] = scene.surfaces[i];
+			Bvh::fit_clip_box(surfaces[i]);
+		}
+	}
+
+	pool.parallel_for(tilesX * tilesY, [&](int tile)
+	{
+		Tracer tracer(scene, surfaces, bvh, textures, skybox);
+		const int x0 = (tile % tilesX) * TILE_SIZE;
+		const int y0 = (tile / tilesX) * TILE_SIZE;
+		const int x1 = std::min(x0 + TILE_SIZE, width);
+		const int y1 = std::min(y0 + TILE_SIZE, height);
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++)
+				pixels[static_cast<size_t>(y) * width + x] = tracer.trace(x + 0.5f, y + 0.5f); // gl_FragCoord is the pixel center
+	});
+}
+
+const std::vector<glm::vec3>& CpuRenderer::get_pixels() const
+{
+	return pixels;
+}
+
+void CpuRenderer::read_rgb8(std::vector<unsigned char>& rgb) const
+{
+	rgb.resize(static_cast<size_t>(width) * height * 3);
+	for (int y = 0; y < height; y++)
+	{
+		const glm::vec3* src = &pixels[static_cast<size_t>(height - 1 - y) * width];
+		unsigned char* dst = &rgb[static_cast<size_t>(y) * width * 3];
+		for (int x = 0; x < width; x++)
+		{
+			const glm::vec3 c = glm::clamp(src[x], 0.0f, 1.0f);
+			dst[x * 3 + 0] = static_cast<unsigned char>(c.r * 255 + 0.5f);
+			dst[x * 3 + 1] = static_cast<unsigned char>(c.g * 255 + 0.5f);
+			dst[x * 3 + 2] = static_cast<unsigned char>(c.b * 255 + 0.5f);
+		}
+	}
+}
+
+bool CpuRenderer::save(const std::string& path) const
+{
+	if (ImageWriter::is_float_format(path))
+	{
+		std::vector<float> rgb(static_cast<size_t>(width) * height * 3);
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+			{
+				const glm::vec3& c = pixels[static_cast<size_t>(height - 1 - y) * width + x];
+				float* dst = &rgb[(static_cast<size_t>(y) * width + x) * 3];
+				dst[0] = c.r;
+				dst[1] = c.g;
+				dst[2] = c.b;
+			}
+		return ImageWriter::write(path, width, height, rgb.data());
+	}
+
+	std::vector<unsigned char> rgb;
+	read_rgb8(rgb);
+	return ImageWriter::write(path, width, height, rgb.data());
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "scene.h"
+#include "Bvh.h"
+#include "CpuTexture.h"
+#include "DirtyTracker.h"
+#include "ThreadPool.h"
+
+// Reference CPU implementation of rt.frag.
+// Renders the same scene_container without a GL context, tiles are traced in parallel on a thread pool
+// and intersections go through the same Bvh the shader traverses.
+// SMAA is not applied, compare against GPU output with SMAA disabled.
+class CpuRenderer
+{
+public:
+	// threads == 0 - use all hardware threads
+	CpuRenderer(int width, int height, unsigned threads = 0);
+
+	int getWidth() const;
+	int getHeight() const;
+
+	void set_skybox(const std::vector<std::string>& faces);
+	// texNum - number the object refers to by textureNum, same numbering as GLWrapper::load_texture_array
+	bool load_texture(int texNum, const char* name);
+
+	void draw(const scene_container& scene);
+
+	// last frame, rows go bottom to top like glReadPixels
+	const std::vector<glm::vec3>& get_pixels() const;
+	// last frame clamped to 8 bit, rows go top to bottom
+	void read_rgb8(std::vector<unsigned char>& rgb) const;
+	// format by extension: .png, .ppm, .raw (8 bit), .pfm or .exr (float)
+	bool save(const std::string& path) const;
+
+private:
+	static const int TILE_SIZE = 16;
+
+	int width;
+	int height;
+
+	ThreadPool pool;
+	Bvh bvh;
+	CpuCubemap skybox;
+	std::vector<CpuTexture> textures;
+	std::vector<rt_surface> surfaces; // scene surfaces with fitted clip boxes
+	DirtyTracker surfacesTracker; // of scene.surfaces
+	std::vector<glm::vec3> pixels;
+};
@@ -0,0 +1,176 @@
+#include "CpuTexture.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stb_image.h>
+
+bool CpuTexture::load(const char* path, bool genMipmap)
+{
+	int width, height, nrComponents;
+	unsigned char* data = stbi_load(path, &width, &height, &nrComponents, 0);
+	if (!data)
+	{
+		std::cout << "Texture failed to load at path: " << path << std::endl;
+		return false;
+	}
+
+	channels = nrComponents;
+	levels.clear();
+	levels.push_back({ width, height, std::vector<unsigned char>(data, data + static_cast<size_t>(width) * height * channels) });
+	stbi_image_free(data);
+
+	if (genMipmap)
+		gen_mipmaps();
+	return true;
+}
+
+void CpuTexture::gen_mipmaps()
+{
+	while (levels.back().width > 1 || levels.back().height > 1)
+	{
+		const level& src = levels.back();
+		level dst = { std::max(1, src.width / 2), std::max(1, src.height / 2), {} };
+		dst.data.resize(static_cast<size_t>(dst.width) * dst.height * channels);
+
+		for (int y = 0; y < dst.height; y++)
+		{
+			const int y0 = std::min(y * 2, src.height - 1);
+			const int y1 = std::min(y * 2 + 1, src.height - 1);
+			for (int x = 0; x < dst.width; x++)
+			{
+				const int x0 = std::min(x * 2, src.width - 1);
+				const int x1 = std::min(x * 2 + 1, src.width - 1);
+				for (int c = 0; c < channels; c++)
+				{
+					const int sum = src.data[(y0 * src.width + x0) * channels + c] + src.data[(y0 * src.width + x1) * channels + c] +
+						src.data[(y1 * src.width + x0) * channels + c] + src.data[(y1 * src.width + x1) * channels + c];
+					dst.data[(y * dst.width + x) * channels + c] = static_cast<unsigned char>((sum + 2) / 4);
+				}
+			}
+		}
+		levels.push_back(std::move(dst));
+	}
+}
+
+glm::vec4 CpuTexture::fetch(const level& l, int x, int y) const
+{
+	const unsigned char* p = &l.data[(static_cast<size_t>(y) * l.width + x) * channels];
+	// same expansion as GL_RED / GL_RGB / GL_RGBA textures
+	glm::vec4 color(0, 0, 0, 1);
+	for (int c = 0; c < channels && c < 4; c++)
+		color[c] = p[c] / 255.0f;
+	return color;
+}
+
+glm::vec4 CpuTexture::bilinear(const level& l, glm::vec2 uv, bool repeat) const
+{
+	if (repeat)
+		uv -= glm::floor(uv);
+	else
+		uv = glm::clamp(uv, glm::vec2(0), glm::vec2(1));
+
+	const float fx = uv.x * l.width - 0.5f;
+	const float fy = uv.y * l.height - 0.5f;
+	const float x0f = std::floor(fx);
+	const float y0f = std::floor(fy);
+	const float ax = fx - x0f;
+	const float ay = fy - y0f;
+
+	int x0 = static_cast<int>(x0f), x1 = x0 + 1;
+	int y0 = static_cast<int>(y0f), y1 = y0 + 1;
+	if (repeat)
+	{
+		x0 = ((x0 % l.width) + l.width) % l.width;
+		x1 = ((x1 % l.width) + l.width) % l.width;
+		y0 = ((y0 % l.height) + l.height) % l.height;
+		y1 = ((y1 % l.height) + l.height) % l.height;
+	}
+	else
+	{
+		x0 = glm::clamp(x0, 0, l.width - 1);
+		x1 = glm::clamp(x1, 0, l.width - 1);
+		y0 = glm::clamp(y0, 0, l.height - 1);
+		y1 = glm::clamp(y1, 0, l.height - 1);
+	}
+
+	const glm::vec4 top = glm::mix(fetch(l, x0, y0), fetch(l, x1, y0), ax);
+	const glm::vec4 bottom = glm::mix(fetch(l, x0, y1), fetch(l, x1, y1), ax);
+	return glm::mix(top, bottom, ay);
+}
+
+glm::vec4 CpuTexture::sample(glm::vec2 uv) const
+{
+	if (empty() || !std::isfinite(uv.x) || !std::isfinite(uv.y))
+		return glm::vec4(0, 0, 0, 1); // what GL returns for an incomplete texture
+	return bilinear(levels[0], uv, true);
+}
+
+glm::vec4 CpuTexture::sample_lod(glm::vec2 uv, float lod) const
+{
+	if (empty() || !std::isfinite(uv.x) || !std::isfinite(uv.y))
+		return glm::vec4(0, 0, 0, 1); // what GL returns for an incomplete texture
+
+	const float maxLevel = static_cast<float>(levels.size() - 1);
+	if (!(lod > 0))
+		return bilinear(levels[0], uv, true);
+	if (lod >= maxLevel)
+		return bilinear(levels.back(), uv, true);
+
+	const int l0 = static_cast<int>(lod);
+	const float a = lod - l0;
+	return glm::mix(bilinear(levels[l0], uv, true), bilinear(levels[l0 + 1], uv, true), a);
+}
+
+glm::vec4 CpuTexture::sample_clamped(glm::vec2 uv) const
+{
+	if (empty() || !std::isfinite(uv.x) || !std::isfinite(uv.y))
+		return glm::vec4(0, 0, 0, 1); // what GL returns for an incomplete texture
+	return bilinear(levels[0], uv, false);
+}
+
+bool CpuCubemap::load(const std::vector<std::string>& paths)
+{
+	faces.clear();
+	faces.resize(paths.size());
+	bool ok = true;
+	for (size_t i = 0; i < paths.size(); i++)
+		ok = faces[i].load(paths[i].c_str(), false) && ok;
+	if (faces.size() != 6)
+		faces.clear();
+	return ok && !faces.empty();
+}
+
+glm::vec4 CpuCubemap::sample(glm::vec3 dir) const
+{
+	if (empty())
+		return glm::vec4(0);
+
+	// face selection from the GL spec, table "Selection of cube map images"
+	const glm::vec3 a = glm::abs(dir);
+	int face;
+	float sc, tc, ma;
+	if (a.x >= a.y && a.x >= a.z)
+	{
+		face = dir.x > 0 ? 0 : 1;
+		sc = dir.x > 0 ? -dir.z : dir.z;
+		tc = -dir.y;
+		ma = a.x;
+	}
+	else if (a.y >= a.z)
+	{
+		face = dir.y > 0 ? 2 : 3;
+		sc = dir.x;
+		tc = dir.y > 0 ? dir.z : -dir.z;
+		ma = a.y;
+	}
+	else
+	{
+		face = dir.z > 0 ? 4 : 5;
+		sc = dir.z > 0 ? dir.x : -dir.x;
+		tc = -dir.y;
+		ma = a.z;
+	}
+
+	const glm::vec2 uv((sc / ma + 1) / 2, (tc / ma + 1) / 2);
+	return faces[face].sample_clamped(uv);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+// CPU side texture with a box-filtered mip chain, sampled like GL_LINEAR_MIPMAP_LINEAR + GL_REPEAT
+class CpuTexture
+{
+public:
+	bool load(const char* path, bool genMipmap = true);
+	bool empty() const { return levels.empty(); }
+
+	int getWidth() const { return empty() ? 0 : levels[0].width; }
+	int getHeight() const { return empty() ? 0 : levels[0].height; }
+
+	glm::vec4 sample(glm::vec2 uv) const;
+	glm::vec4 sample_lod(glm::vec2 uv, float lod) const;
+	// clamp to edge, bilinear, level 0
+	glm::vec4 sample_clamped(glm::vec2 uv) const;
+
+private:
+	struct level
+	{
+		int width;
+		int height;
+		std::vector<unsigned char> data;
+	};
+
+	std::vector<level> levels;
+	int channels = 0;
+
+	glm::vec4 fetch(const level& l, int x, int y) const;
+	glm::vec4 bilinear(const level& l, glm::vec2 uv, bool repeat) const;
+	void gen_mipmaps();
+};
+
+// CPU side cubemap, faces in GL order (+x, -x, +y, -y, +z, -z)
+class CpuCubemap
+{
+public:
+	bool load(const std::vector<std::string>& faces);
+	bool empty() const { return faces.empty(); }
+
+	glm::vec4 sample(glm::vec3 dir) const;
+
+private:
+	std::vector<CpuTexture> faces;
+};
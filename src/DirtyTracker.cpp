@@ -0,0 +1,56 @@
+#include "DirtyTracker.h"
+#include <algorithm>
+#include <cstring>
+
+const std::vector<byte_range>& DirtyTracker::update(const void* data, size_t count, size_t stride)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	const size_t size = count * stride;
+	ranges.clear();
+	dirty_bytes = 0;
+
+	if (!valid)
+	{
+		snapshot.assign(bytes, bytes + size);
+		valid = true;
+		if (size > 0)
+		{
+			ranges.push_back({ 0, size });
+			dirty_bytes = size;
+		}
+		return ranges;
+	}
+
+	const size_t common = std::min(snapshot.size(), size);
+	for (size_t offset = 0; offset < common; offset += stride)
+	{
+		if (memcmp(&snapshot[offset], bytes + offset, stride) == 0)
+			continue;
+
+		memcpy(&snapshot[offset], bytes + offset, stride);
+		add_range(offset, offset + stride);
+	}
+
+	// elements appended since the last update, removed ones at the end need no upload
+	snapshot.resize(size);
+	if (size > common)
+	{
+		memcpy(&snapshot[common], bytes + common, size - common);
+		add_range(common, size);
+	}
+	return ranges;
+}
+
+void DirtyTracker::add_range(size_t begin, size_t end)
+{
+	dirty_bytes += end - begin;
+	if (!ranges.empty() && begin - ranges.back().end <= MERGE_GAP)
+		ranges.back().end = end;
+	else
+		ranges.push_back({ begin, end });
+}
+
+void DirtyTracker::invalidate()
+{
+	valid = false;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+struct byte_range
+{
+	size_t begin;
+	size_t end;
+};
+
+// Finds the parts of an array that changed since the previous update.
+// Keeps a copy of the bytes it has seen, so callers can modify elements in place without marking them.
+class DirtyTracker
+{
+public:
+	// compares count elements of stride bytes with the previous call, count may differ between calls
+	// returns changed byte ranges relative to data, whole elements, sorted, nearby ranges merged
+	const std::vector<byte_range>& update(const void* data, size_t count, size_t stride);
+	// the next update reports everything as changed, e.g. after the buffer was reallocated
+	void invalidate();
+
+	size_t get_dirty_bytes() const { return dirty_bytes; }
+
+private:
+	// ranges closer than this are uploaded as one, a few extra bytes are cheaper than another call
+	static const size_t MERGE_GAP = 256;
+
+	std::vector<unsigned char> snapshot;
+	std::vector<byte_range> ranges;
+	size_t dirty_bytes = 0;
+	bool valid = false;
+
+	void add_range(size_t begin, size_t end);
+};
@@ -0,0 +1,125 @@
+#include "FrameReadback.h"
+#include <algorithm>
+#include "utils.h"
+
+namespace
+{
+	const GLuint64 WAIT_TIMEOUT_NS = 100000000; // glClientWaitSync is retried until the fence signals
+
+	template<typename T>
+	void copy_flipped(const readback_frame& frame, T* dst)
+	{
+		const T* src = static_cast<const T*>(frame.data);
+		for (int y = 0; y < frame.height; y++)
+		{
+			const T* row = src + static_cast<size_t>(frame.height - 1 - y) * frame.width * 4;
+			for (int x = 0; x < frame.width; x++)
+			{
+				*dst++ = row[x * 4];
+				*dst++ = row[x * 4 + 1];
+				*dst++ = row[x * 4 + 2];
+			}
+		}
+	}
+}
+
+FrameReadback::FrameReadback(int width, int height, bool floatPixels, consumer onFrame, int depth)
+	: width(width), height(height), floatPixels(floatPixels), onFrame(onFrame), slots(std::max(depth, 1))
+{
+	// rgba is the format drivers copy without conversion, rgb can fall back to a synchronous path
+	size = static_cast<size_t>(width) * height * 4 * (floatPixels ? sizeof(float) : 1);
+	for (slot& s : slots)
+	{
+		glGenBuffers(1, &s.buffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, s.buffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	checkGlErrors("Readback buffers creation");
+}
+
+FrameReadback::~FrameReadback()
+{
+	for (slot& s : slots)
+	{
+		if (s.fence)
+			glDeleteSync(s.fence);
+		glDeleteBuffers(1, &s.buffer);
+	}
+}
+
+void FrameReadback::capture(GLuint fbo, int index)
+{
+	// ring is full, the oldest frame has to be handed out before its buffer is reused
+	if (pending == static_cast<int>(slots.size()))
+		deliver(slots[oldest]);
+
+	slot& s = slots[(oldest + pending) % slots.size()];
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, s.buffer);
+	glReadPixels(0, 0, width, height, GL_RGBA, floatPixels ? GL_FLOAT : GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	s.index = index;
+	pending++;
+	checkGlErrors("Readback capture");
+
+	poll();
+}
+
+void FrameReadback::poll()
+{
+	while (pending > 0 && ready(slots[oldest]))
+		deliver(slots[oldest]);
+}
+
+void FrameReadback::flush()
+{
+	while (pending > 0)
+		deliver(slots[oldest]);
+}
+
+bool FrameReadback::ready(const slot& s) const
+{
+	// flush bit makes sure the fence reaches the GPU even if nothing else flushes this frame
+	const GLenum status = glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+}
+
+void FrameReadback::deliver(slot& s)
+{
+	GLenum status;
+	do
+		status = glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT, WAIT_TIMEOUT_NS);
+	while (status == GL_TIMEOUT_EXPIRED);
+	glDeleteSync(s.fence);
+	s.fence = nullptr;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, s.buffer);
+	const void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+	if (data)
+	{
+		const readback_frame frame = { s.index, width, height, floatPixels, data };
+		onFrame(frame);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	else
+	{
+		checkGlErrors("Readback map");
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	oldest = (oldest + 1) % slots.size();
+	pending--;
+}
+
+void FrameReadback::copy_rgb(const readback_frame& frame, unsigned char* dst)
+{
+	copy_flipped(frame, dst);
+}
+
+void FrameReadback::copy_rgb(const readback_frame& frame, float* dst)
+{
+	copy_flipped(frame, dst);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+// rgba pixels of a finished frame, valid only during the consumer call
+struct readback_frame
+{
+	int index; // frame number passed to capture()
+	int width;
+	int height;
+	bool isFloat; // GL_FLOAT components, GL_UNSIGNED_BYTE otherwise
+	const void* data; // rows bottom to top, as glReadPixels returns them
+};
+
+// Asynchronous framebuffer readback through a ring of pixel buffer objects.
+// capture() only queues the copy, the frame is mapped and handed to the consumer once its fence
+// has signaled, so with a ring of 3 frame N is read while N + 2 renders.
+// The consumer runs on the render thread with the GL context current, heavy work (encoding, I/O)
+// belongs on another thread.
+class FrameReadback
+{
+public:
+	typedef std::function<void(const readback_frame&)> consumer;
+
+	FrameReadback(int width, int height, bool floatPixels, consumer onFrame, int depth = 3);
+	~FrameReadback();
+
+	FrameReadback(const FrameReadback&) = delete;
+	FrameReadback& operator=(const FrameReadback&) = delete;
+
+	// queues a copy of fbo (0 - default framebuffer back buffer), waits only if the ring is full
+	void capture(GLuint fbo, int index);
+	// hands out finished frames without waiting
+	void poll();
+	// waits for all queued frames and hands them out
+	void flush();
+
+	// drops alpha and flips rows to top to bottom, dst holds width * height * 3 values
+	static void copy_rgb(const readback_frame& frame, unsigned char* dst);
+	static void copy_rgb(const readback_frame& frame, float* dst);
+
+private:
+	struct slot
+	{
+		GLuint buffer = 0;
+		GLsync fence = nullptr;
+		int index = 0;
+	};
+
+	int width;
+	int height;
+	bool floatPixels;
+	size_t size;
+	consumer onFrame;
+
+	std::vector<slot> slots;
+	int oldest = 0; // next slot to hand out
+	int pending = 0;
+
+	bool ready(const slot& s) const;
+	void deliver(slot& s);
+};
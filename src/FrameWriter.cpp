@@ -0,0 +1,68 @@
+#include "FrameWriter.h"
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include "ImageWriter.h"
+
+FrameWriter::FrameWriter(unsigned threads, int maxPending)
+	// the pool counts the calling thread as one of its threads, enqueued tasks only run on the others
+	: pool(std::max(threads, 1u) + 1), maxPending(maxPending)
+{
+}
+
+FrameWriter::~FrameWriter()
+{
+	wait();
+}
+
+void FrameWriter::submit(const std::string& path, int width, int height, std::vector<unsigned char>&& rgb)
+{
+	acquire();
+	// std::function must be copyable, the buffer is shared instead of moved into the task
+	auto data = std::make_shared<std::vector<unsigned char>>(std::move(rgb));
+	pool.enqueue([this, path, width, height, data]
+	{
+		release(path, ImageWriter::write(path, width, height, data->data()));
+	});
+}
+
+void FrameWriter::submit(const std::string& path, int width, int height, std::vector<float>&& rgb)
+{
+	acquire();
+	auto data = std::make_shared<std::vector<float>>(std::move(rgb));
+	pool.enqueue([this, path, width, height, data]
+	{
+		release(path, ImageWriter::write(path, width, height, data->data()));
+	});
+}
+
+void FrameWriter::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	cv.wait(lock, [this] { return pending == 0; });
+}
+
+int FrameWriter::get_failed() const
+{
+	return failed;
+}
+
+void FrameWriter::acquire()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	cv.wait(lock, [this] { return pending < maxPending; });
+	pending++;
+}
+
+void FrameWriter::release(const std::string& path, bool ok)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "Failed to write %s\n", path.c_str());
+		failed++;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	pending--;
+	cv.notify_all();
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ThreadPool.h"
+
+// Writes rendered frames to disk on worker threads so encoding overlaps with rendering.
+// Pixel rows are expected top to bottom, 3 channels, format is chosen by file extension (see ImageWriter).
+// Submitting blocks while maxPending frames are still waiting to be written, memory stays bounded.
+class FrameWriter
+{
+public:
+	explicit FrameWriter(unsigned threads = 2, int maxPending = 8);
+	~FrameWriter();
+
+	FrameWriter(const FrameWriter&) = delete;
+	FrameWriter& operator=(const FrameWriter&) = delete;
+
+	// takes ownership of the pixel data
+	void submit(const std::string& path, int width, int height, std::vector<unsigned char>&& rgb);
+	void submit(const std::string& path, int width, int height, std::vector<float>&& rgb);
+
+	// blocks until all submitted frames are written
+	void wait();
+	int get_failed() const;
+
+private:
+	ThreadPool pool;
+	const int maxPending;
+	int pending = 0;
+	std::atomic<int> failed{ 0 };
+	std::mutex mutex;
+	std::condition_variable cv;
+
+	void acquire();
+	void release(const std::string& path, bool ok);
+};
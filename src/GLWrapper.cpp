@@ -1,14 +1,37 @@
 #include "GLWrapper.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include "Profiler.h"
+#include "rt_math.h"
 #include "scene.h"
-#include <stb_image.h>
 #include "shader.h"
+#include "TextureCache.h"
+
+#ifdef RT_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 
 static void glfw_error_callback(int error, const char * desc)
 {
 	fputs(desc, stderr);
 }
 
+// radical inverse, low discrepancy subpixel positions for accumulated samples
+static float halton(int index, int base)
+{
+	float f = 1, r = 0;
+	while (index > 0)
+	{
+		f /= base;
+		r += f * (index % base);
+		index /= base;
+	}
+	return r;
+}
+
 GLWrapper::GLWrapper(int width, int height, bool fullScreen)
 {
 	this->width = width;
@@ -24,20 +47,53 @@ GLWrapper::GLWrapper(bool fullScreen)
 
 GLWrapper::~GLWrapper()
 {
+	if (!quadVAO)
+		return; // init_window failed, there may be no GL functions to call
+
 	glDeleteVertexArrays(1, &quadVAO);
 	glDeleteBuffers(1, &quadVBO);
 
-	if (SMAA_enabled)
+	if (SMAA_enabled || accumulation || checkerboard)
 	{
 		glDeleteFramebuffers(1, &fboColor);
 		glDeleteTextures(1, &fboTexColor);
+	}
 
+	if (SMAA_enabled)
+	{
 		glDeleteFramebuffers(1, &fboEdge);
 		glDeleteTextures(1, &fboTexEdge);
 
 		glDeleteFramebuffers(1, &fboBlend);
 		glDeleteTextures(1, &fboTexBlend);
 	}
+
+	if (offscreen)
+	{
+		glDeleteFramebuffers(1, &fboOutput);
+		glDeleteTextures(1, &fboTexOutput);
+	}
+
+	if (dynamicResolution || checkerboard)
+	{
+		glDeleteFramebuffers(1, &fboTrace);
+		glDeleteTextures(1, &fboTexTrace);
+	}
+
+	if (dynamicResolution)
+		glDeleteQueries(TIMER_QUERIES, timerQueries);
+
+	if (checkerboard)
+	{
+		glDeleteFramebuffers(2, fboResolve);
+		glDeleteTextures(2, fboTexHistory);
+	}
+
+	if (tileClassification)
+	{
+		glDeleteFramebuffers(1, &fboTiles);
+		glDeleteTextures(1, &fboTexTiles);
+	}
 	
 	glDeleteTextures(1, &skyboxTex);
 	glDeleteTextures(textures.size(), textures.data());
@@ -58,44 +114,21 @@ GLuint GLWrapper::getProgramId()
 	return shader.ID;
 }
 
-bool GLWrapper::init_window()
+GLuint GLWrapper::getOutputFramebuffer() const
 {
-	if (!glfwInit())
-		return false;
-
-	GLFWmonitor* monitor = glfwGetPrimaryMonitor();
-	const GLFWvidmode* mode = glfwGetVideoMode(monitor);
-
-	glfwWindowHint(GLFW_RED_BITS, mode->redBits);
-	glfwWindowHint(GLFW_GREEN_BITS, mode->greenBits);
-	glfwWindowHint(GLFW_BLUE_BITS, mode->blueBits);
-	glfwWindowHint(GLFW_REFRESH_RATE, mode->refreshRate);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-	if (!useCustomResolution)
-	{
-		width = mode->width;
-		height = mode->height;
-	}
-
-	glfwSetErrorCallback(glfw_error_callback);
-
-	window = glfwCreateWindow(width, height, "RayTracing", fullScreen ? monitor : NULL, NULL);
-	glfwGetWindowSize(window, &width, &height);
-
-	if (!window) {
-		glfwTerminate();
-		return false;
-	}
-
-	glfwMakeContextCurrent(window);
+	return fboOutput;
+}
 
-	if (!gladLoadGL()) {
-		printf("gladLoadGL failed!\n");
+bool GLWrapper::init_window()
+{
+#ifdef RT_EGL
+	// offscreen contexts don't need a display server
+	const bool created = offscreen ? create_egl_context() : create_window();
+#else
+	const bool created = create_window(); // offscreen mode uses an invisible window
+#endif
+	if (!created)
 		return false;
-	}
 	printf("OpenGL %d.%d\n", GLVersion.major, GLVersion.minor);
 
 	float quadVertices[] = 
@@ -121,17 +154,193 @@ bool GLWrapper::init_window()
 	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
 	glBindVertexArray(0);
 
+	// accumulated samples have to stay at one resolution and pixel grid
+	if (accumulation)
+	{
+		dynamicResolution = false;
+		checkerboard = false;
+	}
+	// checkerboard already halves the traced pixels
+	if (checkerboard)
+		dynamicResolution = false;
+	// checkerboard keeps primary hit distances in alpha
+	if (dynamicResolution || checkerboard)
+		gen_framebuffer(&fboTrace, &fboTexTrace, checkerboard || floatOutput ? GL_RGBA16F : GL_RGBA, GL_RGBA);
+	if (dynamicResolution)
+		glGenQueries(TIMER_QUERIES, timerQueries);
+
+	// ray traced image, also the running mean of all samples when accumulating
+	if (SMAA_enabled || accumulation || checkerboard)
+		gen_framebuffer(&fboColor, &fboTexColor, accumulation ? GL_RGBA32F : floatOutput ? GL_RGBA16F : GL_RGBA, GL_RGBA);
+
+	// the resolve pass writes the next history and the image for SMAA at once
+	if (checkerboard)
+	{
+		const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+		for (int i = 0; i < 2; i++)
+		{
+			gen_framebuffer(&fboResolve[i], &fboTexHistory[i], GL_RGBA16F, GL_RGBA);
+			glBindFramebuffer(GL_FRAMEBUFFER, fboResolve[i]);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, fboTexColor, 0);
+			glDrawBuffers(2, drawBuffers);
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+				std::cout << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << std::endl;
+				exit(1);
+			}
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// integer texture, so no gen_framebuffer: it has to be NEAREST to be complete
+	if (tileClassification)
+	{
+		glGenTextures(1, &fboTexTiles);
+		glBindTexture(GL_TEXTURE_2D, fboTexTiles);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, (width + TILE_SIZE - 1) / TILE_SIZE, (height + TILE_SIZE - 1) / TILE_SIZE, 0,
+			GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glGenFramebuffers(1, &fboTiles);
+		glBindFramebuffer(GL_FRAMEBUFFER, fboTiles);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, fboTexTiles, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			std::cout << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << std::endl;
+			exit(1);
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// tile files live in the texture cache
+	if (virtualTexturing && !TextureCache::is_enabled())
+	{
+		std::cout << "Virtual texturing needs the texture cache, textures are loaded whole" << std::endl;
+		virtualTexturing = false;
+	}
+	if (virtualTexturing)
+		virtualTextures.init(width, height, VT_PAGES_TEX_UNIT, VT_CACHE_TEX_UNIT, offscreen);
+
 	// SMAA framebuffers
 	if (SMAA_enabled)
 	{
-		gen_framebuffer(&fboColor, &fboTexColor, GL_RGBA, GL_RGBA);
 		gen_framebuffer(&fboEdge, &fboTexEdge, GL_RG, GL_RG);
 		gen_framebuffer(&fboBlend, &fboTexBlend, GL_RGBA, GL_RGBA);
 	}
 
+	if (offscreen)
+	{
+		gen_framebuffer(&fboOutput, &fboTexOutput, floatOutput ? GL_RGBA32F : GL_RGBA8, GL_RGBA);
+		// there is no window to take the viewport size from
+		glViewport(0, 0, width, height);
+	}
+
 	return true;
 }
 
+bool GLWrapper::create_window()
+{
+	if (!glfwInit())
+		return false;
+
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwSetErrorCallback(glfw_error_callback);
+
+	if (offscreen)
+	{
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		window = glfwCreateWindow(width, height, "RayTracing", NULL, NULL);
+	}
+	else
+	{
+		GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+		const GLFWvidmode* mode = glfwGetVideoMode(monitor);
+
+		glfwWindowHint(GLFW_RED_BITS, mode->redBits);
+		glfwWindowHint(GLFW_GREEN_BITS, mode->greenBits);
+		glfwWindowHint(GLFW_BLUE_BITS, mode->blueBits);
+		glfwWindowHint(GLFW_REFRESH_RATE, mode->refreshRate);
+
+		if (!useCustomResolution)
+		{
+			width = mode->width;
+			height = mode->height;
+		}
+
+		window = glfwCreateWindow(width, height, "RayTracing", fullScreen ? monitor : NULL, NULL);
+		if (window)
+			glfwGetWindowSize(window, &width, &height);
+	}
+
+	if (!window) {
+		glfwTerminate();
+		return false;
+	}
+
+	glfwMakeContextCurrent(window);
+
+	if (!gladLoadGL()) {
+		printf("gladLoadGL failed!\n");
+		return false;
+	}
+	return true;
+}
+
+#ifdef RT_EGL
+bool GLWrapper::create_egl_context()
+{
+	// prefer a surfaceless display, the default one may still try to reach X11 or Wayland
+	EGLDisplay display = EGL_NO_DISPLAY;
+	const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless") && getPlatformDisplay)
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (display == EGL_NO_DISPLAY)
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+		printf("EGL display initialization failed!\n");
+		return false;
+	}
+	eglDisplay = display;
+
+	// surface type defaults to windows, surfaceless displays only offer pbuffer configs
+	const EGLint configAttribs[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig config;
+	EGLint configCount = 0;
+	if (!eglChooseConfig(display, configAttribs, &config, 1, &configCount) || configCount == 0 || !eglBindAPI(EGL_OPENGL_API)) {
+		printf("No EGL config with desktop OpenGL support!\n");
+		return false;
+	}
+
+	const EGLint contextAttribs[] =
+	{
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+	// all rendering goes to fboOutput, no surface is needed (EGL_KHR_surfaceless_context)
+	if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		printf("EGL context creation failed!\n");
+		return false;
+	}
+	eglContext = context;
+
+	if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress)) {
+		printf("gladLoadGL failed!\n");
+		return false;
+	}
+	return true;
+}
+#endif
+
 void GLWrapper::set_skybox(unsigned textureId)
 {
 	skyboxTex = textureId;
@@ -142,6 +351,18 @@ void GLWrapper::set_skybox(unsigned textureId)
 
 void GLWrapper::stop()
 {
+	textureLoader.cancel();
+	virtualTextures.release();
+#ifdef RT_EGL
+	if (eglContext)
+	{
+		eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(eglDisplay, eglContext);
+		eglTerminate(eglDisplay);
+		eglContext = nullptr;
+		return;
+	}
+#endif
 	glfwDestroyWindow(window);
 	glfwTerminate();
 }
@@ -152,21 +373,281 @@ void GLWrapper::enable_SMAA(SMAA_PRESET preset)
 	SMAA_preset = preset;
 }
 
-void GLWrapper::draw()
+void GLWrapper::set_profiler(Profiler* profiler)
+{
+	this->profiler = profiler;
+}
+
+Profiler* GLWrapper::getProfiler() const
+{
+	return profiler;
+}
+
+void GLWrapper::enable_offscreen(bool floatOutput)
+{
+	offscreen = true;
+	this->floatOutput = floatOutput;
+	useCustomResolution = true;
+	fullScreen = false;
+}
+
+bool GLWrapper::is_offscreen() const
+{
+	return offscreen;
+}
+
+void GLWrapper::enable_accumulation(int maxSamples)
+{
+	accumulation = true;
+	this->maxSamples = maxSamples;
+}
+
+void GLWrapper::reset_accumulation()
+{
+	sampleCount = 0;
+}
+
+int GLWrapper::getSampleCount() const
+{
+	return sampleCount;
+}
+
+void GLWrapper::enable_dynamic_resolution(float budgetMs, float minScale)
+{
+	dynamicResolution = true;
+	this->budgetMs = budgetMs;
+	this->minScale = glm::clamp(minScale, 0.1f, 1.0f);
+}
+
+float GLWrapper::getRenderScale() const
+{
+	return renderScale;
+}
+
+void GLWrapper::update_render_scale(int slot)
+{
+	if (!timerPending[slot])
+		return;
+	timerPending[slot] = false;
+
+	// a query that is still running is dropped, its object gets reused for this frame
+	GLint available = 0;
+	glGetQueryObjectiv(timerQueries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+		return;
+
+	GLuint64 elapsed = 0;
+	glGetQueryObjectui64v(timerQueries[slot], GL_QUERY_RESULT, &elapsed);
+	const float ms = std::max(elapsed / 1e6f, 0.01f);
+
+	// cost follows the pixel count, the square of the scale
+	const float ideal = timerScales[slot] * std::sqrt(budgetMs / ms);
+	// half steps and a dead zone keep the resolution from pumping
+	if (std::abs(ideal - renderScale) > 0.02f)
+		renderScale = glm::clamp(renderScale + (ideal - renderScale) * 0.5f, minScale, 1.0f);
+}
+
+void GLWrapper::enable_checkerboard()
+{
+	checkerboard = true;
+}
+
+void GLWrapper::enable_tile_classification()
+{
+	tileClassification = true;
+}
+
+void GLWrapper::enable_virtual_texturing()
 {
+	virtualTexturing = true;
+}
+
+void GLWrapper::update_virtual_textures()
+{
+	{
+		gpu_scope scope(profiler, "VT feedback");
+		feedbackShader.use();
+		feedbackShader.setVec2("vt_feedback_offset", virtualTextures.next_feedback_offset());
+		glBindFramebuffer(GL_FRAMEBUFFER, virtualTextures.getFeedbackFramebuffer());
+		glViewport(0, 0, virtualTextures.getFeedbackWidth(), virtualTextures.getFeedbackHeight());
+		glClearColor(0, 0, 0, 0);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+		checkGlErrors("Virtual texture feedback");
+	}
+
+	cpu_scope scope(profiler, "VT update");
+	// coarser tiles were accumulated so far
+	if (virtualTextures.update())
+		reset_accumulation();
 	shader.use();
+}
+
+void GLWrapper::classify_tiles()
+{
+	gpu_scope scope(profiler, "tile classify");
+	tileShader.use();
+	glBindFramebuffer(GL_FRAMEBUFFER, fboTiles);
+	glViewport(0, 0, (width + TILE_SIZE - 1) / TILE_SIZE, (height + TILE_SIZE - 1) / TILE_SIZE);
+	glDrawArrays(GL_TRIANGLES, 0, 6);
+	checkGlErrors("Classify tiles");
+
+	glActiveTexture(GL_TEXTURE0 + TILE_TEX_UNIT);
+	glBindTexture(GL_TEXTURE_2D, fboTexTiles);
+	shader.use();
+}
+
+void GLWrapper::set_camera(const glm::quat& rotation, const glm::vec3& position)
+{
+	cameraRotation = rotation;
+	cameraPosition = position;
+}
+
+void GLWrapper::resolve_checkerboard()
+{
+	gpu_scope scope(profiler, "checkerboard resolve");
+	const int current = checkerboardFrame & 1;
+
+	resolveShader.use();
+	resolveShader.setInt("parity", current);
+	resolveShader.setBool("history_valid", checkerboardFrame > 0);
+	resolveShader.setVec4("prev_camera_rotation", rtmath::to_vec4(prevCameraRotation));
+	resolveShader.setVec3("prev_camera_pos", prevCameraPosition);
+	glActiveTexture(GL_TEXTURE0 + TRACE_TEX_UNIT);
+	glBindTexture(GL_TEXTURE_2D, fboTexTrace);
+	glActiveTexture(GL_TEXTURE0 + HISTORY_TEX_UNIT);
+	glBindTexture(GL_TEXTURE_2D, fboTexHistory[1 - current]);
+	glBindFramebuffer(GL_FRAMEBUFFER, fboResolve[current]);
+	glDrawArrays(GL_TRIANGLES, 0, 6);
+	checkGlErrors("Resolve checkerboard");
+
+	prevCameraRotation = cameraRotation;
+	prevCameraPosition = cameraPosition;
+	checkerboardFrame++;
+	shader.use();
+}
+
+void GLWrapper::begin_sample()
+{
+	// first sample goes through pixel centers, a view that changes every frame looks the same as without accumulation
+	const glm::vec2 jitter = sampleCount == 0 ? glm::vec2(0) :
+		glm::vec2(halton(sampleCount, 2), halton(sampleCount, 3)) - 0.5f;
+	shader.setVec2("jitter", jitter);
+
+	// running mean: color = sample / (n + 1) + color * n / (n + 1)
+	if (sampleCount > 0)
+	{
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+		glBlendColor(0, 0, 0, 1.0f / (sampleCount + 1));
+	}
+}
+
+void GLWrapper::draw()
+{
+	if (textureLoader.getPendingCount() > 0)
+	{
+		cpu_scope scope(profiler, "texture upload");
+		// placeholder colors were accumulated so far
+		if (textureLoader.update() > 0)
+			reset_accumulation();
+	}
+
+	if (!dynamicResolution)
+	{
+		draw_passes();
+		return;
+	}
+
+	const int slot = timerFrame++ % TIMER_QUERIES;
+	update_render_scale(slot);
+	timerScales[slot] = renderScale;
+	glBeginQuery(GL_TIME_ELAPSED, timerQueries[slot]);
+	draw_passes();
+	glEndQuery(GL_TIME_ELAPSED);
+	timerPending[slot] = true;
+}
+
+void GLWrapper::draw_passes()
+{
+	const int traceWidth = std::max(1, static_cast<int>(width * renderScale + 0.5f));
+	const int traceHeight = std::max(1, static_cast<int>(height * renderScale + 0.5f));
+	const bool scaled = traceWidth < width || traceHeight < height;
+	const GLuint target = SMAA_enabled || accumulation || checkerboard ? fboColor : fboOutput;
+
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
 	glBindVertexArray(quadVAO);
-	if (SMAA_enabled) 
+	// before the trace, a synchronous update makes the tiles of this very frame resident
+	if (virtualTexturing && virtualTextures.getCount() > 0 && (!accumulation || sampleCount < maxSamples))
 	{
-		glBindFramebuffer(GL_FRAMEBUFFER, fboColor);
+		update_virtual_textures();
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	}
+	// converged accumulation doesn't trace anymore
+	if (tileClassification && (!accumulation || sampleCount < maxSamples))
+	{
+		classify_tiles();
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	}
+
+	shader.use();
+	glBindFramebuffer(GL_FRAMEBUFFER, scaled || checkerboard ? fboTrace : target);
+	if (dynamicResolution)
+	{
+		shader.setVec2("render_scale", glm::vec2(traceWidth / static_cast<float>(width), traceHeight / static_cast<float>(height)));
+		glViewport(0, 0, traceWidth, traceHeight);
+	}
+	if (checkerboard)
+	{
+		shader.setInt("checkerboard", checkerboardFrame & 1);
+		glViewport(0, 0, (width + 1) / 2, height);
+	}
+	// a converged image is only presented again
+	if (!accumulation || sampleCount < maxSamples)
+	{
+		gpu_scope scope(profiler, "ray trace");
+		if (accumulation)
+		{
+			begin_sample();
+		}
+		else
+		{
+			glClearColor(0, 0, 0, 0);
+			glClear(GL_COLOR_BUFFER_BIT);
+		}
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+		if (accumulation)
+		{
+			glDisable(GL_BLEND);
+			sampleCount++;
+		}
 	}
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT);
-	glDrawArrays(GL_TRIANGLES, 0, 6);
 	checkGlErrors("Draw raytraced image");
 
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	if (checkerboard)
+		resolve_checkerboard();
+	if (scaled)
+	{
+		gpu_scope scope(profiler, "upscale");
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fboTrace);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+		glBlitFramebuffer(0, 0, traceWidth, traceHeight, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, target);
+		checkGlErrors("Upscale raytraced image");
+	}
+
 	if (!SMAA_enabled)
 	{
+		if (accumulation || checkerboard)
+		{
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, fboColor);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fboOutput);
+			glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			checkGlErrors("Copy accumulated image");
+		}
 		return;
 	}
 	
@@ -174,9 +655,12 @@ void GLWrapper::draw()
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, fboTexColor);
 	glBindFramebuffer(GL_FRAMEBUFFER, fboEdge);
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT);
-	glDrawArrays(GL_TRIANGLES, 0, 6);
+	{
+		gpu_scope scope(profiler, "SMAA edge");
+		glClearColor(0, 0, 0, 0);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+	}
 	checkGlErrors("Draw edge");
 	
 	blendShader.use();
@@ -187,9 +671,12 @@ void GLWrapper::draw()
 	glActiveTexture(GL_TEXTURE2);
 	glBindTexture(GL_TEXTURE_2D, searchTex);
 	glBindFramebuffer(GL_FRAMEBUFFER, fboBlend);
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT);
-	glDrawArrays(GL_TRIANGLES, 0, 6);
+	{
+		gpu_scope scope(profiler, "SMAA blend");
+		glClearColor(0, 0, 0, 0);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+	}
 	checkGlErrors("Draw blend");
 
 	neighborhoodShader.use();
@@ -197,10 +684,13 @@ void GLWrapper::draw()
 	glBindTexture(GL_TEXTURE_2D, fboTexColor);
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, fboTexBlend);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT);
-	glDrawArrays(GL_TRIANGLES, 0, 6);
+	glBindFramebuffer(GL_FRAMEBUFFER, fboOutput);
+	{
+		gpu_scope scope(profiler, "SMAA neighborhood");
+		glClearColor(0, 0, 0, 0);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+	}
 	checkGlErrors("Draw screen");
 
 	shader.use();
@@ -232,21 +722,12 @@ void GLWrapper::gen_framebuffer(GLuint* fbo, GLuint* fboTex, GLenum internalForm
 void GLWrapper::init_shaders(rt_defines& defines)
 {
 	const std::string vertexShaderSrc = readStringFromFile(ASSETS_DIR "/shaders/quad.vert");
-	std::string fragmentShaderSrc = readStringFromFile(ASSETS_DIR "/shaders/rt.frag");
-	
-	replace(fragmentShaderSrc, "{SPHERE_SIZE}", std::to_string(defines.sphere_size));
-	replace(fragmentShaderSrc, "{PLANE_SIZE}", std::to_string(defines.plane_size));
-	replace(fragmentShaderSrc, "{SURFACE_SIZE}", std::to_string(defines.surface_size));
-	replace(fragmentShaderSrc, "{BOX_SIZE}", std::to_string(defines.box_size));
-	replace(fragmentShaderSrc, "{TORUS_SIZE}", std::to_string(defines.torus_size));
-	replace(fragmentShaderSrc, "{RING_SIZE}", std::to_string(defines.ring_size));
-	replace(fragmentShaderSrc, "{LIGHT_POINT_SIZE}", std::to_string(defines.light_point_size));
-	replace(fragmentShaderSrc, "{LIGHT_DIRECT_SIZE}", std::to_string(defines.light_direct_size));
-	replace(fragmentShaderSrc, "{ITERATIONS}", std::to_string(defines.iterations));
-	replace(fragmentShaderSrc, "{AMBIENT_COLOR}", to_string(defines.ambient_color));
-	replace(fragmentShaderSrc, "{SHADOW_AMBIENT}", to_string(defines.shadow_ambient));
-
-	shader.initFromSrc(vertexShaderSrc.c_str(), fragmentShaderSrc.c_str());
+	traceSource = readStringFromFile(ASSETS_DIR "/shaders/rt.frag");
+	replace(traceSource, "{ITERATIONS}", std::to_string(defines.iterations));
+	replace(traceSource, "{AMBIENT_COLOR}", to_string(defines.ambient_color));
+	replace(traceSource, "{SHADOW_AMBIENT}", to_string(defines.shadow_ambient));
+	traceFeatures = defines.features;
+	init_trace_shaders();
 
 	if (SMAA_enabled)
 	{
@@ -271,102 +752,150 @@ void GLWrapper::init_shaders(rt_defines& defines)
 		searchTex = smaaBuilder.load_search_texture();
 	}
 
-	shader.use();
+	if (checkerboard)
+	{
+		resolveShader.initFromSrc(vertexShaderSrc, readStringFromFile(ASSETS_DIR "/shaders/checkerboard.frag"));
+		resolveShader.use();
+		resolveShader.setInt("trace_tex", TRACE_TEX_UNIT);
+		resolveShader.setInt("history_tex", HISTORY_TEX_UNIT);
+	}
 
+	shader.use();
 	checkGlErrors("Shader creation");
 }
 
-std::string GLWrapper::to_string(glm::vec3 v)
+unsigned GLWrapper::getFeatures() const
 {
-	return std::string().append("vec3(").append(std::to_string(v.x)).append(",").append(std::to_string(v.y)).append(",").append(std::to_string(v.z)).append(")");
+	return traceFeatures;
+}
+
+void GLWrapper::add_features(unsigned features)
+{
+	if (!(features & ~traceFeatures))
+		return;
+	printf("Scene gained features 0x%x, rebuilding the ray trace shaders\n", features & ~traceFeatures);
+	traceFeatures |= features;
+	glDeleteProgram(shader.ID);
+	if (tileClassification)
+		glDeleteProgram(tileShader.ID);
+	if (virtualTexturing)
+		glDeleteProgram(feedbackShader.ID);
+	init_trace_shaders();
+	reset_accumulation();
+	checkGlErrors("Shader rebuild");
 }
 
-unsigned int GLWrapper::load_cubemap(std::vector<std::string> faces, bool genMipmap)
+void GLWrapper::init_trace_shaders()
 {
-	unsigned int textureID;
-	glGenTextures(1, &textureID);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
+	const std::string vertexShaderSrc = readStringFromFile(ASSETS_DIR "/shaders/quad.vert");
+	// variant for the scene's feature set, ProgramCache keys binaries by source so every variant is cached separately
+	std::string fragmentShaderSrc = traceSource;
+	fragmentShaderSrc.insert(fragmentShaderSrc.find('\n') + 1, "#define SCENE_FEATURES " + std::to_string(traceFeatures) + "\n");
+
+	shader.initFromSrc(vertexShaderSrc.c_str(), fragmentShaderSrc.c_str());
 
-	int width, height, nrChannels;
-	for (unsigned int i = 0; i < faces.size(); i++)
+	// same source and uniforms, its main() classifies tiles instead of tracing
+	if (tileClassification)
 	{
-		unsigned char* data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 0);
-		if (data)
-		{
-			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-				0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data
-			);
-			stbi_image_free(data);
-		}
-		else
-		{
-			std::cout << "Cubemap tex failed to load at path: " << faces[i] << std::endl;
-			stbi_image_free(data);
-		}
+		std::string tileShaderSrc = fragmentShaderSrc;
+		tileShaderSrc.insert(tileShaderSrc.find('\n') + 1, "#define TILE_CLASSIFY\n");
+		tileShader.initFromSrc(vertexShaderSrc, tileShaderSrc);
+		tileShader.use();
+		tileShader.setInt("tile_size", TILE_SIZE);
 	}
-	if (genMipmap) {
-		glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+
+	// camera rays only, their primary hits record the virtual texture tiles they sample
+	if (virtualTexturing)
+	{
+		std::string feedbackShaderSrc = fragmentShaderSrc;
+		feedbackShaderSrc.insert(feedbackShaderSrc.find('\n') + 1, "#define VT_FEEDBACK\n");
+		feedbackShader.initFromSrc(vertexShaderSrc, feedbackShaderSrc);
+		feedbackShader.use();
+		feedbackShader.setInt("object_textures", OBJECT_TEXTURES_TEX_UNIT);
+		feedbackShader.setFloat("vt_feedback_scale", static_cast<float>(VirtualTextures::FEEDBACK_SCALE));
+		feedbackShader.setFloat("vt_lod_bias", -std::log2(static_cast<float>(VirtualTextures::FEEDBACK_SCALE)));
+		virtualTextures.set_uniforms(feedbackShader);
 	}
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, genMipmap ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 
-	return textureID;
+	shader.use();
+	shader.setVec2("render_scale", glm::vec2(1));
+	shader.setInt("checkerboard", -1);
+	shader.setInt("tile_size", tileClassification ? TILE_SIZE : 0);
+	shader.setInt("tile_classes", TILE_TEX_UNIT);
+	shader.setInt("object_textures", OBJECT_TEXTURES_TEX_UNIT);
+	// samplers of different types must not share a unit, even unused ones
+	shader.setInt("vt_pages", VT_PAGES_TEX_UNIT);
+	shader.setInt("vt_cache", VT_CACHE_TEX_UNIT);
+	if (virtualTexturing)
+		virtualTextures.set_uniforms(shader);
+
+	// a rebuilt program starts with the values the scene set on the previous one
+	for (const auto& u : intUniforms)
+		set_int(u.first.c_str(), u.second);
+	for (const auto& b : uniformBlocks)
+		bind_uniform_block(b.first.c_str(), b.second);
 }
 
-unsigned int GLWrapper::load_texture(char const* path, GLuint wrapMode)
+std::string GLWrapper::to_string(glm::vec3 v)
 {
-	unsigned int textureID;
-	glGenTextures(1, &textureID);
-
-	int width, height, nrComponents;
-	unsigned char* data = stbi_load(path, &width, &height, &nrComponents, 0);
-	if (data)
-	{
-		GLenum format;
-		if (nrComponents == 1)
-			format = GL_RED;
-		else if (nrComponents == 3)
-			format = GL_RGB;
-		else if (nrComponents == 4)
-			format = GL_RGBA;
+	return std::string().append("vec3(").append(std::to_string(v.x)).append(",").append(std::to_string(v.y)).append(",").append(std::to_string(v.z)).append(")");
+}
 
-		glBindTexture(GL_TEXTURE_2D, textureID);
-		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
-		
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapMode);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapMode);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+GLuint GLWrapper::load_cubemap(const std::vector<std::string>& faces, bool genMipmap)
+{
+	// the nebula is dark, black stands in for it until the faces arrive
+	return textureLoader.load_cubemap(faces, glm::vec3(0), genMipmap);
+}
 
-		stbi_image_free(data);
-	}
-	else
-	{
-		std::cout << "Texture failed to load at path: " << path << std::endl;
-		stbi_image_free(data);
-	}
+GLuint GLWrapper::load_texture_array(const std::vector<std::string>& names, const std::vector<glm::vec4>& placeholders)
+{
+	std::vector<std::string> paths;
+	for (const std::string& name : names)
+		paths.push_back(name.empty() ? name : ASSETS_DIR "/textures/" + name);
+	const GLuint array = textureLoader.load_array(paths, placeholders, MAX_TEXTURE_LAYER_SIZE);
+	glActiveTexture(GL_TEXTURE0 + OBJECT_TEXTURES_TEX_UNIT);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, array);
+	textures.push_back(array);
+	return array;
+}
 
-	return textureID;
+bool GLWrapper::load_virtual_texture(int texNum, const std::string& name, const glm::vec4& placeholder)
+{
+	if (!virtualTexturing || virtualTextures.add(texNum, ASSETS_DIR "/textures/" + name, placeholder) < 0)
+		return false;
+	feedbackShader.use();
+	virtualTextures.set_uniforms(feedbackShader);
+	shader.use();
+	virtualTextures.set_uniforms(shader);
+	return true;
 }
 
-GLuint GLWrapper::load_texture(int texNum, const char* name, const char* uniformName, GLuint wrapMode)
+void GLWrapper::finish_textures()
 {
-	const std::string path = ASSETS_DIR "/textures/" + std::string(name);
-	const unsigned int tex = load_texture(path.c_str(), wrapMode);
-	shader.setInt(uniformName, texNum);
-	textures.push_back(tex);
-	return tex;
+	textureLoader.finish();
+	virtualTextures.finish();
 }
 
-void GLWrapper::init_buffer(GLuint* ubo, const char* name, int bindingPoint, size_t size, void* data) const
+void GLWrapper::init_buffer(GLuint* ubo, const char* name, int bindingPoint, size_t size, void* data)
 {
 	glGenBuffers(1, ubo);
 	glBindBuffer(GL_UNIFORM_BUFFER, *ubo);
 	glBufferData(GL_UNIFORM_BUFFER, size, data, GL_DYNAMIC_DRAW);
+	bind_uniform_block(name, bindingPoint);
+	uniformBlocks[name] = bindingPoint;
+	// the checkerboard resolve reads the camera and canvas size from the scene block too
+	if (checkerboard)
+	{
+		const GLuint resolveIndex = glGetUniformBlockIndex(resolveShader.ID, name);
+		if (resolveIndex != GL_INVALID_INDEX)
+			glUniformBlockBinding(resolveShader.ID, resolveIndex, bindingPoint);
+	}
+	glBindBufferBase(GL_UNIFORM_BUFFER, bindingPoint, *ubo);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void GLWrapper::bind_uniform_block(const char* name, int bindingPoint) const
+{
 	GLuint blockIndex = glGetUniformBlockIndex(shader.ID, name);
 	if (blockIndex == 0xffffffff)
 	{
@@ -374,8 +903,10 @@ void GLWrapper::init_buffer(GLuint* ubo, const char* name, int bindingPoint, siz
 		exit(1);
 	}
 	glUniformBlockBinding(shader.ID, blockIndex, bindingPoint);
-	glBindBufferBase(GL_UNIFORM_BUFFER, bindingPoint, *ubo);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	if (tileClassification)
+		glUniformBlockBinding(tileShader.ID, glGetUniformBlockIndex(tileShader.ID, name), bindingPoint);
+	if (virtualTexturing)
+		glUniformBlockBinding(feedbackShader.ID, glGetUniformBlockIndex(feedbackShader.ID, name), bindingPoint);
 }
 
 void GLWrapper::update_buffer(GLuint ubo, size_t size, void* data)
@@ -384,3 +915,51 @@ void GLWrapper::update_buffer(GLuint ubo, size_t size, void* data)
 	glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
 	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
+
+void GLWrapper::init_texture_buffer(GLuint* buffer, GLuint* tex, const char* name, int texNum, GLenum format, size_t size, const void* data)
+{
+	glGenBuffers(1, buffer);
+	update_texture_buffer(*buffer, size, data);
+
+	glGenTextures(1, tex);
+	glActiveTexture(GL_TEXTURE0 + texNum);
+	glBindTexture(GL_TEXTURE_BUFFER, *tex);
+	glTexBuffer(GL_TEXTURE_BUFFER, format, *buffer);
+	set_int(name, texNum);
+	textures.push_back(*tex);
+	checkGlErrors("Texture buffer creation");
+}
+
+void GLWrapper::update_texture_buffer(GLuint buffer, size_t size, const void* data)
+{
+	// storage is reallocated on every update, the driver can hand out new memory instead of waiting for the previous frame
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	glBufferData(GL_TEXTURE_BUFFER, size, data, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void GLWrapper::update_texture_buffer(GLuint buffer, size_t offset, size_t size, const void* data)
+{
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	glBufferSubData(GL_TEXTURE_BUFFER, offset, size, data);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void GLWrapper::set_int(const char* name, int value)
+{
+	intUniforms[name] = value;
+	// the tile pre-pass and the feedback pass read the scene with the same uniforms
+	if (tileClassification)
+	{
+		tileShader.use();
+		tileShader.setInt(name, value);
+	}
+	if (virtualTexturing)
+	{
+		feedbackShader.use();
+		feedbackShader.setInt(name, value);
+	}
+	// SMAA passes leave their own program current
+	shader.use();
+	shader.setInt(name, value);
+}
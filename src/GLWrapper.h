@@ -2,14 +2,19 @@
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <map>
 #include <string>
 #include <vector>
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include "shader.h"
 #include "utils.h"
 #include "SMAA_Builder.h"
+#include "TextureLoader.h"
+#include "VirtualTextures.h"
 
 struct rt_defines;
+class Profiler;
 
 class GLWrapper
 {
@@ -21,28 +26,91 @@ public:
 	int getWidth();
 	int getHeight();
 	GLuint getProgramId();
+	// framebuffer draw() leaves the final image in, 0 - default framebuffer
+	GLuint getOutputFramebuffer() const;
 
 	bool init_window();
+	// render into an offscreen framebuffer instead of a visible window, call before init_window
+	// floatOutput - keep unclamped colors for .pfm/.exr output
+	void enable_offscreen(bool floatOutput = false);
+	bool is_offscreen() const;
+	// progressive accumulation: while nothing changes, every frame adds a jittered sample to a float target
+	// and the view converges to a supersampled image, tracing stops after maxSamples. Call before init_window
+	void enable_accumulation(int maxSamples = 256);
+	// camera or scene changed, starts over from a single sample
+	void reset_accumulation();
+	int getSampleCount() const;
+	// dynamic resolution: the ray trace pass renders into a part of the window size picked every frame from measured
+	// GPU time, so draw() stays within budgetMs, and is upscaled before SMAA. Call before init_window,
+	// has no effect together with accumulation or checkerboard rendering
+	void enable_dynamic_resolution(float budgetMs, float minScale = 0.5f);
+	float getRenderScale() const;
+	// checkerboard rendering: every frame traces half of the pixels, alternating, the rest is reprojected
+	// from the previous frame with the camera motion. Call before init_window, has no effect together with accumulation
+	void enable_checkerboard();
+	// variable rate tracing: a pre-pass sorts screen tiles into sky only, a single object, or complex,
+	// camera rays of the first two skip the full object loops. Call before init_window
+	void enable_tile_classification();
+	// virtual texturing: textures loaded with load_virtual_texture are cut into tiles and only the ones the view needs
+	// stay in video memory, picked every frame by a low resolution feedback pass. Offscreen rendering waits for the
+	// tiles of every frame. Call before init_window, needs the texture cache for the tile files
+	void enable_virtual_texturing();
+	// camera of the next draw(), SceneManager sets it every frame
+	void set_camera(const glm::quat& rotation, const glm::vec3& position);
+	// rt.frag is specialized for defines.features, see add_features for scene contents added later
 	void init_shaders(rt_defines& defines);
+	// rt_feature bits the ray trace shaders were built with
+	unsigned getFeatures() const;
+	// relinks the ray trace shaders when features has bits they lack, uniforms and blocks set so far carry over
+	void add_features(unsigned features);
 	void set_skybox(unsigned int textureId);
 
 	void stop();
 	void enable_SMAA(SMAA_PRESET preset);
+	// times draw() passes, nullptr disables
+	void set_profiler(Profiler* profiler);
+	Profiler* getProfiler() const;
 
-	GLFWwindow* window;
+	GLFWwindow* window = nullptr;
 
 	void draw();
-	static GLuint load_cubemap(std::vector<std::string> faces, bool genMipmap = false);
-	GLuint load_texture(int texNum, const char* name, const char* uniformName, GLuint wrapMode = GL_REPEAT);
-	void init_buffer(GLuint* ubo, const char* name, int bindingPoint, size_t size, void* data) const;
+	// textures load in the background: they are usable right away with placeholder colors,
+	// images are decoded on worker threads and uploaded by draw() as they finish
+	GLuint load_cubemap(const std::vector<std::string>& faces, bool genMipmap = false);
+	// object textures, objects refer to layer textureNum - 1 by textureNum = index in names + 1, an empty name leaves
+	// the layer with its placeholder.
+	// Layers share the size of the largest texture up to MAX_TEXTURE_LAYER_SIZE, smaller ones are scaled up.
+	// The array stays bound to its own unit, the passes after the ray trace don't touch it
+	GLuint load_texture_array(const std::vector<std::string>& names, const std::vector<glm::vec4>& placeholders);
+	// sphere texture streamed by the virtual texturing, objects refer to it by textureNum = texNum.
+	// false if virtual texturing is off or the image can't be streamed, it belongs in the texture array then
+	bool load_virtual_texture(int texNum, const std::string& name, const glm::vec4& placeholder);
+	// waits until all textures are loaded, for output that doesn't depend on decode times
+	void finish_textures();
+	void init_buffer(GLuint* ubo, const char* name, int bindingPoint, size_t size, void* data);
 	static void update_buffer(GLuint ubo, size_t size, void* data);
+	void init_texture_buffer(GLuint* buffer, GLuint* tex, const char* name, int texNum, GLenum format, size_t size, const void* data);
+	static void update_texture_buffer(GLuint buffer, size_t size, const void* data);
+	static void update_texture_buffer(GLuint buffer, size_t offset, size_t size, const void* data);
+	void set_int(const char* name, int value);
 
 private:
-	Shader shader, edgeShader, blendShader, neighborhoodShader;
+	Shader shader, edgeShader, blendShader, neighborhoodShader, resolveShader, tileShader, feedbackShader;
 	GLuint skyboxTex, areaTex, searchTex;
-	GLuint quadVAO, quadVBO;
+	GLuint quadVAO = 0, quadVBO = 0;
 	GLuint fboColor, fboTexColor, fboEdge, fboTexEdge, fboBlend, fboTexBlend;
+	GLuint fboOutput = 0, fboTexOutput = 0; // offscreen target, 0 - default framebuffer
+	GLuint fboTrace = 0, fboTexTrace = 0; // full size, dynamic resolution and checkerboard use its lower left part
+	GLuint fboResolve[2] = {}, fboTexHistory[2] = {}; // history i + fboTexColor
+	GLuint fboTiles = 0, fboTexTiles = 0; // one R32UI texel per tile
 	std::vector<GLuint> textures;
+	TextureLoader textureLoader{ UPLOAD_TEX_UNIT };
+	std::string traceSource; // rt.frag with the scene defines, without SCENE_FEATURES
+	unsigned traceFeatures = 0;
+	// set_int and init_buffer values, applied again to relinked ray trace shaders
+	std::map<std::string, int> intUniforms;
+	std::map<std::string, int> uniformBlocks;
+	VirtualTextures virtualTextures;
 
 	int width;
 	int height;
@@ -50,11 +118,61 @@ private:
 	bool fullScreen = true;
 	bool useCustomResolution = false;
 	bool SMAA_enabled = false;
+	bool offscreen = false;
+	bool floatOutput = false;
+	bool accumulation = false;
+	int maxSamples = 0;
+	int sampleCount = 0;
+	bool dynamicResolution = false;
+	float budgetMs = 0;
+	float minScale = 1;
+	float renderScale = 1;
+
+	// draw() GPU time of the last frames, read back a few frames late so the CPU doesn't wait
+	static const int TIMER_QUERIES = 3;
+	GLuint timerQueries[TIMER_QUERIES] = {};
+	float timerScales[TIMER_QUERIES] = {};
+	bool timerPending[TIMER_QUERIES] = {};
+	int timerFrame = 0;
+
+	static const int TRACE_TEX_UNIT = 6;
+	static const int HISTORY_TEX_UNIT = 7;
+	static const int TILE_TEX_UNIT = 11;
+	static const int OBJECT_TEXTURES_TEX_UNIT = 12;
+	static const int UPLOAD_TEX_UNIT = 13;
+	static const int VT_PAGES_TEX_UNIT = 14;
+	static const int VT_CACHE_TEX_UNIT = 15;
+	static const int MAX_TEXTURE_LAYER_SIZE = 4096;
+	static const int TILE_SIZE = 8;
+
+	bool checkerboard = false;
+	int checkerboardFrame = 0;
+	glm::quat cameraRotation = glm::quat(1, 0, 0, 0);
+	glm::vec3 cameraPosition = glm::vec3(0);
+	glm::quat prevCameraRotation = glm::quat(1, 0, 0, 0);
+	glm::vec3 prevCameraPosition = glm::vec3(0);
+	bool tileClassification = false;
+	bool virtualTexturing = false;
+	void* eglDisplay = nullptr; // EGLDisplay and EGLContext of a windowless context
+	void* eglContext = nullptr;
 	SMAA_PRESET SMAA_preset;
+	Profiler* profiler = nullptr;
 
+	void begin_sample();
+	void draw_passes();
+	void update_render_scale(int slot);
+	void resolve_checkerboard();
+	void classify_tiles();
+	void update_virtual_textures();
+	// shader, tileShader and feedbackShader from traceSource and traceFeatures
+	void init_trace_shaders();
+	void bind_uniform_block(const char* name, int bindingPoint) const;
+	bool create_window();
+#ifdef RT_EGL
+	bool create_egl_context();
+#endif
 	void gen_framebuffer(GLuint* fbo, GLuint* fboTex, GLenum internalFormat, GLenum format) const;
 	
-	static GLuint load_texture(char const* path, GLuint wrapMode = GL_REPEAT);
 	static std::string to_string(glm::vec3 v);
 };
 
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Minimal image writers for frame dumps, no external dependencies.
+// Pixel rows are expected top to bottom.
+class ImageWriter
+{
+public:
+	// 8-bit binary PPM (rgb)
+	static bool write_ppm(const char* path, int width, int height, const unsigned char* rgb)
+	{
+		FILE* f = fopen(path, "wb");
+		if (!f)
+			return false;
+		fprintf(f, "P6\n%d %d\n255\n", width, height);
+		const size_t size = static_cast<size_t>(width) * height * 3;
+		const bool ok = fwrite(rgb, 1, size, f) == size;
+		fclose(f);
+		return ok;
+	}
+
+	// 32-bit float PFM (rgb), keeps unclamped values for reference comparisons
+	static bool write_pfm(const char* path, int width, int height, const float* rgb)
+	{
+		FILE* f = fopen(path, "wb");
+		if (!f)
+			return false;
+		// negative scale - little endian; pfm rows go bottom to top
+		fprintf(f, "PF\n%d %d\n-1.0\n", width, height);
+		bool ok = true;
+		for (int y = height - 1; y >= 0 && ok; y--)
+			ok = fwrite(rgb + static_cast<size_t>(y) * width * 3, sizeof(float), width * 3, f) == static_cast<size_t>(width) * 3;
+		fclose(f);
+		return ok;
+	}
+
+	// 32-bit float OpenEXR (rgb), scanline image without compression
+	static bool write_exr(const char* path, int width, int height, const float* rgb)
+	{
+		std::vector<unsigned char> exr = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 }; // magic, version 2, scanline
+
+		std::vector<unsigned char> channels;
+		for (const char* name : { "B", "G", "R" }) // channels are sorted by name
+		{
+			channels.push_back(name[0]);
+			channels.push_back(0);
+			put_le32(channels, 2); // pixel type: float
+			put_le32(channels, 0); // pLinear + reserved
+			put_le32(channels, 1); // x sampling
+			put_le32(channels, 1); // y sampling
+		}
+		channels.push_back(0);
+		put_attribute(exr, "channels", "chlist", channels);
+
+		put_attribute(exr, "compression", "compression", std::vector<unsigned char>(1, 0));
+		std::vector<unsigned char> box;
+		put_le32(box, 0);
+		put_le32(box, 0);
+		put_le32(box, width - 1);
+		put_le32(box, height - 1);
+		put_attribute(exr, "dataWindow", "box2i", box);
+		put_attribute(exr, "displayWindow", "box2i", box);
+		put_attribute(exr, "lineOrder", "lineOrder", std::vector<unsigned char>(1, 0)); // increasing y
+		std::vector<unsigned char> one;
+		put_le32(one, float_bits(1.0f));
+		put_attribute(exr, "pixelAspectRatio", "float", one);
+		put_attribute(exr, "screenWindowCenter", "v2f", std::vector<unsigned char>(8, 0));
+		put_attribute(exr, "screenWindowWidth", "float", one);
+		exr.push_back(0); // end of header
+
+		// line offset table, then one block per scanline: y, size, B row, G row, R row
+		const uint32_t line_size = static_cast<uint32_t>(width) * 3 * sizeof(float);
+		const uint64_t first = exr.size() + static_cast<uint64_t>(height) * 8;
+		for (int y = 0; y < height; y++)
+		{
+			const uint64_t offset = first + static_cast<uint64_t>(y) * (line_size + 8);
+			put_le32(exr, static_cast<uint32_t>(offset));
+			put_le32(exr, static_cast<uint32_t>(offset >> 32));
+		}
+		exr.reserve(exr.size() + static_cast<size_t>(height) * (line_size + 8));
+		for (int y = 0; y < height; y++)
+		{
+			put_le32(exr, y);
+			put_le32(exr, line_size);
+			const float* row = rgb + static_cast<size_t>(y) * width * 3;
+			for (int c = 2; c >= 0; c--)
+				for (int x = 0; x < width; x++)
+					put_le32(exr, float_bits(row[x * 3 + c]));
+		}
+
+		FILE* f = fopen(path, "wb");
+		if (!f)
+			return false;
+		const bool ok = fwrite(exr.data(), 1, exr.size(), f) == exr.size();
+		fclose(f);
+		return ok;
+	}
+
+	// 8-bit PNG, 3 (rgb) or 4 (rgba) channels, stored without compression
+	static bool write_png(const char* path, int width, int height, int channels, const unsigned char* data)
+	{
+		const size_t stride = static_cast<size_t>(width) * channels;
+		std::vector<unsigned char> raw;
+		raw.reserve((stride + 1) * height);
+		for (int y = 0; y < height; y++)
+		{
+			raw.push_back(0); // filter: none
+			raw.insert(raw.end(), data + y * stride, data + (y + 1) * stride);
+		}
+
+		// zlib stream with stored deflate blocks
+		std::vector<unsigned char> zlib = { 0x78, 0x01 };
+		size_t pos = 0;
+		do
+		{
+			const size_t len = std::min<size_t>(raw.size() - pos, 65535);
+			const bool last = pos + len == raw.size();
+			zlib.push_back(last ? 1 : 0);
+			zlib.push_back(len & 0xff);
+			zlib.push_back((len >> 8) & 0xff);
+			zlib.push_back(~len & 0xff);
+			zlib.push_back((~len >> 8) & 0xff);
+			zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+			pos += len;
+		} while (pos < raw.size());
+		put_u32(zlib, adler32(raw.data(), raw.size()));
+
+		std::vector<unsigned char> ihdr;
+		put_u32(ihdr, width);
+		put_u32(ihdr, height);
+		ihdr.push_back(8); // bit depth
+		ihdr.push_back(channels == 4 ? 6 : 2); // color type
+		ihdr.push_back(0);
+		ihdr.push_back(0);
+		ihdr.push_back(0);
+
+		std::vector<unsigned char> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		put_chunk(png, "IHDR", ihdr);
+		put_chunk(png, "IDAT", zlib);
+		put_chunk(png, "IEND", std::vector<unsigned char>());
+
+		FILE* f = fopen(path, "wb");
+		if (!f)
+			return false;
+		const bool ok = fwrite(png.data(), 1, png.size(), f) == png.size();
+		fclose(f);
+		return ok;
+	}
+
+	// raw bytes, no header
+	static bool write_raw(const char* path, const void* data, size_t size)
+	{
+		FILE* f = fopen(path, "wb");
+		if (!f)
+			return false;
+		const bool ok = fwrite(data, 1, size, f) == size;
+		fclose(f);
+		return ok;
+	}
+
+	// chooses format by file extension (.png, .ppm, .pfm, .raw), rgb 8-bit input
+	static bool write(const std::string& path, int width, int height, const unsigned char* rgb)
+	{
+		if (has_extension(path, ".ppm"))
+			return write_ppm(path.c_str(), width, height, rgb);
+		if (has_extension(path, ".raw"))
+			return write_raw(path.c_str(), rgb, static_cast<size_t>(width) * height * 3);
+		return write_png(path.c_str(), width, height, 3, rgb);
+	}
+
+	// chooses format by file extension (.pfm, .exr), rgb float input
+	static bool write(const std::string& path, int width, int height, const float* rgb)
+	{
+		if (has_extension(path, ".exr"))
+			return write_exr(path.c_str(), width, height, rgb);
+		return write_pfm(path.c_str(), width, height, rgb);
+	}
+
+	// formats that keep unclamped float colors
+	static bool is_float_format(const std::string& path)
+	{
+		return has_extension(path, ".pfm") || has_extension(path, ".exr");
+	}
+
+	static bool has_extension(const std::string& path, const char* ext)
+	{
+		const size_t len = strlen(ext);
+		return path.size() >= len && path.compare(path.size() - len, len, ext) == 0;
+	}
+
+private:
+	static void put_u32(std::vector<unsigned char>& v, uint32_t value)
+	{
+		v.push_back((value >> 24) & 0xff);
+		v.push_back((value >> 16) & 0xff);
+		v.push_back((value >> 8) & 0xff);
+		v.push_back(value & 0xff);
+	}
+
+	static void put_le32(std::vector<unsigned char>& v, uint32_t value)
+	{
+		v.push_back(value & 0xff);
+		v.push_back((value >> 8) & 0xff);
+		v.push_back((value >> 16) & 0xff);
+		v.push_back((value >> 24) & 0xff);
+	}
+
+	static uint32_t float_bits(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	static void put_attribute(std::vector<unsigned char>& exr, const char* name, const char* type, const std::vector<unsigned char>& value)
+	{
+		exr.insert(exr.end(), name, name + strlen(name) + 1);
+		exr.insert(exr.end(), type, type + strlen(type) + 1);
+		put_le32(exr, static_cast<uint32_t>(value.size()));
+		exr.insert(exr.end(), value.begin(), value.end());
+	}
+
+	static void put_chunk(std::vector<unsigned char>& png, const char* type, const std::vector<unsigned char>& data)
+	{
+		put_u32(png, static_cast<uint32_t>(data.size()));
+		const size_t start = png.size();
+		png.insert(png.end(), type, type + 4);
+		png.insert(png.end(), data.begin(), data.end());
+		put_u32(png, crc32(png.data() + start, png.size() - start));
+	}
+
+	static uint32_t crc32(const unsigned char* data, size_t size)
+	{
+		// function-local static, initialized once even with concurrent writers
+		static const std::vector<uint32_t> table = crc32_table();
+
+		uint32_t crc = 0xffffffffu;
+		for (size_t i = 0; i < size; i++)
+			crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		return crc ^ 0xffffffffu;
+	}
+
+	static std::vector<uint32_t> crc32_table()
+	{
+		std::vector<uint32_t> table(256);
+		for (uint32_t n = 0; n < 256; n++)
+		{
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		return table;
+	}
+
+	static uint32_t adler32(const unsigned char* data, size_t size)
+	{
+		uint32_t a = 1, b = 0;
+		for (size_t i = 0; i < size; i++)
+		{
+			a = (a + data[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		return (b << 16) | a;
+	}
+};
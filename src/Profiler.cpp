@@ -0,0 +1,251 @@
+#include "Profiler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+
+namespace
+{
+	const char* FRAME_SCOPE = "frame";
+
+	// names come from code, only quotes and backslashes need escaping
+	std::string json_escape(const std::string& s)
+	{
+		std::string out;
+		for (char c : s)
+		{
+			if (c == '"' || c == '\\')
+				out.push_back('\\');
+			out.push_back(c);
+		}
+		return out;
+	}
+}
+
+Profiler::Profiler()
+{
+	epoch = clock::now();
+}
+
+Profiler::~Profiler()
+{
+	for (gpu_frame& f : gpuFrames)
+		if (!f.queries.empty())
+			glDeleteQueries(static_cast<GLsizei>(f.queries.size()), f.queries.data());
+}
+
+void Profiler::begin_frame()
+{
+	const clock::time_point now = clock::now();
+	if (frame < 0)
+	{
+		glGetInteger64v(GL_TIMESTAMP, &gpuBase);
+		gpuBaseMs = since_epoch(clock::now());
+	}
+	else
+	{
+		add_sample(find_track(FRAME_SCOPE, false), frame, since_epoch(frameStart), since_epoch(now) - since_epoch(frameStart));
+	}
+	frameStart = now;
+	frame++;
+
+	gpu_frame& f = gpuFrames[frame % GPU_LATENCY];
+	collect(f);
+	f.frame = frame;
+	gpuStack.clear();
+}
+
+void Profiler::begin_cpu(const char* name)
+{
+	cpuStack.push_back({ find_track(name, false), clock::now() });
+}
+
+void Profiler::end_cpu()
+{
+	const clock::time_point end = clock::now();
+	const open_cpu scope = cpuStack.back();
+	cpuStack.pop_back();
+	const double start = since_epoch(scope.start);
+	add_sample(scope.track, frame, start, since_epoch(end) - start);
+}
+
+void Profiler::begin_gpu(const char* name)
+{
+	gpu_frame& f = gpuFrames[std::max(frame, 0) % GPU_LATENCY];
+	gpu_range range = { find_track(name, true), next_query(f), next_query(f) };
+	glQueryCounter(range.begin, GL_TIMESTAMP);
+	gpuStack.push_back(static_cast<int>(f.ranges.size()));
+	f.ranges.push_back(range);
+}
+
+void Profiler::end_gpu()
+{
+	gpu_frame& f = gpuFrames[std::max(frame, 0) % GPU_LATENCY];
+	glQueryCounter(f.ranges[gpuStack.back()].end, GL_TIMESTAMP);
+	gpuStack.pop_back();
+}
+
+void Profiler::flush()
+{
+	// oldest frame first, samples stay in order
+	for (int i = 1; i <= GPU_LATENCY; i++)
+		collect(gpuFrames[(frame + i) % GPU_LATENCY]);
+}
+
+GLuint Profiler::next_query(gpu_frame& f)
+{
+	if (f.used == f.queries.size())
+	{
+		GLuint query;
+		glGenQueries(1, &query);
+		f.queries.push_back(query);
+	}
+	return f.queries[f.used++];
+}
+
+void Profiler::collect(gpu_frame& f)
+{
+	for (const gpu_range& range : f.ranges)
+	{
+		GLuint64 begin = 0, end = 0;
+		glGetQueryObjectui64v(range.begin, GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(range.end, GL_QUERY_RESULT, &end);
+		const double start = gpuBaseMs + (static_cast<GLint64>(begin) - gpuBase) / 1e6;
+		// results arrive a few frames late, samples keep the frame they were issued in
+		add_sample(range.track, f.frame, start, (end - begin) / 1e6);
+	}
+	f.ranges.clear();
+	f.used = 0;
+}
+
+int Profiler::find_track(const char* name, bool gpu)
+{
+	for (size_t i = 0; i < tracks.size(); i++)
+		if (tracks[i].gpu == gpu && tracks[i].name == name)
+			return static_cast<int>(i);
+
+	track t;
+	t.name = name;
+	t.gpu = gpu;
+	t.samples.reserve(HISTORY);
+	tracks.push_back(t);
+	return static_cast<int>(tracks.size() - 1);
+}
+
+void Profiler::add_sample(int index, int sampleFrame, double start, double duration)
+{
+	track& t = tracks[index];
+	const sample s = { sampleFrame, start, duration };
+	if (t.samples.size() < HISTORY)
+	{
+		t.samples.push_back(s);
+	}
+	else
+	{
+		t.samples[t.next] = s;
+		t.next = (t.next + 1) % HISTORY;
+	}
+}
+
+double Profiler::since_epoch(clock::time_point t) const
+{
+	return std::chrono::duration<double, std::milli>(t - epoch).count();
+}
+
+std::vector<std::string> Profiler::get_names(bool gpu) const
+{
+	std::vector<std::string> names;
+	for (const track& t : tracks)
+		if (t.gpu == gpu)
+			names.push_back(t.name);
+	return names;
+}
+
+bool Profiler::get_stats(const std::string& name, bool gpu, stats& out) const
+{
+	for (const track& t : tracks)
+	{
+		if (t.gpu != gpu || t.name != name || t.samples.empty())
+			continue;
+
+		std::vector<double> durations;
+		durations.reserve(t.samples.size());
+		double sum = 0;
+		for (const sample& s : t.samples)
+		{
+			durations.push_back(s.duration);
+			sum += s.duration;
+		}
+
+		const size_t n = durations.size();
+		const size_t p99 = static_cast<size_t>(std::ceil(n * 0.99)) - 1;
+		std::nth_element(durations.begin(), durations.begin() + p99, durations.end());
+		out.p99 = durations[p99];
+		out.min = *std::min_element(durations.begin(), durations.end());
+		out.avg = sum / n;
+		out.samples = static_cast<int>(n);
+		return true;
+	}
+	return false;
+}
+
+void Profiler::print_stats(std::ostream& out) const
+{
+	out << std::fixed << std::setprecision(3);
+	for (int gpu = 0; gpu < 2; gpu++)
+	{
+		for (const std::string& name : get_names(gpu != 0))
+		{
+			stats s;
+			if (!get_stats(name, gpu != 0, s))
+				continue;
+			out << (gpu ? "gpu " : "cpu ") << std::left << std::setw(24) << name << std::right
+				<< " min " << std::setw(8) << s.min
+				<< " avg " << std::setw(8) << s.avg
+				<< " p99 " << std::setw(8) << s.p99 << " ms" << std::endl;
+		}
+	}
+	out << std::defaultfloat;
+}
+
+bool Profiler::write(const std::string& path) const
+{
+	const std::string ext = ".json";
+	if (path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0)
+		return write_trace(path);
+	return write_csv(path);
+}
+
+bool Profiler::write_csv(const std::string& path) const
+{
+	FILE* f = fopen(path.c_str(), "w");
+	if (!f)
+		return false;
+
+	fprintf(f, "frame,clock,name,start_ms,duration_ms\n");
+	for (const track& t : tracks)
+		for (const sample& s : t.samples)
+			fprintf(f, "%d,%s,\"%s\",%.4f,%.4f\n", s.frame, t.gpu ? "gpu" : "cpu", t.name.c_str(), s.start, s.duration);
+	return fclose(f) == 0;
+}
+
+bool Profiler::write_trace(const std::string& path) const
+{
+	FILE* f = fopen(path.c_str(), "w");
+	if (!f)
+		return false;
+
+	// complete events in microseconds, CPU and GPU scopes on separate rows
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n");
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}");
+	for (const track& t : tracks)
+	{
+		const std::string name = json_escape(t.name);
+		for (const sample& s : t.samples)
+			fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%d}}",
+				name.c_str(), t.gpu ? "gpu" : "cpu", t.gpu ? 2 : 1, s.start * 1000, s.duration * 1000, s.frame);
+	}
+	fprintf(f, "\n]}\n");
+	return fclose(f) == 0;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Frame timing instrumentation: CPU scopes measured with steady_clock, GPU scopes with GL timestamp queries.
+// Every named scope keeps the last HISTORY samples in a ring buffer.
+// GPU results are read GPU_LATENCY frames after they were issued, when they are ready without stalling.
+// Scopes nest, begin and end calls must be balanced within a frame.
+class Profiler
+{
+public:
+	static const int HISTORY = 300; // samples kept per scope
+	static const int GPU_LATENCY = 4; // frames
+
+	// milliseconds
+	struct stats
+	{
+		double min;
+		double avg;
+		double p99;
+		int samples;
+	};
+
+	Profiler();
+	~Profiler();
+
+	Profiler(const Profiler&) = delete;
+	Profiler& operator=(const Profiler&) = delete;
+
+	// call at the start of every frame with the GL context current, the interval to the previous call is the "frame" scope
+	void begin_frame();
+
+	void begin_cpu(const char* name);
+	void end_cpu();
+	void begin_gpu(const char* name);
+	void end_gpu();
+
+	// waits for all issued GPU queries, call before reading results of the last frames
+	void flush();
+
+	// scopes in order of first use
+	std::vector<std::string> get_names(bool gpu) const;
+	bool get_stats(const std::string& name, bool gpu, stats& out) const;
+	void print_stats(std::ostream& out) const;
+
+	// by extension: .json - Chrome trace (chrome://tracing, Perfetto), anything else - CSV of all samples
+	bool write(const std::string& path) const;
+	bool write_csv(const std::string& path) const;
+	bool write_trace(const std::string& path) const;
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	struct sample
+	{
+		int frame;
+		double start; // ms since the profiler was created
+		double duration; // ms
+	};
+
+	struct track
+	{
+		std::string name;
+		bool gpu;
+		std::vector<sample> samples; // ring, next is the oldest once full
+		size_t next = 0;
+	};
+
+	struct gpu_range
+	{
+		int track;
+		GLuint begin;
+		GLuint end;
+	};
+
+	// queries issued during one frame, slots are reused every GPU_LATENCY frames
+	struct gpu_frame
+	{
+		int frame = -1;
+		std::vector<gpu_range> ranges;
+		std::vector<GLuint> queries;
+		size_t used = 0;
+	};
+
+	struct open_cpu
+	{
+		int track;
+		clock::time_point start;
+	};
+
+	clock::time_point epoch;
+	clock::time_point frameStart;
+	int frame = -1;
+	std::vector<track> tracks;
+	std::vector<open_cpu> cpuStack;
+	std::vector<int> gpuStack; // indices into the current frame ranges
+	gpu_frame gpuFrames[GPU_LATENCY];
+
+	// GPU timestamps are mapped onto the CPU timeline through one reference point
+	GLint64 gpuBase = 0;
+	double gpuBaseMs = 0;
+
+	int find_track(const char* name, bool gpu);
+	void add_sample(int track, int sampleFrame, double start, double duration);
+	GLuint next_query(gpu_frame& f);
+	void collect(gpu_frame& f);
+	double since_epoch(clock::time_point t) const;
+};
+
+// scope guards, a null profiler disables them
+class cpu_scope
+{
+public:
+	cpu_scope(Profiler* profiler, const char* name) : profiler(profiler)
+	{
+		if (profiler)
+			profiler->begin_cpu(name);
+	}
+	~cpu_scope()
+	{
+		if (profiler)
+			profiler->end_cpu();
+	}
+	cpu_scope(const cpu_scope&) = delete;
+	cpu_scope& operator=(const cpu_scope&) = delete;
+
+private:
+	Profiler* profiler;
+};
+
+class gpu_scope
+{
+public:
+	gpu_scope(Profiler* profiler, const char* name) : profiler(profiler)
+	{
+		if (profiler)
+			profiler->begin_gpu(name);
+	}
+	~gpu_scope()
+	{
+		if (profiler)
+			profiler->end_gpu();
+	}
+	gpu_scope(const gpu_scope&) = delete;
+	gpu_scope& operator=(const gpu_scope&) = delete;
+
+private:
+	Profiler* profiler;
+};
@@ -0,0 +1,148 @@
+#include "ProgramCache.h"
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+std::string ProgramCache::directory = "shader_cache";
+
+namespace
+{
+	const uint32_t FILE_MAGIC = 0x42505452; // "RTPB"
+
+	struct file_header
+	{
+		uint32_t magic;
+		uint32_t format;
+		uint32_t length;
+	};
+
+	// 64-bit FNV-1a
+	uint64_t hash(uint64_t h, const char* str)
+	{
+		for (; str && *str; str++)
+		{
+			h ^= static_cast<unsigned char>(*str);
+			h *= 1099511628211ull;
+		}
+		// separator, so "ab" + "c" and "a" + "bc" differ
+		h ^= 0xff;
+		h *= 1099511628211ull;
+		return h;
+	}
+
+	void make_dir(const std::string& path)
+	{
+#ifdef _WIN32
+		_mkdir(path.c_str());
+#else
+		mkdir(path.c_str(), 0755);
+#endif
+	}
+}
+
+void ProgramCache::set_directory(const std::string& path)
+{
+	directory = path;
+}
+
+bool ProgramCache::available()
+{
+	if (directory.empty() || !GLAD_GL_VERSION_4_1)
+		return false;
+
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+std::string ProgramCache::key(const char* vertexSrc, const char* fragmentSrc)
+{
+	uint64_t h = 14695981039346656037ull;
+	h = hash(h, reinterpret_cast<const char*>(glGetString(GL_VENDOR)));
+	h = hash(h, reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+	h = hash(h, reinterpret_cast<const char*>(glGetString(GL_VERSION)));
+	h = hash(h, vertexSrc);
+	h = hash(h, fragmentSrc);
+
+	char buff[17];
+	snprintf(buff, sizeof(buff), "%016llx", static_cast<unsigned long long>(h));
+	return buff;
+}
+
+std::string ProgramCache::path(const std::string& key)
+{
+	return directory + "/" + key + ".bin";
+}
+
+bool ProgramCache::load(const std::string& key, GLuint program)
+{
+	if (!available())
+		return false;
+
+	FILE* file = fopen(path(key).c_str(), "rb");
+	if (!file)
+		return false;
+
+	file_header header;
+	std::vector<char> binary;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == FILE_MAGIC;
+	if (ok)
+	{
+		binary.resize(header.length);
+		ok = header.length > 0 && fread(binary.data(), 1, binary.size(), file) == binary.size();
+	}
+	fclose(file);
+	if (!ok)
+		return false;
+
+	glProgramBinary(program, header.format, binary.data(), static_cast<GLsizei>(binary.size()));
+	GLint linked = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	// a rejected binary leaves an error behind, the caller compiles from source and overwrites the entry
+	while (glGetError() != GL_NO_ERROR) {}
+	return linked == GL_TRUE;
+}
+
+void ProgramCache::prepare(GLuint program)
+{
+	if (available())
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+void ProgramCache::save(const std::string& key, GLuint program)
+{
+	if (!available())
+		return;
+
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, &length, &format, binary.data());
+
+	make_dir(directory);
+	// write to a temporary file first, a second instance must never read a half written entry
+	const std::string target = path(key);
+	const std::string temp = target + ".tmp";
+	FILE* file = fopen(temp.c_str(), "wb");
+	if (!file)
+	{
+		fprintf(stderr, "Failed to write program cache %s\n", temp.c_str());
+		return;
+	}
+
+	const file_header header = { FILE_MAGIC, format, static_cast<uint32_t>(length) };
+	const bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(binary.data(), 1, length, file) == static_cast<size_t>(length);
+	fclose(file);
+	remove(target.c_str());
+	if (!ok || rename(temp.c_str(), target.c_str()) != 0)
+		remove(temp.c_str());
+}
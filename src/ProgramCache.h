@@ -0,0 +1,28 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <string>
+
+// Disk cache of linked program binaries (glGetProgramBinary / glProgramBinary).
+// Entries are keyed by a hash of the final shader sources and the driver strings,
+// a driver update or any change to the generated source simply misses the cache.
+// Needs a GL 4.1 context or newer, otherwise every call is a no-op and programs are compiled as before.
+class ProgramCache
+{
+public:
+	// directory for cache files, created on first save, empty string disables the cache
+	static void set_directory(const std::string& path);
+
+	static std::string key(const char* vertexSrc, const char* fragmentSrc);
+	// loads a cached binary into program, returns false if there is none or the driver rejected it
+	static bool load(const std::string& key, GLuint program);
+	// must be called before glLinkProgram so the driver keeps the binary around
+	static void prepare(GLuint program);
+	static void save(const std::string& key, GLuint program);
+
+private:
+	static std::string directory;
+
+	static bool available();
+	static std::string path(const std::string& key);
+};
@@ -0,0 +1,45 @@
+#include "SceneAssets.h"
+
+const std::vector<texture_binding>& scene_textures()
+{
+	static const std::vector<texture_binding> textures =
+	{
+		{ 1, "8k_jupiter.jpg", glm::vec4(0.65f, 0.63f, 0.58f, 1), true },
+		{ 2, "8k_saturn.jpg", glm::vec4(0.81f, 0.75f, 0.64f, 1), true },
+		{ 3, "2k_mars.jpg", glm::vec4(0.72f, 0.39f, 0.28f, 1), false },
+		{ 4, "8k_saturn_ring_alpha.png", glm::vec4(0.36f, 0.34f, 0.37f, 0.6f), false },
+		{ 5, "container.png", glm::vec4(0.32f, 0.23f, 0.15f, 1), false },
+	};
+	return textures;
+}
+
+std::vector<std::string> skybox_faces()
+{
+	return
+	{
+		ASSETS_DIR "/textures/sb_nebula/GalaxyTex_PositiveX.jpg",
+		ASSETS_DIR "/textures/sb_nebula/GalaxyTex_NegativeX.jpg",
+		ASSETS_DIR "/textures/sb_nebula/GalaxyTex_PositiveY.jpg",
+		ASSETS_DIR "/textures/sb_nebula/GalaxyTex_NegativeY.jpg",
+		ASSETS_DIR "/textures/sb_nebula/GalaxyTex_PositiveZ.jpg",
+		ASSETS_DIR "/textures/sb_nebula/GalaxyTex_NegativeZ.jpg"
+	};
+}
+
+GLuint load_textures(GLWrapper& glWrapper)
+{
+	std::vector<std::string> names;
+	std::vector<glm::vec4> placeholders;
+	for (const texture_binding& binding : scene_textures())
+	{
+		if (static_cast<int>(names.size()) < binding.texNum)
+		{
+			names.resize(binding.texNum);
+			placeholders.resize(binding.texNum, glm::vec4(0.5f, 0.5f, 0.5f, 1));
+		}
+		placeholders[binding.texNum - 1] = binding.placeholder;
+		if (!binding.streamed || !glWrapper.load_virtual_texture(binding.texNum, binding.name, binding.placeholder))
+			names[binding.texNum - 1] = binding.name;
+	}
+	return glWrapper.load_texture_array(names, placeholders);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "GLWrapper.h"
+
+// Textures and skybox of the demo scene, shared by the interactive, headless and benchmark executables.
+struct texture_binding
+{
+	int texNum;
+	const char* name;
+	glm::vec4 placeholder; // average color, shown while the texture loads
+	bool streamed; // planet map, a virtual texture when virtual texturing is on
+};
+
+// objects refer to a texture by textureNum = texNum, it is layer texNum - 1 of the texture array
+// unless it is streamed, the layer keeps the placeholder then
+const std::vector<texture_binding>& scene_textures();
+std::vector<std::string> skybox_faces();
+
+GLuint load_textures(GLWrapper& glWrapper);
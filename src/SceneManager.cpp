@@ -1,4 +1,7 @@
 #include "SceneManager.h"
+#include <algorithm>
+#include <cstring>
+#include "Profiler.h"
 #include <GLFW/glfw3.h>
 #include <glm/common.hpp>
 
@@ -14,6 +17,15 @@ SceneManager::SceneManager(int wind_width, int wind_height, scene_container* sce
 }
 
 void SceneManager::init()
+{
+	// offscreen rendering has no window to take input from, the camera stays where the scene put it
+	if (!wrapper->is_offscreen())
+		init_input();
+
+	init_buffers();
+}
+
+void SceneManager::init_input()
 {
 	glfwSetWindowUserPointer(wrapper->window, this);
 
@@ -30,8 +42,6 @@ void SceneManager::init()
 	glfwSetCursorPosCallback(wrapper->window, mouseFunc);
 	glfwSetKeyCallback(wrapper->window, keyFunc);
 	glfwSetFramebufferSizeCallback(wrapper->window, glfw_framebuffer_size_callback);
-
-	init_buffers();
 }
 
 void SceneManager::update(float deltaTime)
@@ -40,6 +50,18 @@ void SceneManager::update(float deltaTime)
 	update_buffers();
 }
 
+bool SceneManager::is_paused() const
+{
+	return paused;
+}
+
+void SceneManager::set_camera(glm::vec3 position, float yaw, float pitch)
+{
+	this->position = position;
+	this->yaw = yaw;
+	this->pitch = pitch;
+}
+
 void SceneManager::update_scene(float deltaTime)
 {
 	front.x = sin(glm::radians(yaw)) * cos(glm::radians(pitch));
@@ -97,6 +119,8 @@ void SceneManager::glfw_key_callback(GLFWwindow* window, int key, int scancode,
 			shift_pressed = pressed;
 		else if (key == GLFW_KEY_LEFT_ALT)
 			alt_pressed = pressed;
+		else if (key == GLFW_KEY_P && pressed)
+			paused = !paused;
 	}
 }
 
@@ -150,7 +174,7 @@ rt_material SceneManager::create_material(glm::vec3 color, int specular, float r
 	return material;
 }
 
-rt_sphere SceneManager::create_sphere(glm::vec3 center, float radius, rt_material material, bool hollow)
+rt_sphere SceneManager::create_sphere(glm::vec3 center, float radius, int material, bool hollow)
 {
 	rt_sphere sphere = {};
 	sphere.obj = glm::vec4(center, radius);
@@ -160,7 +184,7 @@ rt_sphere SceneManager::create_sphere(glm::vec3 center, float radius, rt_materia
 	return sphere;
 }
 
-rt_plane SceneManager::create_plane(glm::vec3 normal, glm::vec3 pos, rt_material material)
+rt_plane SceneManager::create_plane(glm::vec3 normal, glm::vec3 pos, int material)
 {
 	rt_plane plane = {};
 	plane.normal = normal;
@@ -169,34 +193,60 @@ rt_plane SceneManager::create_plane(glm::vec3 normal, glm::vec3 pos, rt_material
 	return plane;
 }
 
-rt_box SceneManager::create_box(glm::vec3 pos, glm::vec3 form, rt_material material)
+rt_box SceneManager::create_box(glm::vec3 pos, glm::vec3 form, int material)
 {
 	rt_box box = {};
 	box.form = form;
 	box.pos = pos;
-	box.mat = material;
+	box.material = material;
 	return box;
 }
 
-rt_torus SceneManager::create_torus(glm::vec3 pos, glm::vec2 form, rt_material material)
+rt_torus SceneManager::create_torus(glm::vec3 pos, glm::vec2 form, int material)
 {
 	rt_torus torus = {};
 	torus.form = form;
 	torus.pos = pos;
-	torus.mat = material;
+	torus.material = material;
 	return torus;
 }
 
-rt_ring SceneManager::create_ring(glm::vec3 pos, float r1, float r2, rt_material material)
+rt_ring SceneManager::create_ring(glm::vec3 pos, float r1, float r2, int material)
 {
 	rt_ring ring = {};
 	ring.pos = pos;
-	ring.mat = material;
+	ring.material = material;
 	ring.r1 = r1 * r1;
 	ring.r2 = r2 * r2;
 	return ring;
 }
 
+rt_prototype SceneManager::create_prototype(rt_prototype_type type, glm::vec4 form, int textureNum)
+{
+	rt_prototype prototype = {};
+	prototype.type = type;
+	prototype.form = form;
+	prototype.textureNum = textureNum;
+	switch (type)
+	{
+		case PROTOTYPE_SPHERE: prototype.radius = form.x; break;
+		case PROTOTYPE_BOX: prototype.radius = glm::length(glm::vec3(form)); break;
+		case PROTOTYPE_TORUS: prototype.radius = form.x + form.y; break;
+	}
+	return prototype;
+}
+
+rt_instance SceneManager::create_instance(int prototype, int material, glm::vec3 pos, glm::quat rotation, float scale)
+{
+	rt_instance instance = {};
+	instance.prototype = prototype;
+	instance.material = material;
+	instance.pos = pos;
+	instance.quat_rotation = rotation;
+	instance.scale = scale;
+	return instance;
+}
+
 rt_light_point SceneManager::create_light_point(glm::vec4 position, glm::vec3 color, float intensity, float linear_k,
 	float quadratic_k)
 {
@@ -235,44 +285,241 @@ rt_scene SceneManager::create_scene(int width, int height)
 	return scene;
 }
 
-template<typename T>
-void SceneManager::init_buffer(GLuint* ubo, const char* name, int bindingPoint, std::vector<T>& v)
-{
-	wrapper->init_buffer(ubo, name, bindingPoint, sizeof(T) * v.size(), v.data());
-}
+// rt.frag reads every struct as whole vec4 texels, strides are the *_TEXELS defines there
+static_assert(sizeof(rt_material) == 4 * sizeof(glm::vec4), "rt_material layout differs from rt.frag");
+static_assert(sizeof(rt_sphere) == 3 * sizeof(glm::vec4), "rt_sphere layout differs from rt.frag");
+static_assert(sizeof(rt_plane) == 2 * sizeof(glm::vec4), "rt_plane layout differs from rt.frag");
+static_assert(sizeof(rt_surface) == 6 * sizeof(glm::vec4), "rt_surface layout differs from rt.frag");
+static_assert(sizeof(rt_box) == 3 * sizeof(glm::vec4), "rt_box layout differs from rt.frag");
+static_assert(sizeof(rt_torus) == 3 * sizeof(glm::vec4), "rt_torus layout differs from rt.frag");
+static_assert(sizeof(rt_ring) == 3 * sizeof(glm::vec4), "rt_ring layout differs from rt.frag");
+static_assert(sizeof(rt_prototype) == 2 * sizeof(glm::vec4), "rt_prototype layout differs from rt.frag");
+static_assert(sizeof(rt_instance) == 3 * sizeof(glm::vec4), "rt_instance layout differs from rt.frag");
+static_assert(sizeof(rt_light_point) == 3 * sizeof(glm::vec4), "rt_light_point layout differs from rt.frag");
+static_assert(sizeof(rt_light_direct) == 2 * sizeof(glm::vec4), "rt_light_direct layout differs from rt.frag");
 
 void SceneManager::init_buffers()
 {
 	wrapper->init_buffer(&sceneUbo, "scene_buf", 0, sizeof(rt_scene), nullptr);
-	init_buffer(&sphereUbo, "spheres_buf", 1, scene->spheres);
-	init_buffer(&planeUbo, "planes_buf", 2, scene->planes);
-	init_buffer(&surfaceUbo, "surfaces_buf", 3, scene->surfaces);
-	init_buffer(&boxUbo, "boxes_buf", 4, scene->boxes);
-	init_buffer(&torusUbo, "toruses_buf", 5, scene->toruses);
-	init_buffer(&ringUbo, "rings_buf", 6, scene->rings);
-	init_buffer(&lightPointUbo, "lights_point_buf", 7, scene->lights_point);
-	init_buffer(&lightDirectUbo, "lights_direct_buf", 8, scene->lights_direct);
+	init_scene_data();
+	init_bvh();
+}
+
+namespace
+{
+	const size_t MIN_CAPACITY = 8; // elements per array
+
+	// room for the array to double before the buffer is reallocated
+	size_t capacity_for(size_t count)
+	{
+		return std::max(count * 2, MIN_CAPACITY);
+	}
 }
 
 template<typename T>
-void SceneManager::update_buffer(GLuint ubo, std::vector<T>& v) const
+SceneManager::scene_array SceneManager::make_array(const char* name, const std::vector<T>& v)
+{
+	return { name, v.data(), v.size(), sizeof(T) };
+}
+
+// Primitive and light arrays share one RGBA32F texture buffer, back to back in the order below.
+// Its size is limited by GL_MAX_TEXTURE_BUFFER_SIZE (in texels) instead of the uniform block size,
+// element counts and offsets are plain uniforms so the shader does not depend on scene size.
+std::array<SceneManager::scene_array, SceneManager::SCENE_ARRAYS> SceneManager::scene_arrays() const
+{
+	return { {
+		make_array("sphere", scene->spheres),
+		make_array("plane", scene->planes),
+		make_array("surface", uploadedSurfaces),
+		make_array("box", scene->boxes),
+		make_array("torus", scene->toruses),
+		make_array("ring", scene->rings),
+		make_array("prototype", scene->prototypes),
+		make_array("material", scene->materials),
+		make_array("instance", scene->instances),
+		make_array("light_point", scene->lights_point),
+		make_array("light_direct", scene->lights_direct)
+	} };
+}
+
+void SceneManager::init_scene_data()
 {
-	if (!v.empty())
+	fit_surfaces();
+	const auto arrays = scene_arrays();
+	for (int i = 0; i < SCENE_ARRAYS; i++)
+		sceneDataCapacity[i] = capacity_for(arrays[i].count);
+	layout_scene_data(arrays);
+	wrapper->init_texture_buffer(&sceneDataBuffer, &sceneDataTex, "scene_data", SCENE_DATA_TEX_UNIT, GL_RGBA32F, sceneDataSize, nullptr);
+	update_scene_data();
+}
+
+// Objects can be added to or removed from scene_container at any time, the program is only relinked for an object
+// kind or material feature it was built without.
+// Every array has room for more elements than it holds, so a changed count is one uniform update.
+// Only when an array outgrows its capacity the storage is reallocated and the offsets move.
+// Otherwise only the elements that changed since the previous frame are uploaded, untouched arrays cost a memcmp.
+bool SceneManager::update_scene_data()
+{
+	fit_surfaces();
+	const auto arrays = scene_arrays();
+
+	bool grown = false;
+	for (int i = 0; i < SCENE_ARRAYS; i++)
 	{
-		wrapper->update_buffer(ubo, sizeof(T) * v.size(), v.data());
+		if (arrays[i].count > sceneDataCapacity[i])
+		{
+			sceneDataCapacity[i] = capacity_for(arrays[i].count);
+			grown = true;
+		}
 	}
+	if (grown)
+	{
+		layout_scene_data(arrays);
+		GLWrapper::update_texture_buffer(sceneDataBuffer, sceneDataSize, nullptr);
+	}
+
+	// a new object kind, the first texture or the first reflective material needs code the shader was built without,
+	// the relinked shader gets the uniforms set so far and the counts below
+	bool countsChanged = false;
+	const unsigned features = scene->get_features();
+	if (features & ~wrapper->getFeatures())
+	{
+		wrapper->add_features(features);
+		countsChanged = true;
+	}
+	for (int i = 0; i < SCENE_ARRAYS; i++)
+	{
+		if (arrays[i].count != sceneDataCounts[i])
+		{
+			countsChanged = true;
+			sceneDataCounts[i] = arrays[i].count;
+			wrapper->set_int((std::string(arrays[i].name) + "_count").c_str(), static_cast<int>(arrays[i].count));
+		}
+	}
+
+	sceneDataWrites.clear();
+	size_t dirty = 0;
+	for (int i = 0; i < SCENE_ARRAYS; i++)
+	{
+		const unsigned char* data = static_cast<const unsigned char*>(arrays[i].data);
+		for (const byte_range& r : sceneDataTrackers[i].update(data, arrays[i].count, arrays[i].stride))
+			sceneDataWrites.push_back({ sceneDataOffsets[i] + r.begin, r.end - r.begin, data + r.begin });
+		dirty += sceneDataTrackers[i].get_dirty_bytes();
+	}
+	if (dirty == 0)
+		return grown || countsChanged;
+
+	// when most of the buffer changed it is orphaned and rewritten,
+	// so the driver does not wait for the previous frame to stop reading it
+	if (dirty * 2 > sceneDataSize)
+	{
+		GLWrapper::update_texture_buffer(sceneDataBuffer, sceneDataSize, nullptr);
+		for (int i = 0; i < SCENE_ARRAYS; i++)
+		{
+			if (arrays[i].count > 0)
+				GLWrapper::update_texture_buffer(sceneDataBuffer, sceneDataOffsets[i], arrays[i].count * arrays[i].stride, arrays[i].data);
+		}
+		return true;
+	}
+	for (const buffer_write& w : sceneDataWrites)
+		GLWrapper::update_texture_buffer(sceneDataBuffer, w.offset, w.size, w.data);
+	return true;
+}
+
+void SceneManager::fit_surfaces()
+{
+	// only surfaces that changed since the last frame are copied and refitted, ranges cover whole elements
+	const size_t stride = sizeof(rt_surface);
+	uploadedSurfaces.resize(scene->surfaces.size());
+	for (const byte_range& r : surfacesTracker.update(scene->surfaces.data(), scene->surfaces.size(), stride))
+	{
+		for (size_t i = r.begin / stride; i < r.end / stride; i++)
+		{
+			uploadedSurfaces[i] = scene->surfaces[i];
+			Bvh::fit_clip_box(uploadedSurfaces[i]);
+		}
+	}
+}
+
+void SceneManager::layout_scene_data(const std::array<scene_array, SCENE_ARRAYS>& arrays)
+{
+	size_t offset = 0;
+	for (int i = 0; i < SCENE_ARRAYS; i++)
+	{
+		sceneDataOffsets[i] = offset;
+		wrapper->set_int((std::string(arrays[i].name) + "_offset").c_str(), static_cast<int>(offset / sizeof(glm::vec4)));
+		offset += sceneDataCapacity[i] * arrays[i].stride;
+		sceneDataTrackers[i].invalidate();
+	}
+	sceneDataSize = offset;
+}
+
+void SceneManager::init_bvh()
+{
+	bvh.build(*scene);
+	const auto& nodes = bvh.get_nodes();
+	const auto& prims = bvh.get_prims();
+	wrapper->init_texture_buffer(&bvhNodesBuffer, &bvhNodesTex, "bvh_nodes", BVH_NODES_TEX_UNIT, GL_RGBA32UI,
+		sizeof(rt_bvh_node) * nodes.size(), nodes.data());
+	wrapper->init_texture_buffer(&bvhPrimsBuffer, &bvhPrimsTex, "bvh_prims", BVH_PRIMS_TEX_UNIT, GL_R32UI,
+		sizeof(uint32_t) * prims.size(), prims.data());
+	wrapper->set_int("bvh_size", static_cast<int>(nodes.size()));
+	wrapper->set_int("bvh_unbounded", bvh.get_unbounded_count());
+	bvhNodesTracker.update(nodes.data(), nodes.size(), sizeof(rt_bvh_node));
+}
+
+void SceneManager::update_bvh()
+{
+	const auto& nodes = bvh.get_nodes();
+	if (bvh.update(*scene))
+	{
+		const auto& prims = bvh.get_prims();
+		GLWrapper::update_texture_buffer(bvhPrimsBuffer, sizeof(uint32_t) * prims.size(), prims.data());
+		wrapper->set_int("bvh_size", static_cast<int>(nodes.size()));
+		wrapper->set_int("bvh_unbounded", bvh.get_unbounded_count());
+		bvhNodesTracker.invalidate();
+	}
+
+	// a refit only touches the ancestors of moved objects
+	const size_t size = sizeof(rt_bvh_node) * nodes.size();
+	const auto& ranges = bvhNodesTracker.update(nodes.data(), nodes.size(), sizeof(rt_bvh_node));
+	if (bvhNodesTracker.get_dirty_bytes() * 2 > size)
+	{
+		GLWrapper::update_texture_buffer(bvhNodesBuffer, size, nodes.data());
+		return;
+	}
+	const unsigned char* data = reinterpret_cast<const unsigned char*>(nodes.data());
+	for (const byte_range& r : ranges)
+		GLWrapper::update_texture_buffer(bvhNodesBuffer, r.begin, r.end - r.begin, data + r.begin);
 }
 
-void SceneManager::update_buffers() const
+void SceneManager::update_buffers()
 {
-	wrapper->update_buffer(sceneUbo, sizeof(rt_scene), &scene->scene);
-	update_buffer(sphereUbo, scene->spheres);
-	update_buffer(planeUbo, scene->planes);
-	update_buffer(surfaceUbo, scene->surfaces);
-	update_buffer(boxUbo, scene->boxes);
-	update_buffer(torusUbo, scene->toruses);
-	update_buffer(ringUbo, scene->rings);
-	update_buffer(lightPointUbo, scene->lights_point);
+	Profiler* profiler = wrapper->getProfiler();
+	bool changed = false;
+	{
+		// camera and canvas, unchanged most frames while the view stands still
+		cpu_scope scope(profiler, "upload scene");
+		if (memcmp(&uploadedScene, &scene->scene, sizeof(rt_scene)) != 0)
+		{
+			uploadedScene = scene->scene;
+			wrapper->update_buffer(sceneUbo, sizeof(rt_scene), &uploadedScene);
+			changed = true;
+		}
+		wrapper->set_camera(uploadedScene.quat_camera_rotation, uploadedScene.camera_pos);
+	}
+	{
+		cpu_scope scope(profiler, "upload scene data");
+		changed |= update_scene_data();
+	}
+	{
+		cpu_scope scope(profiler, "update bvh");
+		update_bvh();
+	}
+
+	// the bvh follows the objects, they are already covered
+	if (changed)
+		wrapper->reset_accumulation();
 }
 
 glm::vec3 SceneManager::get_color(float r, float g, float b)
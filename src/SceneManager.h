@@ -2,9 +2,14 @@
 
 #include "GLWrapper.h"
 #include "scene.h"
+#include "Bvh.h"
+#include "DirtyTracker.h"
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
+#include <array>
+#include <string>
+#include <vector>
 
 class SceneManager
 {
@@ -13,13 +18,22 @@ public:
 
 	void init();
 	void update(float frameRate);
+	// P toggles it, the caller stops animating objects so accumulated samples can converge
+	bool is_paused() const;
+	// places the camera for scripted playback, angles in degrees as the mouse controls use them
+	void set_camera(glm::vec3 position, float yaw, float pitch);
 
 	static rt_material create_material(glm::vec3 color, int specular, float reflect, float refract = 0.0, glm::vec3 absorb = {}, float diffuse = 0.7, float kd = 0.8, float ks = 0.2);
-	static rt_sphere create_sphere(glm::vec3 center, float radius, rt_material material, bool hollow = false);
-	static rt_plane create_plane(glm::vec3 normal, glm::vec3 pos, rt_material material);
-	static rt_box create_box(glm::vec3 pos, glm::vec3 form, rt_material material);
-	static rt_torus create_torus(glm::vec3 pos, glm::vec2 form, rt_material material);
-	static rt_ring create_ring(glm::vec3 pos, float r1, float r2, rt_material material);
+	// material is an index in scene_container::materials, see scene_container::add_material
+	static rt_sphere create_sphere(glm::vec3 center, float radius, int material, bool hollow = false);
+	static rt_plane create_plane(glm::vec3 normal, glm::vec3 pos, int material);
+	static rt_box create_box(glm::vec3 pos, glm::vec3 form, int material);
+	static rt_torus create_torus(glm::vec3 pos, glm::vec2 form, int material);
+	static rt_ring create_ring(glm::vec3 pos, float r1, float r2, int material);
+	// shared shape for instances, form as in rt_prototype
+	static rt_prototype create_prototype(rt_prototype_type type, glm::vec4 form, int textureNum = 0);
+	// prototype is an index in scene_container::prototypes
+	static rt_instance create_instance(int prototype, int material, glm::vec3 pos, glm::quat rotation = glm::quat(1, 0, 0, 0), float scale = 1);
 	static rt_light_point create_light_point(glm::vec4 position, glm::vec3 color, float intensity, float linear_k = 0.22f, float quadratic_k = 0.2f);
 	static rt_light_direct create_light_direct(glm::vec3 direction, glm::vec3 color, float intensity);
 	static rt_scene create_scene(int width, int height);
@@ -39,6 +53,7 @@ private:
 	bool shift_pressed = false;
 	bool space_pressed = false;
 	bool alt_pressed = false;
+	bool paused = false;
 
 	float lastX = 0;
 	float lastY = 0;
@@ -53,25 +68,67 @@ private:
 	float pitch = 0;
 
 	GLuint sceneUbo = 0;
-	GLuint sphereUbo = 0;
-	GLuint planeUbo = 0;
-	GLuint surfaceUbo = 0;
-	GLuint boxUbo = 0;
-	GLuint torusUbo = 0;
-	GLuint ringUbo = 0;
-	GLuint lightPointUbo = 0;
-	GLuint lightDirectUbo = 0;
+	rt_scene uploadedScene = {}; // last scene block sent to the GPU
 
+	static const int BVH_NODES_TEX_UNIT = 8;
+	static const int BVH_PRIMS_TEX_UNIT = 9;
+
+	Bvh bvh;
+	GLuint bvhNodesBuffer = 0;
+	GLuint bvhNodesTex = 0;
+	GLuint bvhPrimsBuffer = 0;
+	GLuint bvhPrimsTex = 0;
+	DirtyTracker bvhNodesTracker;
+
+	static const int SCENE_DATA_TEX_UNIT = 10;
+
+	GLuint sceneDataBuffer = 0;
+	GLuint sceneDataTex = 0;
+	// element array in the scene data buffer, name is the prefix of its uniforms
+	struct scene_array
+	{
+		const char* name;
+		const void* data;
+		size_t count;
+		size_t stride;
+	};
+
+	static const int SCENE_ARRAYS = 11;
+
+	size_t sceneDataSize = 0;
+	// per array, same order as scene_arrays()
+	size_t sceneDataCapacity[SCENE_ARRAYS] = {};
+	size_t sceneDataCounts[SCENE_ARRAYS] = {}; // counts the shader was told about
+	size_t sceneDataOffsets[SCENE_ARRAYS] = {}; // in bytes
+	DirtyTracker sceneDataTrackers[SCENE_ARRAYS];
+
+	struct buffer_write
+	{
+		size_t offset;
+		size_t size;
+		const void* data;
+	};
+	std::vector<buffer_write> sceneDataWrites;
+	// scene surfaces with their clip boxes fitted by Bvh::fit_clip_box, uploaded in place of the originals
+	std::vector<rt_surface> uploadedSurfaces;
+	DirtyTracker surfacesTracker; // of scene->surfaces, picks the ones fit_surfaces refits
+
+	void init_input();
 	void update_scene(float deltaTime);
 	void glfw_key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
 	static void glfw_framebuffer_size_callback(GLFWwindow* wind, int width, int height);
 	void glfw_mouse_callback(GLFWwindow* window, double xpos, double ypos);
 	void init_buffers();
-	void update_buffers() const;
-	glm::vec3 get_color(float r, float g, float b);
-
+	void update_buffers();
+	void init_scene_data();
+	// returns true if anything the shader reads changed
+	bool update_scene_data();
+	void fit_surfaces();
 	template<typename T>
-	void init_buffer(GLuint* ubo, const char* name, int bindingPoint, std::vector<T>& v);
-	template<typename T>
-	void update_buffer(GLuint ubo, std::vector<T>& v) const;
+	static scene_array make_array(const char* name, const std::vector<T>& v);
+	std::array<scene_array, SCENE_ARRAYS> scene_arrays() const;
+	void layout_scene_data(const std::array<scene_array, SCENE_ARRAYS>& arrays);
+	void init_bvh();
+	void update_bvh();
+	glm::vec3 get_color(float r, float g, float b);
 };
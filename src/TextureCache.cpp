@@ -0,0 +1,305 @@
+#include "TextureCache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// GL_EXT_texture_compression_s3tc, not part of core
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+
+std::string TextureCache::directory = "texture_cache";
+
+namespace
+{
+	const uint32_t FILE_MAGIC = 0x43545452; // "RTTC"
+
+	struct file_header
+	{
+		uint32_t magic;
+		uint32_t format;
+		uint32_t width;
+		uint32_t height;
+		uint32_t levels;
+	};
+
+	// 64-bit FNV-1a
+	uint64_t hash(uint64_t h, const std::string& str)
+	{
+		for (char c : str)
+		{
+			h ^= static_cast<unsigned char>(c);
+			h *= 1099511628211ull;
+		}
+		h ^= 0xff;
+		h *= 1099511628211ull;
+		return h;
+	}
+
+	void make_dir(const std::string& path)
+	{
+#ifdef _WIN32
+		_mkdir(path.c_str());
+#else
+		mkdir(path.c_str(), 0755);
+#endif
+	}
+}
+
+TextureCache::entry::~entry()
+{
+#ifdef _WIN32
+	if (base)
+		UnmapViewOfFile(base);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file)
+		CloseHandle(file);
+#else
+	if (base)
+		munmap(base, length);
+#endif
+}
+
+void TextureCache::set_directory(const std::string& path)
+{
+	directory = path;
+}
+
+bool TextureCache::is_enabled()
+{
+	return !directory.empty();
+}
+
+bool TextureCache::has_extension(const char* name)
+{
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; i++)
+	{
+		if (strcmp(reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i)), name) == 0)
+			return true;
+	}
+	return false;
+}
+
+GLenum TextureCache::format(bool alpha)
+{
+	if (directory.empty())
+		return 0;
+
+	// S3TC compresses fastest, BPTC is core since 4.2
+	static const bool s3tc = has_extension("GL_EXT_texture_compression_s3tc");
+	static const bool bptc = GLAD_GL_VERSION_4_2 || has_extension("GL_ARB_texture_compression_bptc");
+	if (s3tc)
+		return alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	if (bptc)
+		return GL_COMPRESSED_RGBA_BPTC_UNORM;
+	return GL_RGBA8;
+}
+
+bool TextureCache::is_compressed(GLenum format)
+{
+	return format != GL_RGBA8;
+}
+
+size_t TextureCache::level_size(GLenum format, int width, int height)
+{
+	if (!is_compressed(format))
+		return static_cast<size_t>(width) * height * 4;
+	// 4x4 blocks, 8 bytes for BC1, 16 for BC3 and BC7
+	const size_t blocks = static_cast<size_t>((width + 3) / 4) * ((height + 3) / 4);
+	return blocks * (format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16);
+}
+
+int TextureCache::level_count(int width, int height)
+{
+	int levels = 1;
+	for (int size = width > height ? width : height; size > 1; size /= 2)
+		levels++;
+	return levels;
+}
+
+std::string TextureCache::key(const std::string& imagePath, int width, int height, int levels, GLenum format)
+{
+	struct stat info = {};
+	stat(imagePath.c_str(), &info);
+
+	uint64_t h = 14695981039346656037ull;
+	h = hash(h, imagePath);
+	h = hash(h, std::to_string(static_cast<long long>(info.st_size)));
+	h = hash(h, std::to_string(static_cast<long long>(info.st_mtime)));
+	h = hash(h, std::to_string(width) + "x" + std::to_string(height) + "x" + std::to_string(levels));
+	h = hash(h, std::to_string(format));
+
+	char buff[17];
+	snprintf(buff, sizeof(buff), "%016llx", static_cast<unsigned long long>(h));
+	return buff;
+}
+
+std::string TextureCache::path(const std::string& key, const char* extension)
+{
+	return directory + "/" + key + extension;
+}
+
+std::unique_ptr<TextureCache::entry> TextureCache::map(const std::string& file, size_t headerSize)
+{
+	std::unique_ptr<entry> e(new entry());
+#ifdef _WIN32
+	e->file = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (e->file == INVALID_HANDLE_VALUE)
+	{
+		e->file = nullptr;
+		return nullptr;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(e->file, &fileSize) || fileSize.QuadPart < static_cast<LONGLONG>(headerSize))
+		return nullptr;
+	e->mapping = CreateFileMappingA(e->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!e->mapping)
+		return nullptr;
+	e->base = static_cast<unsigned char*>(MapViewOfFile(e->mapping, FILE_MAP_READ, 0, 0, 0));
+	e->length = static_cast<size_t>(fileSize.QuadPart);
+#else
+	const int fd = ::open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+	struct stat info = {};
+	if (fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(headerSize))
+	{
+		close(fd);
+		return nullptr;
+	}
+	void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+		return nullptr;
+	e->base = static_cast<unsigned char*>(mapped);
+	e->length = info.st_size;
+#endif
+	if (!e->base)
+		return nullptr;
+	e->headerSize = headerSize;
+	return e;
+}
+
+std::unique_ptr<TextureCache::entry> TextureCache::open(const std::string& key, int width, int height, int levels, GLenum format)
+{
+	if (directory.empty())
+		return nullptr;
+
+	std::unique_ptr<entry> e = map(path(key), sizeof(file_header));
+	if (!e)
+		return nullptr;
+
+	// a file of another layout or a truncated one is never used, the next save replaces it
+	file_header header;
+	memcpy(&header, e->base, sizeof(header));
+	size_t expected = 0;
+	for (int level = 0; level < levels; level++)
+		expected += level_size(format, std::max(width >> level, 1), std::max(height >> level, 1));
+	if (header.magic != FILE_MAGIC || header.format != format || header.width != static_cast<uint32_t>(width)
+		|| header.height != static_cast<uint32_t>(height) || header.levels != static_cast<uint32_t>(levels) || e->size() != expected)
+		return nullptr;
+	return e;
+}
+
+bool TextureCache::write(const std::string& file, const std::function<bool(FILE*)>& writer)
+{
+	make_dir(directory);
+	const std::string temp = file + ".tmp";
+	FILE* f = fopen(temp.c_str(), "wb");
+	if (!f)
+	{
+		fprintf(stderr, "Failed to write texture cache %s\n", temp.c_str());
+		return false;
+	}
+
+	const bool written = writer(f);
+	fclose(f);
+	remove(file.c_str());
+	if (!written || rename(temp.c_str(), file.c_str()) != 0)
+	{
+		remove(temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool TextureCache::compress(const std::vector<unsigned char>& pixels, int width, int height, GLenum format, std::vector<unsigned char>& blocks)
+{
+	// the driver compresses on upload with a compressed internal format
+	GLint bound;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+
+	GLint compressed = GL_FALSE, size = 0;
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &compressed);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+	const bool ok = compressed == GL_TRUE && static_cast<size_t>(size) == level_size(format, width, height);
+	if (ok)
+	{
+		blocks.resize(size);
+		glGetCompressedTexImage(GL_TEXTURE_2D, 0, blocks.data());
+	}
+	glBindTexture(GL_TEXTURE_2D, bound);
+	glDeleteTextures(1, &texture);
+	return ok;
+}
+
+void TextureCache::save(const std::string& key, GLuint texture, GLenum target, int layer, int width, int height, int levels, GLenum format)
+{
+	if (directory.empty())
+		return;
+
+	GLint readFbo;
+	glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFbo);
+	GLuint fbo;
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+
+	std::vector<unsigned char> data, pixels, blocks;
+	bool ok = true;
+	for (int level = 0; level < levels && ok; level++)
+	{
+		const int w = std::max(width >> level, 1);
+		const int h = std::max(height >> level, 1);
+		if (target == GL_TEXTURE_2D_ARRAY)
+			glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture, level, layer);
+		else
+			glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, target, texture, level);
+		pixels.resize(static_cast<size_t>(w) * h * 4);
+		glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+
+		if (is_compressed(format))
+			ok = compress(pixels, w, h, format, blocks);
+		else
+			blocks.swap(pixels);
+		data.insert(data.end(), blocks.begin(), blocks.end());
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, readFbo);
+	glDeleteFramebuffers(1, &fbo);
+	if (!ok)
+	{
+		fprintf(stderr, "Texture compression failed, %s is not cached\n", key.c_str());
+		return;
+	}
+
+	const file_header header = { FILE_MAGIC, format, static_cast<uint32_t>(width), static_cast<uint32_t>(height), static_cast<uint32_t>(levels) };
+	write(path(key), [&](FILE* file)
+	{
+		return fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(data.data(), 1, data.size(), file) == data.size();
+	});
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Disk cache of finished textures: every mip level of an image as it ends up in its texture layer or cubemap face,
+// compressed by the driver to S3TC (BC1 / BC3) or BPTC (BC7) where it supports them.
+// A later launch maps the entry and uploads the blocks as they are, without decoding the image or generating mips.
+// Entries are keyed by the image path, size and modification time and the texture layout,
+// an edited image simply misses the cache.
+class TextureCache
+{
+public:
+	// cache file mapped into memory, levels are stored one after another starting with level 0
+	class entry
+	{
+	public:
+		~entry();
+		const unsigned char* data() const { return base + headerSize; }
+		size_t size() const { return length - headerSize; }
+
+	private:
+		friend class TextureCache;
+		unsigned char* base = nullptr;
+		size_t length = 0;
+		size_t headerSize = 0;
+#ifdef _WIN32
+		void* file = nullptr;
+		void* mapping = nullptr;
+#endif
+	};
+
+	// directory for cache files, created on first save, empty string disables the cache
+	static void set_directory(const std::string& path);
+	static bool is_enabled();
+
+	// format entries are stored in, 0 if the cache is disabled, GL_RGBA8 if the driver has no suitable compression
+	static GLenum format(bool alpha);
+	static bool is_compressed(GLenum format);
+	// bytes of one level of one layer
+	static size_t level_size(GLenum format, int width, int height);
+	static int level_count(int width, int height);
+
+	static std::string key(const std::string& imagePath, int width, int height, int levels, GLenum format);
+	// nullptr if there is no entry or it doesn't match the layout
+	static std::unique_ptr<entry> open(const std::string& key, int width, int height, int levels, GLenum format);
+	// reads levels of an array layer or cubemap face back, compresses them and writes the entry.
+	// target - GL_TEXTURE_2D_ARRAY or a cubemap face
+	static void save(const std::string& key, GLuint texture, GLenum target, int layer, int width, int height, int levels, GLenum format);
+
+	// cache file of key, other kinds of cached data use their own extension
+	static std::string path(const std::string& key, const char* extension = ".tex");
+	// maps a whole file, data() starts after headerSize bytes. nullptr if it's missing or shorter than the header
+	static std::unique_ptr<entry> map(const std::string& file, size_t headerSize);
+	// writes the file through a temporary one, a second instance must never map a half written file.
+	// writer returns false on failure, the file is left out then
+	static bool write(const std::string& file, const std::function<bool(FILE*)>& writer);
+
+private:
+	static std::string directory;
+
+	static bool has_extension(const char* name);
+	static bool compress(const std::vector<unsigned char>& pixels, int width, int height, GLenum format, std::vector<unsigned char>& blocks);
+};
@@ -0,0 +1,543 @@
+#include "TextureLoader.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stb_image.h>
+#include "utils.h"
+
+namespace
+{
+	// cached textures show their levels up to this size until the full ones arrive
+	const int PREVIEW_SIZE = 64;
+}
+
+// at least one worker, the render thread only uploads
+TextureLoader::TextureLoader(int uploadUnit)
+	: uploadUnit(uploadUnit), pool(std::max(std::thread::hardware_concurrency(), 2u))
+{
+}
+
+TextureLoader::~TextureLoader()
+{
+	cancel();
+}
+
+GLuint TextureLoader::load_array(const std::vector<std::string>& paths, const std::vector<glm::vec4>& placeholders, int maxLayerSize)
+{
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	maxSize = std::min<GLint>(maxSize, maxLayerSize);
+
+	// only headers are read here, they give the layer size before anything is decoded
+	std::vector<std::unique_ptr<image>> images;
+	int layerWidth = 1, layerHeight = 1;
+	bool alpha = false;
+	for (size_t i = 0; i < paths.size(); i++)
+	{
+		std::unique_ptr<image> img(new image());
+		img->path = paths[i];
+		img->layer = static_cast<int>(i);
+		// no image, the layer keeps its placeholder
+		if (img->path.empty() || !read_header(*img))
+			continue;
+		layerWidth = std::max(layerWidth, std::min(img->width, maxSize));
+		layerHeight = std::max(layerHeight, std::min(img->height, maxSize));
+		alpha = alpha || img->components == 2 || img->components == 4;
+		images.push_back(std::move(img));
+	}
+
+	std::unique_ptr<texture_job> job(new texture_job());
+	job->target = GL_TEXTURE_2D_ARRAY;
+	job->width = layerWidth;
+	job->height = layerHeight;
+	job->layers = std::max(static_cast<int>(paths.size()), 1);
+	job->levels = TextureCache::level_count(layerWidth, layerHeight);
+	job->mipmaps = true;
+	job->cacheFormat = TextureCache::format(alpha);
+	open_cache(*job, images);
+
+	GLint drawFbo;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFbo);
+	glActiveTexture(GL_TEXTURE0 + uploadUnit);
+
+	glGenTextures(1, &job->texture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, job->texture);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	if (job->cached)
+	{
+		create_cached(*job, images);
+	}
+	else
+	{
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, layerWidth, layerHeight, job->layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		for (size_t i = 0; i < paths.size(); i++)
+			clear(job->texture, GL_TEXTURE_2D_ARRAY, static_cast<int>(i), i < placeholders.size() ? placeholders[i] : glm::vec4(0.5f, 0.5f, 0.5f, 1));
+		glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFbo);
+
+	const GLuint array = job->texture;
+	start(std::move(job), images);
+	checkGlErrors("Texture array creation");
+	return array;
+}
+
+GLuint TextureLoader::load_cubemap(const std::vector<std::string>& faces, const glm::vec3& placeholder, bool genMipmap)
+{
+	std::vector<std::unique_ptr<image>> images;
+	for (size_t i = 0; i < faces.size() && i < 6; i++)
+	{
+		std::unique_ptr<image> img(new image());
+		img->path = faces[i];
+		img->layer = static_cast<int>(i);
+		if (!read_header(*img))
+			continue;
+		// faces can't be scaled, the ones that don't match the first are left out
+		if (!images.empty() && (img->width != images[0]->width || img->height != images[0]->height))
+		{
+			std::cout << "Cubemap face " << img->path << " is " << img->width << "x" << img->height
+				<< ", the other faces are " << images[0]->width << "x" << images[0]->height << std::endl;
+			continue;
+		}
+		images.push_back(std::move(img));
+	}
+
+	std::unique_ptr<texture_job> job(new texture_job());
+	job->target = GL_TEXTURE_CUBE_MAP;
+	job->width = images.empty() ? 1 : images[0]->width;
+	job->height = images.empty() ? 1 : images[0]->height;
+	job->layers = 6;
+	job->levels = genMipmap ? TextureCache::level_count(job->width, job->height) : 1;
+	job->mipmaps = genMipmap;
+	job->cacheFormat = TextureCache::format(false);
+	open_cache(*job, images);
+
+	GLint drawFbo;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFbo);
+	glActiveTexture(GL_TEXTURE0 + uploadUnit);
+
+	glGenTextures(1, &job->texture);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, job->texture);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, genMipmap ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	if (job->cached)
+	{
+		create_cached(*job, images);
+	}
+	else
+	{
+		for (GLenum face = 0; face < 6; face++)
+		{
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_RGB8, job->width, job->height, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+			clear(job->texture, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, glm::vec4(placeholder, 1));
+		}
+		if (genMipmap)
+			glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+	}
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFbo);
+
+	const GLuint cubemap = job->texture;
+	start(std::move(job), images);
+	checkGlErrors("Cubemap creation");
+	return cubemap;
+}
+
+int TextureLoader::update()
+{
+	std::vector<std::unique_ptr<image>> ready;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (std::unique_ptr<image>& img : pending)
+		{
+			if (img->decoded)
+				ready.push_back(std::move(img));
+		}
+	}
+	if (ready.empty())
+		return 0;
+	pending.erase(std::remove(pending.begin(), pending.end(), nullptr), pending.end());
+
+	GLint activeUnit, readFbo, drawFbo, unpackAlignment;
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &activeUnit);
+	glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFbo);
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFbo);
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpackAlignment);
+	glActiveTexture(GL_TEXTURE0 + uploadUnit);
+	// rgb rows of odd widths aren't 4 byte aligned
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	// mip levels are rebuilt once per texture, not once per image
+	std::vector<texture_job*> mipmapped;
+	for (std::unique_ptr<image>& img : ready)
+	{
+		upload(*img);
+		texture_job* job = img->job;
+		if (job->mipmaps && !job->cached && !img->failed && std::find(mipmapped.begin(), mipmapped.end(), job) == mipmapped.end())
+			mipmapped.push_back(job);
+	}
+	for (texture_job* job : mipmapped)
+	{
+		glBindTexture(job->target, job->texture);
+		glGenerateMipmap(job->target);
+		glBindTexture(job->target, 0);
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, unpackAlignment);
+
+	for (std::unique_ptr<texture_job>& job : jobs)
+	{
+		if (job->remaining == 0)
+		{
+			finish_job(*job);
+			job.reset();
+		}
+	}
+	jobs.erase(std::remove(jobs.begin(), jobs.end(), nullptr), jobs.end());
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, readFbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFbo);
+	glActiveTexture(activeUnit);
+	checkGlErrors("Texture upload");
+	return static_cast<int>(ready.size());
+}
+
+void TextureLoader::finish()
+{
+	while (!pending.empty())
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this]
+			{
+				return std::any_of(pending.begin(), pending.end(), [](const std::unique_ptr<image>& img) { return img->decoded; });
+			});
+		}
+		update();
+	}
+}
+
+int TextureLoader::getPendingCount() const
+{
+	return static_cast<int>(pending.size());
+}
+
+void TextureLoader::cancel()
+{
+	cancelled = true;
+	{
+		// a running decode may still write to its mapped buffer
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this] { return running == 0; });
+	}
+
+	for (std::unique_ptr<image>& img : pending)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, img->buffer);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &img->buffer);
+	}
+	pending.clear();
+	jobs.clear();
+
+	if (fbo[0])
+	{
+		glDeleteFramebuffers(2, fbo);
+		fbo[0] = fbo[1] = 0;
+	}
+}
+
+bool TextureLoader::read_header(image& img)
+{
+	if (!stbi_info(img.path.c_str(), &img.width, &img.height, &img.components))
+	{
+		std::cout << "Texture failed to load at path: " << img.path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void TextureLoader::open_cache(texture_job& job, std::vector<std::unique_ptr<image>>& images)
+{
+	// compressed levels can't be cleared to a placeholder, a layer without an image keeps the whole texture uncached
+	if (static_cast<int>(images.size()) != job.layers)
+		job.cacheFormat = 0;
+	if (!job.cacheFormat)
+		return;
+
+	// one format for the whole texture, a single missing entry means decoding all of them
+	bool all = true;
+	for (std::unique_ptr<image>& img : images)
+	{
+		img->cacheKey = TextureCache::key(img->path, job.width, job.height, job.levels, job.cacheFormat);
+		img->entry = TextureCache::open(img->cacheKey, job.width, job.height, job.levels, job.cacheFormat);
+		all = all && img->entry;
+	}
+	if (!all)
+	{
+		for (std::unique_ptr<image>& img : images)
+			img->entry.reset();
+		return;
+	}
+
+	job.cached = true;
+	job.firstResident = job.levels;
+	while (job.firstResident > 0 && std::max(job.width >> (job.firstResident - 1), job.height >> (job.firstResident - 1)) <= PREVIEW_SIZE)
+		job.firstResident--;
+}
+
+void TextureLoader::create_cached(texture_job& job, const std::vector<std::unique_ptr<image>>& images)
+{
+	const GLenum format = job.cacheFormat;
+	const bool compressed = TextureCache::is_compressed(format);
+	for (int level = 0; level < job.levels; level++)
+	{
+		const int w = std::max(job.width >> level, 1);
+		const int h = std::max(job.height >> level, 1);
+		const GLsizei size = static_cast<GLsizei>(TextureCache::level_size(format, w, h));
+		if (job.target == GL_TEXTURE_2D_ARRAY)
+		{
+			if (compressed)
+				glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, w, h, job.layers, 0, size * job.layers, nullptr);
+			else
+				glTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, w, h, job.layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+			continue;
+		}
+		for (int face = 0; face < job.layers; face++)
+		{
+			if (compressed)
+				glCompressedTexImage2D(image_target(job, face), level, format, w, h, 0, size, nullptr);
+			else
+				glTexImage2D(image_target(job, face), level, format, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		}
+	}
+	glTexParameteri(job.target, GL_TEXTURE_MAX_LEVEL, job.levels - 1);
+
+	// the small levels are a coarse preview of the texture while the large ones load
+	if (job.firstResident < job.levels)
+	{
+		for (const std::unique_ptr<image>& img : images)
+			upload_cached(job, *img, img->entry->data(), job.firstResident, job.levels);
+		glTexParameteri(job.target, GL_TEXTURE_BASE_LEVEL, job.firstResident);
+	}
+}
+
+void TextureLoader::start(std::unique_ptr<texture_job> job, std::vector<std::unique_ptr<image>>& images)
+{
+	for (std::unique_ptr<image>& img : images)
+	{
+		img->job = job.get();
+		queue(std::move(img));
+	}
+	if (job->remaining == 0)
+		finish_job(*job);
+	else
+		jobs.push_back(std::move(job));
+}
+
+void TextureLoader::queue(std::unique_ptr<image> img)
+{
+	texture_job& job = *img->job;
+	if (img->entry)
+	{
+		// levels from firstResident on are uploaded already
+		img->size = 0;
+		for (int level = 0; level < job.firstResident; level++)
+			img->size += TextureCache::level_size(job.cacheFormat, std::max(job.width >> level, 1), std::max(job.height >> level, 1));
+		if (img->size == 0)
+			return;
+	}
+	else
+	{
+		img->size = static_cast<size_t>(img->width) * img->height * img->components;
+	}
+
+	// the worker decodes straight into the buffer, update() only unmaps it and starts the transfer
+	glGenBuffers(1, &img->buffer);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, img->buffer);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, img->size, nullptr, GL_STREAM_DRAW);
+	img->mapped = static_cast<unsigned char*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, img->size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (!img->mapped)
+	{
+		std::cout << "Texture upload buffer mapping failed for " << img->path << std::endl;
+		glDeleteBuffers(1, &img->buffer);
+		return;
+	}
+
+	image* target = img.get();
+	job.remaining++;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending.push_back(std::move(img));
+		running++;
+	}
+	pool.enqueue([this, target] { decode(target); });
+}
+
+void TextureLoader::decode(image* img)
+{
+	bool ok = false;
+	if (cancelled)
+	{
+		// nothing is read, cancel() waits for this task and releases the buffer
+	}
+	else if (img->entry)
+	{
+		// page faults of the mapped entry are taken here, not on the render thread
+		memcpy(img->mapped, img->entry->data(), img->size);
+		ok = true;
+	}
+	else
+	{
+		int width, height, components;
+		unsigned char* data = stbi_load(img->path.c_str(), &width, &height, &components, img->components);
+		ok = data && width == img->width && height == img->height;
+		if (ok)
+			memcpy(img->mapped, data, img->size);
+		stbi_image_free(data);
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	img->decoded = true;
+	img->failed = !ok;
+	running--;
+	cv.notify_all();
+}
+
+void TextureLoader::upload(image& img)
+{
+	texture_job& job = *img.job;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, img.buffer);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	if (img.failed)
+	{
+		std::cout << "Texture failed to load at path: " << img.path << std::endl;
+	}
+	else if (job.cached)
+	{
+		glBindTexture(job.target, job.texture);
+		upload_cached(job, img, nullptr, 0, job.firstResident);
+		glBindTexture(job.target, 0);
+	}
+	else if (job.target == GL_TEXTURE_2D_ARRAY)
+	{
+		// layers have one size, the image goes through a 2D texture and is scaled into its layer by a blit
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, img.width, img.height, 0, pixel_format(img.components), GL_UNSIGNED_BYTE, nullptr);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		if (!fbo[0])
+			glGenFramebuffers(2, fbo);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo[0]);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[1]);
+		glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+		glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, job.texture, 0, img.layer);
+		glBlitFramebuffer(0, 0, img.width, img.height, 0, 0, job.width, job.height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+		glDeleteTextures(1, &texture);
+	}
+	else
+	{
+		glBindTexture(GL_TEXTURE_CUBE_MAP, job.texture);
+		glTexSubImage2D(image_target(job, img.layer), 0, 0, 0, img.width, img.height, pixel_format(img.components), GL_UNSIGNED_BYTE, nullptr);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glDeleteBuffers(1, &img.buffer);
+
+	if (!img.failed && !job.cached && job.cacheFormat)
+		job.entries.push_back(std::make_pair(img.layer, img.cacheKey));
+	job.remaining--;
+}
+
+void TextureLoader::upload_cached(const texture_job& job, const image& img, const unsigned char* data, int firstLevel, int endLevel)
+{
+	// data - the entry in client memory, nullptr - the bound unpack buffer, which starts at firstLevel.
+	// The texture is bound by the caller
+	const GLenum format = job.cacheFormat;
+	size_t offset = 0;
+	if (data)
+	{
+		for (int level = 0; level < firstLevel; level++)
+			offset += TextureCache::level_size(format, std::max(job.width >> level, 1), std::max(job.height >> level, 1));
+	}
+
+	for (int level = firstLevel; level < endLevel; level++)
+	{
+		const int w = std::max(job.width >> level, 1);
+		const int h = std::max(job.height >> level, 1);
+		const GLsizei size = static_cast<GLsizei>(TextureCache::level_size(format, w, h));
+		const void* pixels = data ? static_cast<const void*>(data + offset) : reinterpret_cast<const void*>(offset);
+		if (job.target == GL_TEXTURE_2D_ARRAY)
+		{
+			if (TextureCache::is_compressed(format))
+				glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, img.layer, w, h, 1, format, size, pixels);
+			else
+				glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, img.layer, w, h, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+		}
+		else
+		{
+			if (TextureCache::is_compressed(format))
+				glCompressedTexSubImage2D(image_target(job, img.layer), level, 0, 0, w, h, format, size, pixels);
+			else
+				glTexSubImage2D(image_target(job, img.layer), level, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+		}
+		offset += size;
+	}
+}
+
+void TextureLoader::finish_job(texture_job& job)
+{
+	if (job.cached)
+	{
+		glBindTexture(job.target, job.texture);
+		glTexParameteri(job.target, GL_TEXTURE_BASE_LEVEL, 0);
+		glBindTexture(job.target, 0);
+		return;
+	}
+
+	// first launch, the next one maps these instead of decoding.
+	// Reading back and compressing takes a moment, but only once
+	for (const std::pair<int, std::string>& entry : job.entries)
+		TextureCache::save(entry.second, job.texture, image_target(job, entry.first), entry.first, job.width, job.height, job.levels, job.cacheFormat);
+}
+
+void TextureLoader::clear(GLuint texture, GLenum target, int layer, const glm::vec4& color)
+{
+	if (!fbo[0])
+		glGenFramebuffers(2, fbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[1]);
+	if (target == GL_TEXTURE_2D_ARRAY)
+		glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture, 0, layer);
+	else
+		glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, target, texture, 0);
+	glClearBufferfv(GL_COLOR, 0, &color[0]);
+}
+
+GLenum TextureLoader::image_target(const texture_job& job, int layer)
+{
+	return job.target == GL_TEXTURE_2D_ARRAY ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_CUBE_MAP_POSITIVE_X + layer;
+}
+
+GLenum TextureLoader::pixel_format(int components)
+{
+	switch (components)
+	{
+		case 1: return GL_RED;
+		case 2: return GL_RG;
+		case 3: return GL_RGB;
+		default: return GL_RGBA;
+	}
+}
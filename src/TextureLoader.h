@@ -0,0 +1,113 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "TextureCache.h"
+#include "ThreadPool.h"
+
+// Asynchronous texture loading.
+// Textures are created right away, filled with a placeholder color, and images are decoded on a thread pool
+// straight into mapped pixel buffer objects. update() copies finished images from their buffers into the textures,
+// so rendering starts before anything is decoded and textures sharpen as they arrive.
+// Once all images of a texture are in, its levels are written to the TextureCache. When every image
+// of a texture is cached, the texture is created in the compressed format instead and the workers
+// copy the mapped entries, the images aren't decoded at all.
+// All GL calls happen on the thread that calls the public methods, the one with the context current.
+class TextureLoader
+{
+public:
+	// uploadUnit - texture unit textures are bound to while being filled, left unbound afterwards
+	explicit TextureLoader(int uploadUnit);
+	~TextureLoader();
+
+	TextureLoader(const TextureLoader&) = delete;
+	TextureLoader& operator=(const TextureLoader&) = delete;
+
+	// 2D array, image i is layer i, placeholders[i] its color until it arrives (gray if missing), for good with an empty path.
+	// Layers share the size of the largest image up to maxLayerSize, other images are scaled on upload.
+	// Mipmapped, GL_REPEAT
+	GLuint load_array(const std::vector<std::string>& paths, const std::vector<glm::vec4>& placeholders, int maxLayerSize);
+	// faces in GL_TEXTURE_CUBE_MAP_POSITIVE_X + i order, the size of the first one
+	GLuint load_cubemap(const std::vector<std::string>& faces, const glm::vec3& placeholder, bool genMipmap);
+
+	// uploads decoded images without waiting, returns the number uploaded
+	int update();
+	// waits for all images and uploads them
+	void finish();
+	int getPendingCount() const;
+	// stops decoding and releases the buffers, call while the context is still current
+	void cancel();
+
+private:
+	// a texture whose images are still loading
+	struct texture_job
+	{
+		GLuint texture = 0;
+		GLenum target = 0; // GL_TEXTURE_2D_ARRAY or GL_TEXTURE_CUBE_MAP
+		int width = 0; // layer or face size
+		int height = 0;
+		int layers = 1; // array layers, 6 for a cubemap
+		int levels = 1;
+		bool mipmaps = false; // levels past 0 are generated from level 0
+		GLenum cacheFormat = 0; // 0 - not cached
+		bool cached = false; // the texture is in cacheFormat, images come from cache entries with all levels
+		int firstResident = 0; // cached: levels below it arrive with the images, the ones above are uploaded up front
+		int remaining = 0; // images not uploaded yet
+		std::vector<std::pair<int, std::string>> entries; // layer and cache key of every image, written once all are in
+	};
+
+	struct image
+	{
+		texture_job* job = nullptr;
+		int layer = 0; // array layer or cubemap face
+		int width = 0;
+		int height = 0;
+		int components = 0;
+		std::string path;
+		std::string cacheKey;
+		std::unique_ptr<TextureCache::entry> entry; // the image is copied from here instead of decoded
+		GLuint buffer = 0;
+		size_t size = 0; // bytes in buffer
+		unsigned char* mapped = nullptr; // written by the decoding worker
+		bool decoded = false; // guarded by mutex, mapped holds the pixels
+		bool failed = false;
+	};
+
+	int uploadUnit;
+	std::vector<std::unique_ptr<texture_job>> jobs;
+	std::vector<std::unique_ptr<image>> pending;
+	GLuint fbo[2] = {};
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::atomic<bool> cancelled{ false };
+	int running = 0; // decode tasks started and not finished, guarded by mutex
+
+	// last, workers must stop before the rest is destroyed
+	ThreadPool pool;
+
+	// size and components without decoding, false if the file can't be read
+	static bool read_header(image& img);
+	// looks up cache entries for all images, with every one of them found the job becomes a cached one.
+	// Textures with layers that have no image are never cached
+	void open_cache(texture_job& job, std::vector<std::unique_ptr<image>>& images);
+	// cached job: allocates the compressed levels and uploads the small ones from the entries right away
+	void create_cached(texture_job& job, const std::vector<std::unique_ptr<image>>& images);
+	// queues the images, the job is kept until the last one is uploaded
+	void start(std::unique_ptr<texture_job> job, std::vector<std::unique_ptr<image>>& images);
+	// maps a buffer for the pixels and queues the decode
+	void queue(std::unique_ptr<image> img);
+	void decode(image* img);
+	void upload(image& img);
+	void upload_cached(const texture_job& job, const image& img, const unsigned char* data, int firstLevel, int endLevel);
+	void finish_job(texture_job& job);
+	void clear(GLuint texture, GLenum target, int layer, const glm::vec4& color);
+	static GLenum image_target(const texture_job& job, int layer);
+	static GLenum pixel_format(int components);
+};
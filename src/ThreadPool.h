@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+	// threads == 0 - use all hardware threads
+	explicit ThreadPool(unsigned threads = 0)
+	{
+		if (threads == 0)
+			threads = std::thread::hardware_concurrency();
+		if (threads == 0)
+			threads = 1;
+
+		// calling thread takes part in parallel_for, so one worker less is enough
+		for (unsigned i = 1; i < threads; i++)
+			workers.emplace_back([this] { worker_loop(); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cv.notify_all();
+		for (auto& worker : workers)
+			worker.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned size() const
+	{
+		return static_cast<unsigned>(workers.size()) + 1;
+	}
+
+	void enqueue(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+		}
+		cv.notify_one();
+	}
+
+	// calls fn(i) for every i in [0, count), blocks until all calls are finished
+	void parallel_for(int count, const std::function<void(int)>& fn)
+	{
+		if (count <= 0)
+			return;
+
+		// helpers may be picked up after all indices are taken and parallel_for has returned,
+		// so the shared state must outlive this call
+		auto job = std::make_shared<parallel_job>();
+		job->count = count;
+		job->fn = &fn;
+
+		auto run = [job]
+		{
+			int finished = 0;
+			for (int i = job->next++; i < job->count; i = job->next++)
+			{
+				(*job->fn)(i);
+				finished++;
+			}
+			if (finished > 0 && (job->done += finished) == job->count)
+			{
+				std::lock_guard<std::mutex> lock(job->mutex);
+				job->cv.notify_all();
+			}
+		};
+
+		const int helpers = std::min(static_cast<int>(workers.size()), count - 1);
+		for (int i = 0; i < helpers; i++)
+			enqueue(run);
+
+		run();
+
+		std::unique_lock<std::mutex> lock(job->mutex);
+		job->cv.wait(lock, [&] { return job->done == count; });
+	}
+
+private:
+	struct parallel_job
+	{
+		std::atomic<int> next{ 0 };
+		std::atomic<int> done{ 0 };
+		int count = 0;
+		const std::function<void(int)>* fn = nullptr;
+		std::mutex mutex;
+		std::condition_variable cv;
+	};
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool stopping = false;
+
+	void worker_loop()
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+				if (stopping && tasks.empty())
+					return;
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+};
@@ -0,0 +1,502 @@
+#include "VirtualTextures.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <stb_image.h>
+#include "utils.h"
+
+namespace
+{
+	const uint32_t FILE_MAGIC = 0x54565452; // "RTVT"
+	const size_t TILE_BYTES = static_cast<size_t>(VirtualTextures::SLOT_SIZE) * VirtualTextures::SLOT_SIZE * 4;
+	// tiles uploaded per frame while the view moves, more just arrive a frame later
+	const int MAX_UPLOADS_PER_FRAME = 16;
+	// page table entry with no resident tile, rt.frag shows the placeholder
+	const uint32_t PAGE_NONE = 0xffffffffu;
+
+	struct file_header
+	{
+		uint32_t magic;
+		uint32_t width;
+		uint32_t height;
+		uint32_t levels;
+		uint32_t tileSize;
+		uint32_t tileBorder;
+	};
+
+	// slot coordinates and the level of the resident tile
+	uint32_t page_entry(int slotIndex, int slotsPerSide, int level)
+	{
+		return static_cast<uint32_t>(slotIndex % slotsPerSide) | static_cast<uint32_t>(slotIndex / slotsPerSide) << 8
+			| static_cast<uint32_t>(level) << 16;
+	}
+}
+
+// the only worker builds tile files one after another, the render thread doesn't take part
+VirtualTextures::VirtualTextures()
+	: pool(2)
+{
+}
+
+VirtualTextures::~VirtualTextures()
+{
+	cancelled = true;
+}
+
+void VirtualTextures::init(int width, int height, int pagesUnit, int cacheUnit, bool synchronous, int cacheSlots)
+{
+	this->width = width;
+	this->height = height;
+	this->pagesUnit = pagesUnit;
+	this->cacheUnit = cacheUnit;
+	this->synchronous = synchronous;
+	this->cacheSlots = std::min(cacheSlots, 256); // page table entries store slot coordinates in 8 bits
+	slots.assign(this->cacheSlots * this->cacheSlots, slot());
+
+	// physical cache, tiles are sampled at their own level, it needs no mips
+	glGenTextures(1, &cacheTex);
+	glActiveTexture(GL_TEXTURE0 + cacheUnit);
+	glBindTexture(GL_TEXTURE_2D, cacheTex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, this->cacheSlots * SLOT_SIZE, this->cacheSlots * SLOT_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glGenBuffers(1, &pagesBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, pagesBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(uint32_t), &PAGE_NONE, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glGenTextures(1, &pagesTex);
+	glActiveTexture(GL_TEXTURE0 + pagesUnit);
+	glBindTexture(GL_TEXTURE_BUFFER, pagesTex);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, pagesBuffer);
+
+	// rgba8: texture + 1 (0 - no request), level, tile x, tile y
+	const int feedbackWidth = getFeedbackWidth();
+	const int feedbackHeight = getFeedbackHeight();
+	glGenTextures(1, &feedbackTex);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, feedbackTex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, feedbackWidth, feedbackHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glGenFramebuffers(1, &feedbackFbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, feedbackFbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, feedbackTex, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		std::cout << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << std::endl;
+		exit(1);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	feedback.reset(new FrameReadback(feedbackWidth, feedbackHeight, false, [this](const readback_frame& f) { collect_requests(f); }));
+	checkGlErrors("Virtual textures creation");
+}
+
+int VirtualTextures::add(int texNum, const std::string& path, const glm::vec4& placeholder)
+{
+	if (static_cast<int>(textures.size()) == MAX_TEXTURES)
+	{
+		std::cout << "No virtual texture left for " << path << ", at most " << MAX_TEXTURES << std::endl;
+		return -1;
+	}
+
+	std::unique_ptr<texture> tex(new texture());
+	int components;
+	if (!stbi_info(path.c_str(), &tex->width, &tex->height, &components))
+	{
+		std::cout << "Texture failed to load at path: " << path << std::endl;
+		return -1;
+	}
+	if (tex->width > MAX_SIZE || tex->height > MAX_SIZE)
+	{
+		std::cout << "Virtual texture " << path << " is " << tex->width << "x" << tex->height
+			<< ", at most " << MAX_SIZE << "x" << MAX_SIZE << std::endl;
+		return -1;
+	}
+
+	tex->texNum = texNum;
+	tex->path = path;
+	tex->placeholder = placeholder;
+	// down to the level that fits a single tile
+	tex->levels = 1;
+	while (pages(tex->width, tex->levels - 1) > 1 || pages(tex->height, tex->levels - 1) > 1)
+		tex->levels++;
+	tex->levelPages.push_back(0);
+	for (int level = 0; level < tex->levels; level++)
+		tex->levelPages.push_back(tex->levelPages.back() + pages(tex->width, level) * pages(tex->height, level));
+	tex->pageSlots.assign(tex->levelPages.back(), -1);
+	tex->firstPage = textures.empty() ? 0 : textures.back()->firstPage + textures.back()->levelPages.back();
+
+	// the slot size stands in for the format, tile files of another layout get another key
+	const std::string key = TextureCache::key(path, tex->width, tex->height, tex->levels, SLOT_SIZE);
+	tex->file = TextureCache::path(key, ".vt");
+
+	texture* added = tex.get();
+	textures.push_back(std::move(tex));
+	pagesDirty = true;
+
+	const std::unique_ptr<TextureCache::entry> existing = TextureCache::map(added->file, sizeof(file_header));
+	if (existing)
+	{
+		file_header header;
+		memcpy(&header, existing->data() - sizeof(header), sizeof(header));
+		if (header.magic == FILE_MAGIC && header.width == static_cast<uint32_t>(added->width) && header.height == static_cast<uint32_t>(added->height)
+			&& header.levels == static_cast<uint32_t>(added->levels) && header.tileSize == TILE_SIZE && header.tileBorder == TILE_BORDER
+			&& existing->size() == added->pageSlots.size() * TILE_BYTES)
+		{
+			added->state = BUILT;
+			return static_cast<int>(textures.size()) - 1;
+		}
+	}
+
+	pool.enqueue([this, added]
+	{
+		const bool built = build_tiles(*added, cancelled);
+		std::lock_guard<std::mutex> lock(mutex);
+		added->state = built ? BUILT : FAILED;
+		if (!built && !cancelled)
+			std::cout << "Failed to build the tiles of " << added->path << std::endl;
+		cv.notify_all();
+	});
+	return static_cast<int>(textures.size()) - 1;
+}
+
+int VirtualTextures::getCount() const
+{
+	return static_cast<int>(textures.size());
+}
+
+void VirtualTextures::set_uniforms(const Shader& program) const
+{
+	program.setInt("vt_count", getCount());
+	for (int i = 0; i < getCount(); i++)
+	{
+		const texture& tex = *textures[i];
+		const std::string index = "[" + std::to_string(i) + "]";
+		glUniform4i(glGetUniformLocation(program.ID, ("vt_info" + index).c_str()), tex.texNum, tex.firstPage, tex.width, tex.height);
+		program.setInt("vt_levels" + index, tex.levels);
+		program.setVec4("vt_placeholder" + index, tex.placeholder);
+	}
+	program.setInt("vt_pages", pagesUnit);
+	program.setInt("vt_cache", cacheUnit);
+}
+
+GLuint VirtualTextures::getFeedbackFramebuffer() const
+{
+	return feedbackFbo;
+}
+
+int VirtualTextures::getFeedbackWidth() const
+{
+	return (width + FEEDBACK_SCALE - 1) / FEEDBACK_SCALE;
+}
+
+int VirtualTextures::getFeedbackHeight() const
+{
+	return (height + FEEDBACK_SCALE - 1) / FEEDBACK_SCALE;
+}
+
+glm::vec2 VirtualTextures::next_feedback_offset()
+{
+	// R2 sequence, spreads the samples of consecutive frames evenly over the block
+	const int n = feedbackFrame++;
+	const float x = 0.5f + n * 0.7548776662f;
+	const float y = 0.5f + n * 0.5698402910f;
+	return glm::vec2(x - std::floor(x), y - std::floor(y)) * static_cast<float>(FEEDBACK_SCALE);
+}
+
+bool VirtualTextures::update()
+{
+	frame++;
+	open_built();
+
+	feedback->capture(feedbackFbo, static_cast<int>(frame));
+	if (synchronous)
+		feedback->flush();
+	else
+		feedback->poll();
+
+	if (stream() > 0)
+		pagesDirty = true;
+	requests.clear();
+
+	if (!pagesDirty)
+		return false;
+	write_page_table();
+	pagesDirty = false;
+	return true;
+}
+
+void VirtualTextures::finish()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	cv.wait(lock, [this]
+	{
+		return std::none_of(textures.begin(), textures.end(), [](const std::unique_ptr<texture>& tex) { return tex->state == BUILDING; });
+	});
+}
+
+void VirtualTextures::release()
+{
+	cancelled = true;
+	feedback.reset();
+	if (cacheTex)
+	{
+		glDeleteTextures(1, &cacheTex);
+		glDeleteTextures(1, &pagesTex);
+		glDeleteBuffers(1, &pagesBuffer);
+		glDeleteTextures(1, &feedbackTex);
+		glDeleteFramebuffers(1, &feedbackFbo);
+		cacheTex = 0;
+	}
+}
+
+int VirtualTextures::level_size(int size, int level)
+{
+	return std::max(size >> level, 1);
+}
+
+int VirtualTextures::pages(int size, int level)
+{
+	return (level_size(size, level) + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+uint32_t VirtualTextures::request_key(int texture, int level, int x, int y)
+{
+	return static_cast<uint32_t>(texture) << 28 | static_cast<uint32_t>(level) << 16 | static_cast<uint32_t>(y) << 8 | static_cast<uint32_t>(x);
+}
+
+bool VirtualTextures::build_tiles(const texture& tex, const std::atomic<bool>& cancelled)
+{
+	int w, h, components;
+	unsigned char* decoded = stbi_load(tex.path.c_str(), &w, &h, &components, 4);
+	if (!decoded)
+		return false;
+	std::vector<unsigned char> pixels(decoded, decoded + static_cast<size_t>(w) * h * 4);
+	stbi_image_free(decoded);
+	if (w != tex.width || h != tex.height)
+		return false;
+
+	return TextureCache::write(tex.file, [&](FILE* file)
+	{
+		const file_header header = { FILE_MAGIC, static_cast<uint32_t>(w), static_cast<uint32_t>(h), static_cast<uint32_t>(tex.levels),
+			TILE_SIZE, TILE_BORDER };
+		if (fwrite(&header, sizeof(header), 1, file) != 1)
+			return false;
+
+		std::vector<unsigned char> tile(TILE_BYTES);
+		for (int level = 0; level < tex.levels; level++)
+		{
+			// borders wrap around horizontally, a sphere's u is periodic, and clamp at the poles
+			for (int ty = 0; ty < pages(h, 0); ty++)
+			{
+				for (int tx = 0; tx < pages(w, 0); tx++)
+				{
+					unsigned char* dst = tile.data();
+					for (int row = 0; row < SLOT_SIZE; row++)
+					{
+						const int y = glm::clamp(ty * TILE_SIZE - TILE_BORDER + row, 0, h - 1);
+						const unsigned char* src = pixels.data() + static_cast<size_t>(y) * w * 4;
+						for (int column = 0; column < SLOT_SIZE; column++)
+						{
+							const int x = ((tx * TILE_SIZE - TILE_BORDER + column) % w + w) % w;
+							memcpy(dst, src + x * 4, 4);
+							dst += 4;
+						}
+					}
+					if (fwrite(tile.data(), 1, tile.size(), file) != tile.size())
+						return false;
+				}
+				if (cancelled)
+					return false;
+			}
+			if (level + 1 == tex.levels)
+				break;
+
+			// 2x2 box filter, the last row or column of odd sizes is repeated
+			const int nw = level_size(w, 1);
+			const int nh = level_size(h, 1);
+			std::vector<unsigned char> next(static_cast<size_t>(nw) * nh * 4);
+			for (int y = 0; y < nh; y++)
+			{
+				const unsigned char* row0 = pixels.data() + static_cast<size_t>(std::min(2 * y, h - 1)) * w * 4;
+				const unsigned char* row1 = pixels.data() + static_cast<size_t>(std::min(2 * y + 1, h - 1)) * w * 4;
+				for (int x = 0; x < nw; x++)
+				{
+					const int x0 = std::min(2 * x, w - 1) * 4;
+					const int x1 = std::min(2 * x + 1, w - 1) * 4;
+					for (int c = 0; c < 4; c++)
+						next[(static_cast<size_t>(y) * nw + x) * 4 + c] = static_cast<unsigned char>((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+				}
+			}
+			pixels.swap(next);
+			w = nw;
+			h = nh;
+		}
+		return true;
+	});
+}
+
+void VirtualTextures::collect_requests(const readback_frame& f)
+{
+	const unsigned char* pixels = static_cast<const unsigned char*>(f.data);
+	for (int i = 0; i < f.width * f.height; i++)
+	{
+		const unsigned char* p = pixels + i * 4;
+		if (p[0] == 0 || p[0] > getCount())
+			continue;
+		const texture& tex = *textures[p[0] - 1];
+		if (p[1] < tex.levels && p[2] < pages(tex.width, p[1]) && p[3] < pages(tex.height, p[1]))
+			requests.push_back(request_key(p[0] - 1, p[1], p[2], p[3]));
+	}
+}
+
+void VirtualTextures::open_built()
+{
+	for (int i = 0; i < getCount(); i++)
+	{
+		texture& tex = *textures[i];
+		if (tex.tiles)
+			continue;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (tex.state != BUILT)
+				continue;
+		}
+		tex.tiles = TextureCache::map(tex.file, sizeof(file_header));
+		if (!tex.tiles || tex.tiles->size() != tex.pageSlots.size() * TILE_BYTES)
+		{
+			std::cout << "Failed to map the tiles of " << tex.path << std::endl;
+			tex.tiles.reset();
+			std::lock_guard<std::mutex> lock(mutex);
+			tex.state = FAILED;
+			continue;
+		}
+
+		// the single tile of the last level is always resident, no page falls back to the placeholder anymore
+		const int slotIndex = find_slot();
+		if (slotIndex < 0)
+			continue;
+		upload(i, tex.levelPages[tex.levels - 1], slotIndex);
+		slots[slotIndex].pinned = true;
+		pagesDirty = true;
+	}
+}
+
+int VirtualTextures::stream()
+{
+	// every level above a requested tile is needed too: trilinear filtering reads the next one,
+	// and coarser tiles stand in while finer ones aren't resident
+	const size_t requested = requests.size();
+	for (size_t i = 0; i < requested; i++)
+	{
+		const uint32_t key = requests[i];
+		const int index = key >> 28;
+		int level = key >> 16 & 0xff, x = key & 0xff, y = key >> 8 & 0xff;
+		while (++level < textures[index]->levels)
+		{
+			x /= 2;
+			y /= 2;
+			requests.push_back(request_key(index, level, x, y));
+		}
+	}
+	std::sort(requests.begin(), requests.end());
+	requests.erase(std::unique(requests.begin(), requests.end()), requests.end());
+
+	std::vector<std::pair<int, int>> missing; // texture, page
+	for (uint32_t key : requests)
+	{
+		const int index = key >> 28;
+		texture& tex = *textures[index];
+		if (!tex.tiles)
+			continue;
+		const int level = key >> 16 & 0xff;
+		const int page = tex.levelPages[level] + (key >> 8 & 0xff) * pages(tex.width, level) + (key & 0xff);
+		if (tex.pageSlots[page] >= 0)
+			slots[tex.pageSlots[page]].lastUsed = frame;
+		else
+			missing.push_back(std::make_pair(index, page));
+	}
+
+	// coarse first, a fine tile is useless while its parent shows the placeholder
+	std::stable_sort(missing.begin(), missing.end(), [](const std::pair<int, int>& a, const std::pair<int, int>& b) { return a.second > b.second; });
+	int uploaded = 0;
+	for (const std::pair<int, int>& m : missing)
+	{
+		if (!synchronous && uploaded == MAX_UPLOADS_PER_FRAME)
+			break;
+		const int slotIndex = find_slot();
+		if (slotIndex < 0)
+			break; // everything in the cache is needed this frame
+		upload(m.first, m.second, slotIndex);
+		uploaded++;
+	}
+	return uploaded;
+}
+
+void VirtualTextures::upload(int textureIndex, int page, int slotIndex)
+{
+	slot& s = slots[slotIndex];
+	if (s.texture >= 0)
+		textures[s.texture]->pageSlots[s.page] = -1;
+	s.texture = textureIndex;
+	s.page = page;
+	s.lastUsed = frame;
+
+	texture& tex = *textures[textureIndex];
+	tex.pageSlots[page] = slotIndex;
+	glActiveTexture(GL_TEXTURE0 + cacheUnit);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, slotIndex % cacheSlots * SLOT_SIZE, slotIndex / cacheSlots * SLOT_SIZE, SLOT_SIZE, SLOT_SIZE,
+		GL_RGBA, GL_UNSIGNED_BYTE, tex.tiles->data() + page * TILE_BYTES);
+}
+
+int VirtualTextures::find_slot() const
+{
+	int best = -1;
+	for (int i = 0; i < static_cast<int>(slots.size()); i++)
+	{
+		const slot& s = slots[i];
+		if (s.texture < 0)
+			return i;
+		if (!s.pinned && s.lastUsed < frame && (best < 0 || s.lastUsed < slots[best].lastUsed))
+			best = i;
+	}
+	return best;
+}
+
+void VirtualTextures::write_page_table()
+{
+	if (textures.empty())
+		return;
+
+	// every page points to its own tile or inherits the entry of the page above it, filled coarse to fine
+	std::vector<uint32_t> entries(textures.back()->firstPage + textures.back()->levelPages.back(), PAGE_NONE);
+	for (const std::unique_ptr<texture>& tex : textures)
+	{
+		uint32_t* table = entries.data() + tex->firstPage;
+		for (int level = tex->levels - 1; level >= 0; level--)
+		{
+			const int pagesX = pages(tex->width, level);
+			const int pagesY = pages(tex->height, level);
+			for (int y = 0; y < pagesY; y++)
+			{
+				for (int x = 0; x < pagesX; x++)
+				{
+					const int page = tex->levelPages[level] + y * pagesX + x;
+					if (tex->pageSlots[page] >= 0)
+						table[page] = page_entry(tex->pageSlots[page], cacheSlots, level);
+					else if (level + 1 < tex->levels)
+						table[page] = table[tex->levelPages[level + 1] + y / 2 * pages(tex->width, level + 1) + x / 2];
+				}
+			}
+		}
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, pagesBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, entries.size() * sizeof(uint32_t), entries.data(), GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	checkGlErrors("Virtual texture page table");
+}
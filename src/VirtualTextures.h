@@ -0,0 +1,136 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "FrameReadback.h"
+#include "TextureCache.h"
+#include "ThreadPool.h"
+#include "shader.h"
+
+// Virtual texturing for sphere textures too large to keep in video memory as a whole.
+// Every mip level of the image is cut into TILE_SIZE tiles, converted once into a tile file in the TextureCache
+// directory and mapped. A physical cache texture holds a fixed number of tiles, so video memory stays the same
+// for any image size, and a page table maps every tile of every level to the finest resident tile covering it.
+// A feedback pass renders the tile and level each camera ray needs at 1/FEEDBACK_SCALE resolution, update() reads
+// it back, uploads missing tiles coarse to fine and evicts the least recently requested ones.
+// All GL calls happen on the thread that calls the public methods, the one with the context current.
+class VirtualTextures
+{
+public:
+	static const int TILE_SIZE = 128;
+	// texels copied from the neighbouring tiles around every tile, bilinear filtering stays inside its slot
+	static const int TILE_BORDER = 4;
+	static const int SLOT_SIZE = TILE_SIZE + 2 * TILE_BORDER;
+	// vt_* uniform arrays in rt.frag
+	static const int MAX_TEXTURES = 4;
+	// the feedback stores tile coordinates in 8 bits
+	static const int MAX_SIZE = TILE_SIZE * 256;
+	// feedback pixel per FEEDBACK_SCALE x FEEDBACK_SCALE canvas pixels, rt.frag biases the level by its log2
+	static const int FEEDBACK_SCALE = 8;
+
+	VirtualTextures();
+	~VirtualTextures();
+
+	VirtualTextures(const VirtualTextures&) = delete;
+	VirtualTextures& operator=(const VirtualTextures&) = delete;
+
+	// width, height - canvas size. The page table and the cache stay bound to pagesUnit and cacheUnit.
+	// synchronous - update() waits for the feedback of the frame and uploads every tile it asks for,
+	// so the image doesn't depend on timing. cacheSlots - tiles per side of the cache texture
+	void init(int width, int height, int pagesUnit, int cacheUnit, bool synchronous, int cacheSlots = 16);
+	// texNum - textureNum of the objects using it. The tile file is built on a worker if it isn't cached yet,
+	// until then and until its tiles arrive the texture shows placeholder. -1 if the image can't be used
+	int add(int texNum, const std::string& path, const glm::vec4& placeholder);
+	int getCount() const;
+	// vt_* uniforms of rt.frag, program must be current
+	void set_uniforms(const Shader& program) const;
+
+	GLuint getFeedbackFramebuffer() const;
+	int getFeedbackWidth() const;
+	int getFeedbackHeight() const;
+	// canvas pixel within the FEEDBACK_SCALE block the next feedback pass traces, changes every frame
+	// so the whole view gets sampled over a few frames
+	glm::vec2 next_feedback_offset();
+	// after the feedback pass: queues its readback, reads back finished ones, uploads tiles
+	// and rewrites the page table. Returns whether the page table changed
+	bool update();
+	// waits until all tile files are built
+	void finish();
+	// stops building tile files and deletes the GL objects, call while the context is still current
+	void release();
+
+private:
+	enum file_state { BUILDING, BUILT, FAILED };
+
+	struct texture
+	{
+		int texNum = 0;
+		std::string path;
+		glm::vec4 placeholder;
+		int width = 0;
+		int height = 0;
+		int levels = 0;
+		int firstPage = 0; // of its entries in the page table
+		std::vector<int> levelPages; // first page of every level, relative to firstPage, and the total
+		std::string file;
+		file_state state = BUILDING; // of the tile file, guarded by mutex
+		std::unique_ptr<TextureCache::entry> tiles; // mapped once built
+		std::vector<int> pageSlots; // cache slot of every page, -1 - not resident
+	};
+
+	struct slot
+	{
+		int texture = -1; // -1 - free
+		int page = 0;
+		uint64_t lastUsed = 0; // frame it was last requested in
+		bool pinned = false; // coarsest level, the fallback for every other page
+	};
+
+	int width = 0;
+	int height = 0;
+	int pagesUnit = 0;
+	int cacheUnit = 0;
+	bool synchronous = false;
+	int cacheSlots = 0;
+	uint64_t frame = 0;
+	int feedbackFrame = 0;
+
+	std::vector<std::unique_ptr<texture>> textures;
+	std::vector<slot> slots;
+	std::vector<uint32_t> requests; // packed by the feedback consumer, see request_key
+	bool pagesDirty = false;
+
+	GLuint cacheTex = 0;
+	GLuint pagesBuffer = 0, pagesTex = 0;
+	GLuint feedbackFbo = 0, feedbackTex = 0;
+	std::unique_ptr<FrameReadback> feedback;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::atomic<bool> cancelled{ false };
+
+	// last, workers must stop before the rest is destroyed
+	ThreadPool pool;
+
+	static int level_size(int size, int level);
+	static int pages(int size, int level);
+	// page coordinates are 8 bits each, levels and textures fit the rest
+	static uint32_t request_key(int texture, int level, int x, int y);
+	static bool build_tiles(const texture& tex, const std::atomic<bool>& cancelled);
+	void collect_requests(const readback_frame& frame);
+	// maps tile files built since the last call and makes their coarsest tile resident
+	void open_built();
+	// uploads missing tiles of the requests, returns the number uploaded
+	int stream();
+	void upload(int textureIndex, int page, int slotIndex);
+	// free slot, or the least recently used one not requested this frame, -1 if there is none
+	int find_slot() const;
+	void write_page_table();
+};
@@ -3,11 +3,65 @@
 #include "GLWrapper.h"
 #include "SceneManager.h"
 #include "Surface.h"
+#include "CpuRenderer.h"
+#include "FrameReadback.h"
+#include "FrameWriter.h"
+#include "ImageWriter.h"
+#include "Profiler.h"
+#include "SceneAssets.h"
+#include <chrono>
+#include <memory>
 
 static int wind_width = 1280;
 static int wind_height = 720;
 
+void init_scene(scene_container& scene, int width, int height);
 void update_scene(scene_container& scene, float delta, float time);
+int run_cpu(int argc, char* argv[]);
+int run_headless(int argc, char* argv[], Profiler* profiler, int maxSamples, float gpuBudget, bool checkerboard, bool tiles, bool virtualTextures);
+
+// removes "<name> <value>" from the arguments, returns the value or an empty string
+static std::string take_option(int& argc, char* argv[], const char* name)
+{
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		if (std::string(argv[i]) != name)
+			continue;
+		const std::string path = argv[i + 1];
+		for (int j = i + 2; j < argc; j++)
+			argv[j - 2] = argv[j];
+		argc -= 2;
+		return path;
+	}
+	return std::string();
+}
+
+// removes a "<name>" switch from the arguments, returns whether it was there
+static bool take_flag(int& argc, char* argv[], const char* name)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::string(argv[i]) != name)
+			continue;
+		for (int j = i + 1; j < argc; j++)
+			argv[j - 1] = argv[j];
+		argc--;
+		return true;
+	}
+	return false;
+}
+
+static void save_profile(Profiler* profiler, const std::string& path)
+{
+	if (!profiler)
+		return;
+	profiler->flush();
+	profiler->print_stats(std::cout);
+	if (!profiler->write(path))
+		fprintf(stderr, "Failed to write %s\n", path.c_str());
+	else
+		std::cout << "Profile written to " << path << std::endl;
+}
 
 namespace update {
 	int jupiter = -1,
@@ -20,8 +74,33 @@ namespace update {
 
 const glm::quat saturn_pitch = glm::quat(glm::vec3(glm::radians(15.f), 0, 0));
 
-int main()
+int main(int argc, char* argv[])
 {
+	// --profile out.csv / out.json: per-pass timings, printed every second and saved on exit
+	const std::string profilePath = take_option(argc, argv, "--profile");
+	std::unique_ptr<Profiler> profiler(profilePath.empty() ? nullptr : new Profiler());
+	// --accumulate N: average up to N jittered samples while the view stands still
+	const std::string accumulate = take_option(argc, argv, "--accumulate");
+	const int maxSamples = accumulate.empty() ? 0 : atoi(accumulate.c_str());
+	// --gpu-budget MS: lower the ray trace resolution while the GPU needs longer than MS per frame
+	const std::string budget = take_option(argc, argv, "--gpu-budget");
+	const float gpuBudget = budget.empty() ? 0 : static_cast<float>(atof(budget.c_str()));
+	// --checkerboard: trace half of the pixels per frame, reproject the rest from the previous one
+	const bool checkerboard = take_flag(argc, argv, "--checkerboard");
+	// --no-tiles: trace every camera ray through all objects, for comparison with the tile pre-pass
+	const bool tiles = !take_flag(argc, argv, "--no-tiles");
+	// --virtual-textures: stream the planet maps in tiles instead of loading them whole
+	const bool virtualTextures = take_flag(argc, argv, "--virtual-textures");
+
+	if (argc > 1 && std::string(argv[1]) == "--cpu")
+		return run_cpu(argc, argv);
+	if (argc > 1 && std::string(argv[1]) == "--headless")
+	{
+		const int result = run_headless(argc, argv, profiler.get(), maxSamples, gpuBudget, checkerboard, tiles, virtualTextures);
+		save_profile(profiler.get(), profilePath);
+		return result;
+	}
+
 	GLWrapper glWrapper(wind_width, wind_height, false);
 	// fullscreen
 	//GLWrapper glWrapper(true);
@@ -30,6 +109,16 @@ int main()
 
 	// set SMAA quality preset
 	glWrapper.enable_SMAA(ULTRA);
+	if (maxSamples > 0)
+		glWrapper.enable_accumulation(maxSamples);
+	if (gpuBudget > 0)
+		glWrapper.enable_dynamic_resolution(gpuBudget);
+	if (checkerboard)
+		glWrapper.enable_checkerboard();
+	if (tiles)
+		glWrapper.enable_tile_classification();
+	if (virtualTextures)
+		glWrapper.enable_virtual_texturing();
 	
 	glWrapper.init_window();
 	glfwSwapInterval(1); // vsync
@@ -41,8 +130,69 @@ int main()
 	if (wind_height % 2 == 1) wind_height++;
 
 	scene_container scene = {};
+	init_scene(scene, wind_width, wind_height);
+
+	rt_defines defines = scene.get_defines();
+	glWrapper.init_shaders(defines);
+
+	glWrapper.set_skybox(glWrapper.load_cubemap(skybox_faces(), false));
+
+	load_textures(glWrapper);
+
+	SceneManager scene_manager(wind_width, wind_height, &scene, &glWrapper);
+	scene_manager.init();
+	glWrapper.set_profiler(profiler.get());
+
+	float currentTime = static_cast<float>(glfwGetTime());
+	float lastFramesPrint = currentTime;
+	float framesCount = 0;
 
-	scene.scene = SceneManager::create_scene(wind_width, wind_height);
+	while (!glfwWindowShouldClose(glWrapper.window))
+	{
+		framesCount++;
+		float newTime = static_cast<float>(glfwGetTime());
+		float deltaTime = newTime - currentTime;
+		currentTime = newTime;
+
+		if (newTime - lastFramesPrint > 1.0f)
+		{
+			std::cout << "FPS: " << framesCount;
+			if (gpuBudget > 0)
+				std::cout << ", render scale: " << glWrapper.getRenderScale();
+			std::cout << std::endl;
+			if (profiler)
+				profiler->print_stats(std::cout);
+			lastFramesPrint = newTime;
+			framesCount = 0;
+		}
+
+		if (profiler)
+			profiler->begin_frame();
+		if (!scene_manager.is_paused())
+		{
+			cpu_scope scope(profiler.get(), "update_scene");
+			update_scene(scene, deltaTime, newTime);
+		}
+		{
+			cpu_scope scope(profiler.get(), "SceneManager::update");
+			scene_manager.update(deltaTime);
+		}
+		{
+			cpu_scope scope(profiler.get(), "draw");
+			glWrapper.draw();
+		}
+		glfwSwapBuffers(glWrapper.window);
+		glfwPollEvents();
+	}
+
+	save_profile(profiler.get(), profilePath);
+	glWrapper.stop(); // stop glfw, close window
+	return 0;
+}
+
+void init_scene(scene_container& scene, int width, int height)
+{
+	scene.scene = SceneManager::create_scene(width, height);
 	scene.scene.camera_pos = { 0, 0, -5 };
 	scene.shadow_ambient = glm::vec3{ 0.1, 0.1, 0.1 };
 	scene.ambient_color = glm::vec3{ 0.025, 0.025, 0.025 };
@@ -53,41 +203,40 @@ int main()
 
 	// blue sphere
 	scene.spheres.push_back(SceneManager::create_sphere({ 2, 0, 6 }, 1,
-		SceneManager::create_material({ 0, 0, 1 }, 50, 0.35)));
+		scene.add_material(SceneManager::create_material({ 0, 0, 1 }, 50, 0.35))));
 	// red sphere
 	scene.spheres.push_back(SceneManager::create_sphere({ -1, 0, 6 }, 1,
-		SceneManager::create_material({ 1, 0, 0 }, 100, 0.1), true));
+		scene.add_material(SceneManager::create_material({ 1, 0, 0 }, 100, 0.1)), true));
 	// transparent sphere
 	scene.spheres.push_back(SceneManager::create_sphere({ 0.5, 2, 6 }, 1,
-		SceneManager::create_material({ 1, 1, 1 }, 200, 0.1, 1.125, { 1, 0, 2 }, 1), true));
+		scene.add_material(SceneManager::create_material({ 1, 1, 1 }, 200, 0.1, 1.125, { 1, 0, 2 }, 1)), true));
+
+	// planets and the ring take their color from textures
+	const int planetMaterial = scene.add_material(SceneManager::create_material({}, 0, 0.0f));
 
 	// jupiter
-	rt_sphere jupiter = SceneManager::create_sphere({}, 5000,
-		SceneManager::create_material({}, 0, 0.0f));
+	rt_sphere jupiter = SceneManager::create_sphere({}, 5000, planetMaterial);
 	jupiter.textureNum = 1;
 	scene.spheres.push_back(jupiter);
 	update::jupiter = scene.spheres.size() - 1;
 
 	// saturn
 	const int saturnRadius = 4150;
-	rt_sphere saturn = SceneManager::create_sphere({}, saturnRadius,
-		SceneManager::create_material({}, 0, 0.0f));
+	rt_sphere saturn = SceneManager::create_sphere({}, saturnRadius, planetMaterial);
 	saturn.textureNum = 2;
 	saturn.quat_rotation = saturn_pitch;
 	scene.spheres.push_back(saturn);
 	update::saturn = scene.spheres.size() - 1;
 
 	// mars
-	rt_sphere mars = SceneManager::create_sphere({}, 500,
-		SceneManager::create_material({}, 0, 0.0f));
+	rt_sphere mars = SceneManager::create_sphere({}, 500, planetMaterial);
 	mars.textureNum = 3;
 	scene.spheres.push_back(mars);
 	update::mars = scene.spheres.size() - 1;
 
 	// ring
 	{
-		rt_ring ring = SceneManager::create_ring({}, saturnRadius * 1.1166, saturnRadius * 2.35,
-			SceneManager::create_material({}, 0, 0));
+		rt_ring ring = SceneManager::create_ring({}, saturnRadius * 1.1166, saturnRadius * 2.35, planetMaterial);
 		ring.textureNum = 4;
 		ring.quat_rotation = glm::angleAxis(glm::radians(90.f), glm::vec3(1, 0, 0)) * saturn_pitch;
 		scene.rings.push_back(ring);
@@ -96,25 +245,23 @@ int main()
 
 	// floor
 	scene.boxes.push_back(SceneManager::create_box({ 0, -1.2, 6 }, { 10, 0.2, 5 },
-		SceneManager::create_material({ 1, 0.6, 0 }, 100, 0.05)));
+		scene.add_material(SceneManager::create_material({ 1, 0.6, 0 }, 100, 0.05))));
 	// box
 	rt_box box = SceneManager::create_box({ 8, 1, 6 }, { 1, 1, 1 },
-		SceneManager::create_material({ 0.8,0.7,0 }, 50, 0.0));
+		scene.add_material(SceneManager::create_material({ 0.8,0.7,0 }, 50, 0.0)));
 	box.textureNum = 5;
 	scene.boxes.push_back(box);
 	update::box = scene.boxes.size() - 1;
 
-	// *** beware! torus calculations is the heaviest part of rendering
-	// *** comment next line if you have performance issues
 	// torus
 	rt_torus torus = SceneManager::create_torus({ -9, 0.5, 6 }, { 1.0, 0.5 },
-		SceneManager::create_material({ 0.5, 0.4, 1 }, 200, 0.2));
+		scene.add_material(SceneManager::create_material({ 0.5, 0.4, 1 }, 200, 0.2)));
 	torus.quat_rotation = glm::quat(glm::vec3(glm::radians(45.f), 0, 0));
 	scene.toruses.push_back(torus);
 	update::torus = scene.toruses.size() - 1;
 
 	// cone
-	rt_material coneMaterial = SceneManager::create_material({ 234 / 255.0f, 17 / 255.0f, 82 / 255.0f }, 200, 0.2);
+	const int coneMaterial = scene.add_material(SceneManager::create_material({ 234 / 255.0f, 17 / 255.0f, 82 / 255.0f }, 200, 0.2));
 	rt_surface cone = SurfaceFactory::GetEllipticCone(1 / 3.0f, 1 / 3.0f, 1, coneMaterial);
 	cone.pos = { -5, 4, 6 };
 	cone.quat_rotation = glm::quat(glm::vec3(glm::radians(90.f), 0, 0));
@@ -123,75 +270,162 @@ int main()
 	scene.surfaces.push_back(cone);
 
 	// cylinder
-	rt_material cylinderMaterial = SceneManager::create_material({ 200 / 255.0f, 255 / 255.0f, 0 / 255.0f }, 200, 0.2);
+	const int cylinderMaterial = scene.add_material(SceneManager::create_material({ 200 / 255.0f, 255 / 255.0f, 0 / 255.0f }, 200, 0.2));
 	rt_surface cylinder = SurfaceFactory::GetEllipticCylinder(1 / 2.0f, 1 / 2.0f, cylinderMaterial);
 	cylinder.pos = { 5, 0, 6 };
 	cylinder.quat_rotation = glm::quat(glm::vec3(glm::radians(90.f), 0, 0));
 	cylinder.yMin = -1;
 	cylinder.yMax = 1;
 	scene.surfaces.push_back(cylinder);
+}
 
-	rt_defines defines = scene.get_defines();
-	glWrapper.init_shaders(defines);
+// headless reference render: rt --cpu [frames] [width] [height]
+// writes frame_0000.png, frame_0001.png, ... to the working directory
+int run_cpu(int argc, char* argv[])
+{
+	const int frames = argc > 2 ? atoi(argv[2]) : 1;
+	int width = argc > 3 ? atoi(argv[3]) : wind_width;
+	int height = argc > 4 ? atoi(argv[4]) : wind_height;
 
-	std::vector<std::string> faces =
-	{
-		ASSETS_DIR "/textures/sb_nebula/GalaxyTex_PositiveX.jpg",
-		ASSETS_DIR "/textures/sb_nebula/GalaxyTex_NegativeX.jpg",
-		ASSETS_DIR "/textures/sb_nebula/GalaxyTex_PositiveY.jpg",
-		ASSETS_DIR "/textures/sb_nebula/GalaxyTex_NegativeY.jpg",
-		ASSETS_DIR "/textures/sb_nebula/GalaxyTex_PositiveZ.jpg",
-		ASSETS_DIR "/textures/sb_nebula/GalaxyTex_NegativeZ.jpg"
-	};
-
-	glWrapper.set_skybox(GLWrapper::load_cubemap(faces, false));
-
-	auto jupiterTex = glWrapper.load_texture(1, "8k_jupiter.jpg", "texture_sphere_1");
-	auto saturnTex = glWrapper.load_texture(2, "8k_saturn.jpg", "texture_sphere_2");
-	auto marsTex = glWrapper.load_texture(3, "2k_mars.jpg", "texture_sphere_3");
-	auto ringTex = glWrapper.load_texture(4, "8k_saturn_ring_alpha.png", "texture_ring");
-	auto boxTex = glWrapper.load_texture(5, "container.png", "texture_box");
+	// fix ray direction issues
+	if (width % 2 == 1) width++;
+	if (height % 2 == 1) height++;
 
-	SceneManager scene_manager(wind_width, wind_height, &scene, &glWrapper);
-	scene_manager.init();
+	scene_container scene = {};
+	init_scene(scene, width, height);
+	// SceneManager sets the camera every frame in interactive mode, here it looks straight ahead
+	scene.scene.quat_camera_rotation = glm::quat(1, 0, 0, 0);
 
-	float currentTime = static_cast<float>(glfwGetTime());
-	float lastFramesPrint = currentTime;
-	float framesCount = 0;
+	CpuRenderer renderer(width, height);
+	renderer.set_skybox(skybox_faces());
+	for (const texture_binding& binding : scene_textures())
+		renderer.load_texture(binding.texNum, binding.name);
 
-	while (!glfwWindowShouldClose(glWrapper.window))
+	const float deltaTime = 1.0f / 60;
+	for (int frame = 0; frame < frames; frame++)
 	{
-		framesCount++;
-		float newTime = static_cast<float>(glfwGetTime());
-		float deltaTime = newTime - currentTime;
-		currentTime = newTime;
+		update_scene(scene, deltaTime, frame * deltaTime);
 
-		if (newTime - lastFramesPrint > 1.0f)
+		const auto start = std::chrono::steady_clock::now();
+		renderer.draw(scene);
+		const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+		char path[64];
+		snprintf(path, sizeof(path), "frame_%04d.png", frame);
+		if (!renderer.save(path))
 		{
-			std::cout << "FPS: " << framesCount << std::endl;
-			lastFramesPrint = newTime;
-			framesCount = 0;
+			fprintf(stderr, "Failed to write %s\n", path);
+			return 1;
 		}
+		std::cout << path << ": " << elapsed.count() << " ms" << std::endl;
+	}
+	return 0;
+}
 
-		update_scene(scene, deltaTime, newTime);
-		scene_manager.update(deltaTime);
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, jupiterTex);
-		glActiveTexture(GL_TEXTURE2);
-		glBindTexture(GL_TEXTURE_2D, saturnTex);
-		glActiveTexture(GL_TEXTURE3);
-		glBindTexture(GL_TEXTURE_2D, marsTex);
-		glActiveTexture(GL_TEXTURE4);
-		glBindTexture(GL_TEXTURE_2D, ringTex);
-		glActiveTexture(GL_TEXTURE5);
-		glBindTexture(GL_TEXTURE_2D, boxTex);
-		glWrapper.draw();
-		glfwSwapBuffers(glWrapper.window);
-		glfwPollEvents();
+// offscreen GPU render: rt --headless [frames] [width] [height] [pattern]
+// pattern is a printf format for the frame number, its extension selects the format:
+// .png, .ppm, .raw (8 bit), .pfm or .exr (float); default frame_%04d.png
+// frames are rendered as fast as possible with a fixed 1/60 s step, pixels are read back asynchronously
+// and files are written on background threads
+int run_headless(int argc, char* argv[], Profiler* profiler, int maxSamples, float gpuBudget, bool checkerboard, bool tiles, bool virtualTextures)
+{
+	const int frames = argc > 2 ? atoi(argv[2]) : 1;
+	int width = argc > 3 ? atoi(argv[3]) : wind_width;
+	int height = argc > 4 ? atoi(argv[4]) : wind_height;
+	const std::string pattern = argc > 5 ? argv[5] : "frame_%04d.png";
+	const bool floatOutput = ImageWriter::is_float_format(pattern);
+
+	// fix ray direction issues
+	if (width % 2 == 1) width++;
+	if (height % 2 == 1) height++;
+
+	GLWrapper glWrapper(width, height, false);
+	glWrapper.enable_SMAA(ULTRA);
+	glWrapper.enable_offscreen(floatOutput);
+	if (maxSamples > 0)
+		glWrapper.enable_accumulation(maxSamples);
+	if (gpuBudget > 0)
+		glWrapper.enable_dynamic_resolution(gpuBudget);
+	if (checkerboard)
+		glWrapper.enable_checkerboard();
+	if (tiles)
+		glWrapper.enable_tile_classification();
+	if (virtualTextures)
+		glWrapper.enable_virtual_texturing();
+	if (!glWrapper.init_window())
+	{
+		fprintf(stderr, "Failed to create an offscreen OpenGL context\n");
+		return 1;
 	}
 
-	glWrapper.stop(); // stop glfw, close window
-	return 0;
+	scene_container scene = {};
+	init_scene(scene, width, height);
+
+	rt_defines defines = scene.get_defines();
+	glWrapper.init_shaders(defines);
+	glWrapper.set_skybox(glWrapper.load_cubemap(skybox_faces(), false));
+	load_textures(glWrapper);
+	// frames must not depend on how fast the images decode
+	glWrapper.finish_textures();
+
+	SceneManager scene_manager(width, height, &scene, &glWrapper);
+	scene_manager.init();
+	glWrapper.set_profiler(profiler);
+
+	FrameWriter writer;
+	// pixels are copied out of the mapped buffer so it can be reused right away, encoding happens in the writer
+	FrameReadback readback(width, height, floatOutput, [&](const readback_frame& frame)
+	{
+		char path[512];
+		snprintf(path, sizeof(path), pattern.c_str(), frame.index);
+		const size_t size = static_cast<size_t>(frame.width) * frame.height * 3;
+		if (frame.isFloat)
+		{
+			std::vector<float> rgb(size);
+			FrameReadback::copy_rgb(frame, rgb.data());
+			writer.submit(path, frame.width, frame.height, std::move(rgb));
+		}
+		else
+		{
+			std::vector<unsigned char> rgb(size);
+			FrameReadback::copy_rgb(frame, rgb.data());
+			writer.submit(path, frame.width, frame.height, std::move(rgb));
+		}
+	});
+
+	const float deltaTime = 1.0f / 60;
+	const auto start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; frame++)
+	{
+		if (profiler)
+			profiler->begin_frame();
+		{
+			cpu_scope scope(profiler, "update_scene");
+			update_scene(scene, deltaTime, frame * deltaTime);
+		}
+		{
+			cpu_scope scope(profiler, "SceneManager::update");
+			scene_manager.update(deltaTime);
+		}
+		{
+			cpu_scope scope(profiler, "draw");
+			glWrapper.draw();
+		}
+		cpu_scope scope(profiler, "readback");
+		readback.capture(glWrapper.getOutputFramebuffer(), frame);
+	}
+	readback.flush();
+	writer.wait();
+
+	const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << frames << " frames in " << elapsed.count() << " ms (" << frames * 1000 / elapsed.count() << " fps)" << std::endl;
+	if (gpuBudget > 0)
+		std::cout << "Final render scale: " << glWrapper.getRenderScale() << std::endl;
+
+	if (profiler)
+		profiler->flush(); // query results need the context
+	glWrapper.stop();
+	return writer.get_failed() == 0 ? 0 : 1;
 }
 
 void update_scene(scene_container& scene, float deltaTime, float time)
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+// Host-side copies of the rt.frag math helpers.
+// Quaternions are passed as vec4 (x, y, z, w), the same layout glm::quat has in the uniform buffers.
+namespace rtmath
+{
+	inline glm::vec4 to_vec4(const glm::quat& q)
+	{
+		return glm::vec4(q.x, q.y, q.z, q.w);
+	}
+
+	inline glm::vec4 quat_conj(const glm::vec4& q)
+	{
+		return glm::vec4(-q.x, -q.y, -q.z, q.w);
+	}
+
+	inline glm::vec4 quat_inv(const glm::vec4& q)
+	{
+		return quat_conj(q) * (1 / glm::dot(q, q));
+	}
+
+	inline glm::vec4 quat_mult(const glm::vec4& q1, const glm::vec4& q2)
+	{
+		glm::vec4 qr;
+		qr.x = (q1.w * q2.x) + (q1.x * q2.w) + (q1.y * q2.z) - (q1.z * q2.y);
+		qr.y = (q1.w * q2.y) - (q1.x * q2.z) + (q1.y * q2.w) + (q1.z * q2.x);
+		qr.z = (q1.w * q2.z) + (q1.x * q2.y) - (q1.y * q2.x) + (q1.z * q2.w);
+		qr.w = (q1.w * q2.w) - (q1.x * q2.x) - (q1.y * q2.y) - (q1.z * q2.z);
+		return qr;
+	}
+
+	inline glm::vec3 rotate(const glm::vec4& qr, const glm::vec3& v)
+	{
+		const glm::vec4 qr_conj = quat_conj(qr);
+		const glm::vec4 q_pos = glm::vec4(v, 0);
+		const glm::vec4 q_tmp = quat_mult(qr, q_pos);
+		return glm::vec3(quat_mult(q_tmp, qr_conj));
+	}
+
+	inline glm::vec3 rotate(const glm::quat& qr, const glm::vec3& v)
+	{
+		return rotate(to_vec4(qr), v);
+	}
+
+	// rotate(q, v) of a unit quaternion as a matrix, v * m is the inverse rotation
+	inline glm::mat3 rotation_matrix(const glm::quat& q)
+	{
+		const glm::vec3 q2 = glm::vec3(q.x, q.y, q.z) * 2.0f;
+		const glm::vec3 qq = glm::vec3(q.x, q.y, q.z) * q2;
+		const float xy = q.x * q2.y, xz = q.x * q2.z, yz = q.y * q2.z;
+		const glm::vec3 w = q.w * q2;
+		return glm::mat3(
+			1 - qq.y - qq.z, xy + w.z, xz - w.y,
+			xy - w.z, 1 - qq.x - qq.z, yz + w.x,
+			xz + w.y, yz - w.x, 1 - qq.x - qq.y);
+	}
+}
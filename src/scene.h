@@ -4,19 +4,31 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 
+// What a scene contains, rt.frag is compiled without the code for missing features.
+// Bit values are the SCENE_FEATURES bits tested there
+enum rt_feature
+{
+	FEATURE_SPHERES = 1 << 0,
+	FEATURE_PLANES = 1 << 1,
+	FEATURE_SURFACES = 1 << 2,
+	FEATURE_BOXES = 1 << 3,
+	FEATURE_TORUSES = 1 << 4,
+	FEATURE_RINGS = 1 << 5,
+	FEATURE_INSTANCES = 1 << 6,
+	FEATURE_POINT_LIGHTS = 1 << 7,
+	FEATURE_DIRECT_LIGHTS = 1 << 8,
+	FEATURE_TEXTURES = 1 << 9,
+	FEATURE_REFLECTION = 1 << 10,
+	FEATURE_REFRACTION = 1 << 11,
+	FEATURE_ALL = (1 << 12) - 1
+};
+
 struct rt_defines
 {
-	int sphere_size;
-	int plane_size;
-	int surface_size;
-	int box_size;
-	int torus_size;
-	int ring_size;
-	int light_point_size;
-	int light_direct_size;
 	int iterations;
 	glm::vec3 ambient_color;
 	glm::vec3 shadow_ambient;
+	unsigned features; // rt_feature bits, SceneManager adds the ones the scene gains later
 };
 
 typedef struct {
@@ -34,51 +46,50 @@ typedef struct {
 	float __padding[3];
 } rt_material;
 
+// Primitives refer to their material by index in scene_container::materials,
+// so intersection tests only fetch geometry and the material is read once per hit.
+
 typedef struct {
-	rt_material material;
 	glm::vec4 obj; // pos + radius
 	glm::quat quat_rotation = glm::quat(1, 0, 0, 0);
 	int textureNum;
 	bool hollow;
-	float __padding[2];
+	int material;
+	float __p1;
 } rt_sphere;
 
 typedef struct {
-	rt_material material;
-	glm::vec3 pos; float __p1;
+	glm::vec3 pos; int material;
 	glm::vec3 normal; float __p2;
 } rt_plane;
 
 typedef struct {
-	rt_material mat;
 	glm::quat quat_rotation = glm::quat(1, 0, 0, 0);
-	glm::vec3 pos; float __p1;
+	glm::vec3 pos; int material;
 	glm::vec3 form;
 	int textureNum;
 } rt_box;
 
 typedef struct {
-	rt_material mat;
 	glm::quat quat_rotation = glm::quat(1, 0, 0, 0);
-	glm::vec3 pos; float __p1;
+	glm::vec3 pos; int material;
 	glm::vec2 form; float __p2[2];
 } rt_torus;
 
 typedef struct {
-	rt_material mat;
 	glm::quat quat_rotation = glm::quat(1, 0, 0, 0);
 	glm::vec3 pos; int textureNum;
 	float r1, r2;
-	float __p2[2];
+	int material;
+	float __p2;
 } rt_ring;
 
 typedef struct {
-	rt_material mat;
 	glm::quat quat_rotation = glm::quat(1, 0, 0, 0);
 	float xMin = -FLT_MAX;
 	float yMin = -FLT_MAX;
 	float zMin = -FLT_MAX;
-	float __p0;
+	int material;
 	float xMax = FLT_MAX;
 	float yMax = FLT_MAX;
 	float zMax = FLT_MAX;
@@ -94,6 +105,28 @@ typedef struct {
 	float __padding[3];
 } rt_surface;
 
+// Shape shared by any number of rt_instance, in its own space: centered at the origin, unrotated.
+// type is one of rt.frag's TYPE_SPHERE, TYPE_BOX, TYPE_TORUS
+enum rt_prototype_type { PROTOTYPE_SPHERE = 0, PROTOTYPE_BOX = 3, PROTOTYPE_TORUS = 4 };
+
+typedef struct {
+	glm::vec4 form; // sphere: x - radius, box: xyz - half size, torus: x - radius, y - ring thickness
+	int type;
+	int textureNum;
+	float radius; // bounding sphere, for rejecting rays before the shape test
+	float __p1;
+} rt_prototype;
+
+// Placement of a prototype
+typedef struct {
+	glm::quat quat_rotation = glm::quat(1, 0, 0, 0);
+	glm::vec3 pos;
+	float scale;
+	int prototype;
+	int material;
+	float __padding[2];
+} rt_instance;
+
 typedef enum { sphere, light } primitiveType;
 
 struct rt_light_direct {
@@ -136,19 +169,53 @@ struct scene_container
 	std::vector<rt_box> boxes;
 	std::vector<rt_torus> toruses;
 	std::vector<rt_ring> rings;
+	// instanced objects, prototypes are shared by index
+	std::vector<rt_prototype> prototypes;
+	std::vector<rt_instance> instances;
+	// referred to by index from every primitive and instance
+	std::vector<rt_material> materials;
 	std::vector<rt_light_point> lights_point;
 	std::vector<rt_light_direct> lights_direct;
 
 	rt_defines get_defines()
 	{
-		return { static_cast<int>(spheres.size()),
-			static_cast<int>(planes.size()),
-			static_cast<int>(surfaces.size()),
-			static_cast<int>(boxes.size()),
-			static_cast<int>(toruses.size()),
-			static_cast<int>(rings.size()),
-			static_cast<int>(lights_point.size()),
-			static_cast<int>(lights_direct.size()),
-			scene.reflect_depth, ambient_color, shadow_ambient };
+		return { scene.reflect_depth, ambient_color, shadow_ambient, get_features() };
+	}
+
+	unsigned get_features() const
+	{
+		unsigned features = 0;
+		if (!spheres.empty()) features |= FEATURE_SPHERES;
+		if (!planes.empty()) features |= FEATURE_PLANES;
+		if (!surfaces.empty()) features |= FEATURE_SURFACES;
+		if (!boxes.empty()) features |= FEATURE_BOXES;
+		if (!toruses.empty()) features |= FEATURE_TORUSES;
+		if (!rings.empty()) features |= FEATURE_RINGS;
+		if (!instances.empty()) features |= FEATURE_INSTANCES;
+		if (!lights_point.empty()) features |= FEATURE_POINT_LIGHTS;
+		if (!lights_direct.empty()) features |= FEATURE_DIRECT_LIGHTS;
+
+		for (const rt_sphere& sphere : spheres)
+			if (sphere.textureNum != 0) features |= FEATURE_TEXTURES;
+		for (const rt_box& box : boxes)
+			if (box.textureNum != 0) features |= FEATURE_TEXTURES;
+		for (const rt_ring& ring : rings)
+			if (ring.textureNum != 0) features |= FEATURE_TEXTURES;
+		for (const rt_prototype& prototype : prototypes)
+			if (prototype.textureNum != 0) features |= FEATURE_TEXTURES;
+
+		for (const rt_material& material : materials)
+		{
+			if (material.reflect > 0) features |= FEATURE_REFLECTION;
+			if (material.refract > 0) features |= FEATURE_REFRACTION;
+		}
+		return features;
+	}
+
+	// returns the index primitives refer to it by
+	int add_material(const rt_material& material)
+	{
+		materials.push_back(material);
+		return static_cast<int>(materials.size() - 1);
 	}
 };
\ No newline at end of file
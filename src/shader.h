@@ -9,6 +9,7 @@
 #include <iostream>
 #include <glm/glm.hpp>
 #include "utils.h"
+#include "ProgramCache.h"
 
 class Shader
 {
@@ -59,7 +60,7 @@ public:
 			vertexCode = vShaderStream.str();
 			fragmentCode = fShaderStream.str();
 		}
-		catch (std::ifstream::failure e)
+		catch (std::ifstream::failure & e)
 		{
 			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
 		}
@@ -72,6 +73,12 @@ public:
 	}
 	
 	void initFromSrc(const char* vertexSrc, const char* fragmentSrc) {
+		ID = glCreateProgram();
+		// linked binary from a previous run, skips compilation
+		const std::string cacheKey = ProgramCache::key(vertexSrc, fragmentSrc);
+		if (ProgramCache::load(cacheKey, ID))
+			return;
+
 		// 2. compile shaders
 		unsigned int vertex, fragment;
 		// vertex shader
@@ -85,14 +92,15 @@ public:
 		glCompileShader(fragment);
 		checkCompileErrors(fragment, "FRAGMENT");
 		// shader Program
-		ID = glCreateProgram();
 		glAttachShader(ID, vertex);
 		glAttachShader(ID, fragment);
+		ProgramCache::prepare(ID);
 		glLinkProgram(ID);
 		checkCompileErrors(ID, "PROGRAM");
 		// delete the shaders as they're linked into our program now and no longer necessary
 		glDeleteShader(vertex);
 		glDeleteShader(fragment);
+		ProgramCache::save(cacheKey, ID);
 	}
 
 	// activate the shader
@@ -7,7 +7,7 @@
 #include <fstream>
 #include <sstream>
 
-static void readBytesFromFile(const char* path, std::vector<char> & buffer) {
+static inline void readBytesFromFile(const char* path, std::vector<char> & buffer) {
 	std::ifstream file;
 	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 	try
@@ -26,7 +26,7 @@ static void readBytesFromFile(const char* path, std::vector<char> & buffer) {
 	}
 }
 
-static std::string readStringFromFile(const char* path) {
+static inline std::string readStringFromFile(const char* path) {
 	std::string content;
 	std::ifstream file;
 	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
@@ -46,7 +46,7 @@ static std::string readStringFromFile(const char* path) {
 	return content;
 }
 
-static bool replace(std::string& str, const std::string& from, const std::string& to) {
+static inline bool replace(std::string& str, const std::string& from, const std::string& to) {
 	size_t start_pos = str.find(from);
 	if (start_pos == std::string::npos)
 		return false;
@@ -54,7 +54,7 @@ static bool replace(std::string& str, const std::string& from, const std::string
 	return true;
 }
 
-static void checkGlErrors(std::string desc)
+static inline void checkGlErrors(std::string desc)
 {
 	GLenum e = glGetError();
 	if (e != GL_NO_ERROR) {